@@ -0,0 +1,115 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Cube string escaping benchmark
+//
+// Compares the two-pass path (convertCubeToUTF8() into a temporary
+// buffer, then escaping the UTF-8 string) with the fused single-pass
+// encoder used by ElementPrinter::printCubeString().
+//
+// Usage: bench/cubestring [iterations]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include "plugins/web/elementprinter.h"
+
+using namespace web;
+
+namespace {
+
+struct Input {
+  const char *name;
+  const char *str;
+};
+
+const Input inputs[] = {
+  {"short name", "player123"},
+  {"clan name", "[RB]Dr.Brown"},
+  {"description", "\f3Server \f7#42 <Duel & Clanwar> \f2www.example.org"},
+  {"long ascii", "Welcome to the best insta ctf server in the world, have fun and play fair"},
+  {"escapes", "<<\"&&\">> \"quoted\" <tag> & more & more & more"},
+  {"non-ascii", "\x83\x84\x85\x86\x87 \x90\x91\x92\x93\x94\x95 \xc0\xc1\xc2\xc3\xc4\xc5"},
+};
+
+template <typename Fun>
+double measure(const Format format, const size_t iterations, Fun fun) {
+  FString content;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; ++i) {
+    content.clear();
+    ElementPrinter elementPrinter(content, format);
+    fun(elementPrinter);
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+void run(const Input &input, const Format format, const size_t iterations) {
+  // 64 elements per iteration to make the printer setup cost negligible
+  constexpr size_t elements = 64;
+
+  auto twoPass = [&](ElementPrinter &elementPrinter) {
+    for (size_t i = 0; i < elements; ++i) {
+      char buf[256];
+      elementPrinter.printElement("x", convertCubeToUTF8(input.str, buf));
+    }
+  };
+
+  auto fused = [&](ElementPrinter &elementPrinter) {
+    for (size_t i = 0; i < elements; ++i) elementPrinter.printCubeString("x", input.str);
+  };
+
+  const double twoPassNs = measure(format, iterations, twoPass) / elements;
+  const double fusedNs = measure(format, iterations, fused) / elements;
+
+  std::printf("%-4s %-12s %3zu bytes  two-pass %7.1f ns  fused %7.1f ns  %5.2fx\n",
+              format == Format::XML ? "xml" : "json", input.name, std::strlen(input.str), twoPassNs, fusedNs,
+              twoPassNs / fusedNs);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  const size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+
+  if (!iterations) {
+    std::fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+#if defined(__AVX2__)
+  std::printf("simd: avx2\n");
+#elif defined(__SSE2__)
+  std::printf("simd: sse2\n");
+#else
+  std::printf("simd: none\n");
+#endif
+
+  for (const Format format : {Format::XML, Format::JSON})
+    for (const Input &input : inputs) run(input, format, iterations);
+
+  return 0;
+}
@@ -0,0 +1,454 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// HTTP load generator
+//
+// Drives the web plugin with a number of keep-alive connections, each
+// sending one request at a time from a weighted mix of URLs, and reports
+// throughput and p50/p99/p999 latency, overall and per URL.
+//
+// The core is not started by this tool, it connects to an instance that
+// is already running. Before starting it, enable extinfo.simulation in
+// cube_server_browser.cfg and disable httpd.enableRateLimit in
+// plugins/web-plugin.cfg (all connections come from the same address).
+// The core reads both from fixed paths in its working directory, so
+// they cannot be generated and passed in here.
+//
+// Usage: bench/httpload [-h host] [-p port] [-c connections] [-d seconds]
+//                       [-w warm-up seconds] [-z] [-u weight:path]...
+//
+//   -z  request gzip compressed responses
+//   -u  add a URL to the mix, e.g. -u 5:/players?format=json
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <strings.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct URL {
+  unsigned weight;
+  std::string path;
+};
+
+const URL DEFAULT_MIX[] = {
+  {40, "/servers?format=json"},
+  {10, "/servers?format=json&fields=description,clients,mapname"},
+  {25, "/players?format=json"},
+  {15, "/players?format=json&sort=frags&limit=20"},
+  {5, "/findplayer?format=json&name=ka"},
+  {5, "/info?format=json"}
+};
+
+struct Options {
+  const char *host = "127.0.0.1";
+  const char *port = "8080";
+  unsigned connections = 16;
+  unsigned duration = 10;
+  unsigned warmUp = 2;
+  bool gzip = false;
+  std::vector<URL> mix;
+};
+
+struct Results {
+  std::vector<std::vector<uint32_t>> latencies; // Microseconds, per URL
+  uint64_t statusClasses[6] = {}; // 1xx - 5xx, [0]: anything else
+  uint64_t rateLimited = 0;       // 429
+  uint64_t bytes = 0;             // Bodies only
+  uint64_t errors = 0;
+};
+
+//
+// Connection
+//
+
+class Connection {
+public:
+  explicit Connection(const addrinfo *address) : address(address) {}
+  ~Connection() { disconnect(); }
+
+  // Returns the status code or -1 on error
+  int request(const std::string &request, size_t &bodySize) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      // The server may have closed an idle connection in the
+      // meantime, retry once on a fresh connection in that case.
+      const bool reused = fd >= 0;
+
+      if (!reused && !connect()) return -1;
+
+      const int status = send(request) ? receive(bodySize) : -1;
+      if (status >= 0 || !reused) return status;
+
+      disconnect();
+    }
+
+    return -1;
+  }
+
+private:
+  const addrinfo *address;
+  int fd = -1;
+  std::string buffer;
+  size_t pos = 0; // Consumed part of buffer
+  bool keepAlive = true;
+
+  bool connect() {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) return false;
+
+    const int one = 1;
+    timeval timeout{10, 0};
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (::connect(fd, address->ai_addr, address->ai_addrlen)) {
+      disconnect();
+      return false;
+    }
+
+    return true;
+  }
+
+  void disconnect() {
+    if (fd >= 0) close(fd);
+    fd = -1;
+    buffer.clear();
+    pos = 0;
+  }
+
+  bool send(const std::string &data) {
+    for (size_t sent = 0; sent < data.size();) {
+      const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) return false;
+      sent += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  bool fill() {
+    if (pos && pos == buffer.size()) {
+      buffer.clear();
+      pos = 0;
+    } else if (pos > 65536) {
+      buffer.erase(0, pos);
+      pos = 0;
+    }
+
+    char data[16384];
+    const ssize_t n = recv(fd, data, sizeof(data), 0);
+    if (n <= 0) return false;
+
+    buffer.append(data, static_cast<size_t>(n));
+    return true;
+  }
+
+  bool readLine(std::string &line) {
+    size_t end;
+
+    while ((end = buffer.find("\r\n", pos)) == std::string::npos) {
+      if (!fill()) return false;
+    }
+
+    line.assign(buffer, pos, end - pos);
+    pos = end + 2;
+    return true;
+  }
+
+  bool skip(const size_t size) {
+    while (buffer.size() - pos < size) {
+      if (!fill()) return false;
+    }
+
+    pos += size;
+    return true;
+  }
+
+  int receive(size_t &bodySize) {
+    std::string line;
+    int status;
+
+    if (!readLine(line) || std::sscanf(line.c_str(), "HTTP/%*u.%*u %d", &status) != 1) return -1;
+
+    bool chunked = false;
+    bool haveContentLength = false;
+    size_t contentLength = 0;
+
+    keepAlive = true;
+
+    while (readLine(line)) {
+      if (line.empty()) break;
+
+      const char *value = std::strchr(line.c_str(), ':');
+      if (!value) continue;
+
+      const size_t nameLength = static_cast<size_t>(value - line.c_str());
+      for (++value; *value == ' '; ++value) {}
+
+      auto isHeader = [&](const char *name) {
+        return nameLength == std::strlen(name) && !strncasecmp(line.c_str(), name, nameLength);
+      };
+
+      if (isHeader("Content-Length")) {
+        contentLength = std::strtoul(value, nullptr, 10);
+        haveContentLength = true;
+      } else if (isHeader("Transfer-Encoding")) {
+        chunked = strcasestr(value, "chunked") != nullptr;
+      } else if (isHeader("Connection")) {
+        keepAlive = strcasestr(value, "close") == nullptr;
+      }
+    }
+
+    if (!line.empty()) return -1;
+
+    bodySize = 0;
+
+    if (chunked) {
+      for (;;) {
+        if (!readLine(line)) return -1;
+        const size_t chunkSize = std::strtoul(line.c_str(), nullptr, 16);
+
+        if (!chunkSize) {
+          // Trailer
+          do { if (!readLine(line)) return -1; } while (!line.empty());
+          break;
+        }
+
+        if (!skip(chunkSize) || !readLine(line)) return -1;
+        bodySize += chunkSize;
+      }
+    } else if (haveContentLength) {
+      if (!skip(contentLength)) return -1;
+      bodySize = contentLength;
+    } else {
+      // Delimited by the end of the connection
+      bodySize = buffer.size() - pos;
+      while (fill()) bodySize = buffer.size() - pos;
+      keepAlive = false;
+    }
+
+    if (!keepAlive) disconnect();
+
+    return status;
+  }
+};
+
+//
+// Load Generation
+//
+
+// xorshift64*
+uint64_t nextRandom(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Dull;
+}
+
+void runConnection(const addrinfo *address, const std::vector<std::string> &requests,
+                   const std::vector<unsigned> &cumulativeWeights, const Clock::time_point measureStart,
+                   const std::atomic<bool> &stop, uint64_t random, Results &results) {
+  Connection connection(address);
+  size_t bodySize;
+
+  results.latencies.resize(requests.size());
+
+  while (!stop.load(std::memory_order_relaxed)) {
+    const unsigned r = static_cast<unsigned>(nextRandom(random) % cumulativeWeights.back());
+    const size_t url = std::upper_bound(cumulativeWeights.begin(), cumulativeWeights.end(), r) -
+                       cumulativeWeights.begin();
+
+    const Clock::time_point start = Clock::now();
+    const int status = connection.request(requests[url], bodySize);
+    const Clock::time_point end = Clock::now();
+
+    if (status < 0) {
+      if (end >= measureStart) ++results.errors;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+
+    if (end < measureStart) continue;
+
+    const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+    results.latencies[url].push_back(static_cast<uint32_t>(std::min<decltype(latency)>(latency, UINT32_MAX)));
+    ++results.statusClasses[status >= 100 && status < 600 ? status / 100 : 0];
+    if (status == 429) ++results.rateLimited;
+    results.bytes += bodySize;
+  }
+}
+
+double percentile(const std::vector<uint32_t> &sorted, const double p) {
+  if (sorted.empty()) return 0;
+  const size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size()));
+  return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+void printLatencies(const char *name, std::vector<uint32_t> &latencies, const double seconds) {
+  std::sort(latencies.begin(), latencies.end());
+
+  std::printf("%10zu %10.1f %9.2f %9.2f %9.2f %9.2f  %s\n", latencies.size(), latencies.size() / seconds,
+              percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+              latencies.empty() ? 0.0 : latencies.back() / 1000.0, name);
+}
+
+bool addURL(Options &options, const char *str) {
+  char *end;
+  const unsigned long weight = std::strtoul(str, &end, 10);
+
+  if (!weight || *end != ':' || end[1] != '/') return false;
+
+  options.mix.push_back({static_cast<unsigned>(weight), end + 1});
+  return true;
+}
+
+int usage(const char *argv0) {
+  std::fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+                       "[-w warm-up seconds] [-z] [-u weight:path]...\n\n"
+                       "Connects to a running core. Start it with extinfo.simulation enabled\n"
+                       "and httpd.enableRateLimit disabled.\n", argv0);
+  return 1;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h:p:c:d:w:zu:")) != -1) {
+    switch (opt) {
+    case 'h': options.host = optarg; break;
+    case 'p': options.port = optarg; break;
+    case 'c': options.connections = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+    case 'd': options.duration = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+    case 'w': options.warmUp = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+    case 'z': options.gzip = true; break;
+    case 'u':
+      if (!addURL(options, optarg)) return usage(argv[0]);
+      break;
+    default: return usage(argv[0]);
+    }
+  }
+
+  if (!options.connections || !options.duration) {
+    std::fprintf(stderr, "connections and duration must be > 0\n");
+    return 1;
+  }
+
+  if (options.mix.empty()) options.mix.assign(std::begin(DEFAULT_MIX), std::end(DEFAULT_MIX));
+
+  addrinfo hints{};
+  addrinfo *address;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (const int error = getaddrinfo(options.host, options.port, &hints, &address)) {
+    std::fprintf(stderr, "cannot resolve %s:%s: %s\n", options.host, options.port, gai_strerror(error));
+    return 1;
+  }
+
+  std::vector<std::string> requests;
+  std::vector<unsigned> cumulativeWeights;
+
+  for (const URL &url : options.mix) {
+    requests.push_back("GET " + url.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n" +
+                       (options.gzip ? "Accept-Encoding: gzip\r\n" : "") + "\r\n");
+    cumulativeWeights.push_back((cumulativeWeights.empty() ? 0 : cumulativeWeights.back()) + url.weight);
+  }
+
+  std::printf("%s:%s, %u connections, %u s warm-up, %u s measurement%s\n", options.host, options.port,
+              options.connections, options.warmUp, options.duration, options.gzip ? ", gzip" : "");
+
+  std::vector<Results> results(options.connections);
+  std::vector<std::thread> threads;
+  std::atomic<bool> stop{false};
+  const Clock::time_point measureStart = Clock::now() + std::chrono::seconds(options.warmUp);
+  const uint64_t seed = static_cast<uint64_t>(Clock::now().time_since_epoch().count());
+
+  for (unsigned i = 0; i < options.connections; ++i) {
+    threads.emplace_back(runConnection, address, std::cref(requests),
+                         std::cref(cumulativeWeights), measureStart, std::cref(stop),
+                         (seed + i) * 0x9E3779B97F4A7C15ull | 1, std::ref(results[i]));
+  }
+
+  std::this_thread::sleep_until(measureStart + std::chrono::seconds(options.duration));
+  stop = true;
+  const double seconds = std::chrono::duration<double>(Clock::now() - measureStart).count();
+
+  for (std::thread &thread : threads) thread.join();
+  freeaddrinfo(address);
+
+  // Merge
+  Results total;
+  std::vector<uint32_t> all;
+
+  total.latencies.resize(requests.size());
+
+  for (Results &result : results) {
+    for (size_t i = 0; i < requests.size(); ++i) {
+      total.latencies[i].insert(total.latencies[i].end(), result.latencies[i].begin(), result.latencies[i].end());
+      all.insert(all.end(), result.latencies[i].begin(), result.latencies[i].end());
+    }
+
+    for (size_t i = 0; i < 6; ++i) total.statusClasses[i] += result.statusClasses[i];
+    total.rateLimited += result.rateLimited;
+    total.bytes += result.bytes;
+    total.errors += result.errors;
+  }
+
+  std::printf("\n%10s %10s %9s %9s %9s %9s  (latencies in ms)\n", "requests", "req/s", "p50", "p99", "p999", "max");
+
+  for (size_t i = 0; i < requests.size(); ++i) printLatencies(options.mix[i].path.c_str(), total.latencies[i], seconds);
+  printLatencies("all", all, seconds);
+
+  std::printf("\nbody throughput: %.2f MiB/s\n", total.bytes / seconds / (1024 * 1024));
+  std::printf("status: 2xx: %llu, 3xx: %llu, 4xx: %llu (429: %llu), 5xx: %llu, other: %llu, errors: %llu\n",
+              static_cast<unsigned long long>(total.statusClasses[2]),
+              static_cast<unsigned long long>(total.statusClasses[3]),
+              static_cast<unsigned long long>(total.statusClasses[4]),
+              static_cast<unsigned long long>(total.rateLimited),
+              static_cast<unsigned long long>(total.statusClasses[5]),
+              static_cast<unsigned long long>(total.statusClasses[0] + total.statusClasses[1]),
+              static_cast<unsigned long long>(total.errors));
+
+  if (total.rateLimited) std::printf("note: requests were rate limited, set httpd.enableRateLimit = false\n");
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Master list parsing microbenchmark
+//
+// Compares the previous sscanf() based line parser with
+// MasterListTokenizer on a generated master server list.
+//
+// Usage: bench/masterlist [lines] [iterations]
+//
+
+#include <cstdio>
+#include <chrono>
+#include "extinfo-masterlist.h"
+
+using namespace extinfo;
+
+namespace {
+
+std::string generateList(const size_t numLines) {
+  std::string list;
+  char line[128];
+
+  for (size_t i = 0; i < numLines; ++i) {
+    if (i % 50 == 49) {
+      // Some master servers send additional data.
+      std::snprintf(line, sizeof(line), "addserver play%zu.example.org 28785 1 \"Server %zu\"\n", i, i);
+    } else {
+      std::snprintf(line, sizeof(line), "addserver %zu.%zu.%zu.%zu %zu\n", 10 + (i >> 24 & 0xFF), i >> 16 & 0xFF,
+                    i >> 8 & 0xFF, i & 0xFF, 28785 + i % 100);
+    }
+    list += line;
+  }
+
+  return list;
+}
+
+size_t parseSScanf(const std::string &list, uint64_t &checksum) {
+  char command[120];
+  char serverHost[120];
+  int serverPort;
+  const char *p = list.c_str();
+  size_t numServers = 0;
+
+  while (true) {
+    if (std::sscanf(p, "%119s %119s %d", command, serverHost, &serverPort) < 3) goto next;
+    if (std::strcmp(command, "addserver") || serverPort < 0 || serverPort > 0xFFFF) goto next;
+    {
+      uint32_t ip = 0;
+      network::parseIPv4Address(serverHost, std::strlen(serverHost), ip);
+      checksum += ip + serverPort;
+    }
+    ++numServers;
+    next:;
+    p = std::strchr(p, '\n');
+    if (!p || !*++p) break;
+  }
+
+  return numServers;
+}
+
+size_t parseTokenizer(const std::string &list, uint64_t &checksum) {
+  MasterListTokenizer tokenizer(list);
+  MasterListEntry entry;
+  size_t numServers = 0;
+
+  while (tokenizer.next(entry)) {
+    checksum += (entry.isIPv4 ? entry.ip : 0) + entry.port;
+    ++numServers;
+  }
+
+  return numServers;
+}
+
+template <typename F> void run(const char *name, F parse, const std::string &list, const size_t iterations) {
+  uint64_t checksum = 0;
+  size_t numServers = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) numServers = parse(list, checksum);
+  const auto end = std::chrono::steady_clock::now();
+
+  const double ms = std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+
+  std::printf("%-10s %8zu servers  %9.3f ms/list  %8.1f ns/line  (checksum %llu)\n", name, numServers, ms,
+              ms * 1e6 / numServers, static_cast<unsigned long long>(checksum));
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  const size_t numLines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+  const size_t iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20;
+
+  if (!numLines || !iterations) {
+    std::fprintf(stderr, "usage: %s [lines] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  const std::string list = generateList(numLines);
+
+  std::printf("%zu lines, %zu bytes, %zu iterations\n", numLines, list.length(), iterations);
+
+  run("sscanf", parseSScanf, list, iterations);
+  run("tokenizer", parseTokenizer, list, iterations);
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Web response format benchmark
+//
+// Renders a generated server and player list with the web plugin's
+// ElementPrinter as XML and as JSON and compares render time,
+// response size and gzipped response size. The fields mirror
+// serverInfo() and playerInfo() in plugins/web/web.cpp.
+//
+// Usage: bench/webformat [servers] [players per server] [iterations]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "plugins/web/elementprinter.h"
+
+using namespace web;
+
+namespace {
+
+struct BenchPlayer {
+  char name[16];
+  char team[16];
+  int frags, flags, deaths, teamkills, accuracy, health, armour, gun, priv, state, ping, cn;
+  uint64_t onlineTime;
+  uint64_t uid;
+};
+
+struct BenchServer {
+  char description[120]; // UTF-8, like Server::descriptionUTF8
+  char mapName[60];
+  char host[32];
+  uint32_t hostLong;
+  int port, protocol, numPlayers, maxPlayers, gameMode, masterMode, ping, secondsLeft, uptime;
+  std::vector<BenchPlayer> players;
+};
+
+std::vector<BenchServer> generateServers(const size_t numServers, const size_t numPlayers) {
+  static const char *const maps[] = {"complex", "ot", "turbine", "hashi", "reissen", "frozen"};
+  std::vector<BenchServer> servers(numServers);
+  uint64_t uid = 0;
+
+  for (size_t i = 0; i < numServers; ++i) {
+    BenchServer &s = servers[i];
+    char description[60];
+    std::snprintf(description, sizeof(description), "\f3Server \f7#%zu <Duel & Clanwar>", i);
+    convertCubeToUTF8(static_cast<const char *>(description), s.description);
+    std::snprintf(s.mapName, sizeof(s.mapName), "%s", maps[i % sizeofarray(maps)]);
+    std::snprintf(s.host, sizeof(s.host), "10.%zu.%zu.%zu", i >> 16 & 0xFF, i >> 8 & 0xFF, i & 0xFF);
+    s.hostLong = 0x0A000000 | static_cast<uint32_t>(i);
+    s.port = 28785 + i % 10;
+    s.protocol = 260;
+    s.numPlayers = numPlayers;
+    s.maxPlayers = 16;
+    s.gameMode = i % 12;
+    s.masterMode = i % 4;
+    s.ping = 20 + i % 200;
+    s.secondsLeft = 600 - i % 600;
+    s.uptime = 3600 * (i % 48);
+    s.players.resize(numPlayers);
+
+    for (size_t j = 0; j < numPlayers; ++j) {
+      BenchPlayer &p = s.players[j];
+      std::snprintf(p.name, sizeof(p.name), "player%u", static_cast<unsigned>(j % 10000));
+      std::snprintf(p.team, sizeof(p.team), "%s", j & 1 ? "good" : "evil");
+      p.frags = j * 3;
+      p.flags = j % 3;
+      p.deaths = j * 2;
+      p.teamkills = j % 2;
+      p.accuracy = 20 + j % 50;
+      p.health = 100;
+      p.armour = 50;
+      p.gun = j % 7;
+      p.priv = 0;
+      p.state = 0;
+      p.ping = 30 + j;
+      p.cn = j;
+      p.onlineTime = 1000 * 60 * j;
+      p.uid = ++uid;
+    }
+  }
+
+  return servers;
+}
+
+void serverInfo(const BenchServer &s, ElementPrinter &elementPrinter, const char *node = "server") {
+  ShortString timeLeft;
+  std::snprintf(timeLeft, sizeof(timeLeft), "%02d:%02d", s.secondsLeft / 60, s.secondsLeft % 60);
+
+  NodePrinter nodePrinter(elementPrinter, node);
+
+  elementPrinter.printElement("protocol", s.protocol);
+  elementPrinter.printCubeString("release", "Collect Edition");
+  elementPrinter.printElement("description", s.description);
+  elementPrinter.printElement("clients", s.numPlayers);
+  elementPrinter.printElement("maxplayers", s.maxPlayers);
+  elementPrinter.printElement("gamemodeint", s.gameMode);
+  elementPrinter.printCubeString("gamemode", "instactf");
+  elementPrinter.printElement("mastermodeint", s.masterMode);
+  elementPrinter.printElement("mastermode", "veto");
+  elementPrinter.printElement("mapname", s.mapName);
+  elementPrinter.printCubeString("host", s.host);
+  elementPrinter.printElement("hostlong", s.hostLong);
+  elementPrinter.printElement("port", s.port);
+  elementPrinter.printElement("ping", s.ping);
+  elementPrinter.printElement("gamespeed", 100);
+  elementPrinter.printElement("gamepaused", 0);
+  elementPrinter.printElement("timeleftint", s.secondsLeft);
+  elementPrinter.printElement("timeleft", timeLeft);
+  elementPrinter.printCubeString("country", "Germany");
+  elementPrinter.printCubeString("countrycode", "DE");
+
+  {
+    NodePrinter nodePrinter(elementPrinter, "extended");
+    elementPrinter.printElement("uptime", s.uptime);
+    elementPrinter.printCubeString("servermod", "zeromod");
+    elementPrinter.printElement("servermodid", -8);
+    elementPrinter.printElement("lastupdate", 1234);
+  }
+
+  elementPrinter.printElement("lastupdate", 567);
+}
+
+void playerInfo(const BenchPlayer &p, ElementPrinter &elementPrinter) {
+  NodePrinter nodePrinter(elementPrinter, "player");
+
+  elementPrinter.printElement("name", p.name);
+  elementPrinter.printElement("team", p.team);
+  elementPrinter.printElement("frags", p.frags);
+  elementPrinter.printElement("flags", p.flags);
+  elementPrinter.printElement("deaths", p.deaths);
+  elementPrinter.printElement("teamkills", p.teamkills);
+  elementPrinter.printElement("accuracy", p.accuracy);
+  elementPrinter.printElement("health", p.health);
+  elementPrinter.printElement("armour", p.armour);
+  elementPrinter.printElement("gunselect", p.gun);
+  elementPrinter.printElement("priv", p.priv);
+  elementPrinter.printElement("state", p.state);
+  elementPrinter.printElement("ping", p.ping);
+  elementPrinter.printElement("clientnum", p.cn);
+  elementPrinter.printCubeString("country", "Germany");
+  elementPrinter.printCubeString("countrycode", "DE");
+  elementPrinter.printElement("onlinetime", p.onlineTime);
+  elementPrinter.printElement("lastupdate", 250);
+  elementPrinter.printElement("sessionid", p.uid % 100000);
+  elementPrinter.printElement("uid", p.uid);
+}
+
+// Same structure as /players without a server parameter
+void render(FString &content, const Format format, const std::vector<BenchServer> &servers) {
+  ElementPrinter elementPrinter(content, format);
+  NodePrinter nodePrinter(elementPrinter, "players");
+  ListPrinter listPrinter(elementPrinter, "servers");
+
+  for (const BenchServer &server : servers) {
+    NodePrinter nodePrinter(elementPrinter, "server");
+    serverInfo(server, elementPrinter, "info");
+    ListPrinter listPrinter(elementPrinter, "players");
+    for (const BenchPlayer &player : server.players) playerInfo(player, elementPrinter);
+  }
+}
+
+void run(const char *name, const Format format, const std::vector<BenchServer> &servers, const size_t iterations) {
+  FString content;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; ++i) {
+    content.clear();
+    render(content, format, servers);
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+  const double ms = std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+
+  std::string compressed;
+  size_t length = compressBufSize(content.length());
+  compressed.resize(length);
+  if (!compress(&compressed[0], length, content.data(), content.length(), 5, true)) length = 0;
+
+  std::printf("%-5s %9.3f ms/response  %9zu bytes  %8zu bytes gzipped\n", name, ms, content.length(), length);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  const size_t numServers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 500;
+  const size_t numPlayers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+  const size_t iterations = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 50;
+
+  if (!numServers || !iterations) {
+    std::fprintf(stderr, "usage: %s [servers] [players per server] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  const std::vector<BenchServer> servers = generateServers(numServers, numPlayers);
+
+  std::printf("%zu servers, %zu players per server, %zu iterations\n", numServers, numPlayers, iterations);
+
+  run("xml", Format::XML, servers, iterations);
+  run("json", Format::JSON, servers, iterations);
+
+  return 0;
+}
@@ -53,8 +53,8 @@
 #define SIGPIPE 13
 #endif
 
-#ifndef S_ISREG
-#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
 #endif
 
 #ifdef _MSC_VER
@@ -77,6 +77,10 @@ typedef intptr_t ssize_t;
 #define getcwd _getcwd
 #define strcasestr StrStrI
 
+// Symbolic links are not supported
+#define lstat stat
+#define S_ISLNK(mode) 0
+
 #ifdef __cplusplus
 extern "C" {
 #endif
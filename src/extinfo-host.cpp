@@ -22,7 +22,10 @@
 #include "geoip.h"
 #include "extinfo.h"
 #include "extinfo-internal.h"
+#include "extinfo-masterlist.h"
+#include "resolver.h"
 #include <cassert>
+#include <algorithm>
 #include <sys/stat.h>
 
 #ifndef _MSC_VER
@@ -42,26 +45,75 @@ size_t ExtInfoHost::getPlayerCount() const {
   return numPlayers;
 }
 
+namespace {
+
+bool playerMatches(const FindPlayer &findPlayer, const Player &player) {
+  // Always check integer variables before
+  // string variables, StrCmp (class) may invoke
+  // invoke function calls.
+
+  if (!findPlayer.cn.match(player.cn) || !findPlayer.frags.match(player.frags) ||
+      !findPlayer.deaths.match(player.deaths) || !findPlayer.accuracy.match(player.accuracy)) return false;
+
+  if (findPlayer.country.isSet()) {
+    const char *playerCountry = player.info.getCountry(findPlayer.country.valLength() <= 2);
+    if (!findPlayer.country.match(playerCountry)) return false;
+  }
+
+  return findPlayer.name.match(player.getName());
+}
+
+// All players matching the name must contain it (case-insensitive)
+bool canUsePlayerNameIndex(const StrCmp &name) {
+  if (!name.isSet()) return false;
+
+  switch (name.getOp()) {
+  case STRCMP_OP_CONTAINS_CASE_INSENSITIVE:
+  case STRCMP_OP_CONTAINS:
+  case STRCMP_OP_EQUAL_CASE_INSENSITIVE:
+  case STRCMP_OP_EQUAL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+} // anonymous namespace
+
 void ExtInfoHost::findPlayer(const FindPlayer &findPlayer, FindPlayerCallback callback, void *callbackData) const {
-  for (const Server *server : servers) {
-    if (!server->infoOK) continue;
+  typedef PlayerNameIndex::Entry Entry;
+  std::vector<Entry> candidates;
 
-    for (const Player &player : server->players) {
-      // Always check integer variables before
-      // string variables, StrCmp (class) may invoke
-      // invoke function calls.
+  if (!canUsePlayerNameIndex(findPlayer.name) || !playerNameIndex.find(findPlayer.name.getVal(), candidates)) {
+    for (const Server *server : servers) {
+      if (!server->infoOK) continue;
 
-      if (!findPlayer.cn.match(player.cn) || !findPlayer.frags.match(player.frags) ||
-          !findPlayer.deaths.match(player.deaths) || !findPlayer.accuracy.match(player.accuracy)) continue;
+      for (const Player &player : server->players)
+        if (playerMatches(findPlayer, player)) callback(server, player, callbackData);
+    }
 
-      if (findPlayer.country.isSet()) {
-        const char *playerCountry = player.info.getCountry(findPlayer.country.valLength() <= 2);
-        if (!findPlayer.country.match(playerCountry)) continue;
-      }
-  
-      if (!findPlayer.name.match(player.getName())) continue;
+    return;
+  }
+
+  if (candidates.empty()) return;
+
+  // Keep the order of a full scan: servers first, then players
+  auto less = [](const Entry &a, const Entry &b) {
+    return a.server != b.server ? std::less<const Server *>()(a.server, b.server) : a.sessionID < b.sessionID;
+  };
+
+  std::sort(candidates.begin(), candidates.end(), less);
+
+  for (const Server *server : servers) {
+    if (!server->infoOK) continue;
 
-      callback(server, player, callbackData);
+    auto range = std::equal_range(candidates.begin(), candidates.end(), Entry{server, 0},
+                                  [](const Entry &a, const Entry &b) { return std::less<const Server *>()(a.server, b.server); });
+    if (range.first == range.second) continue;
+
+    for (const Player &player : server->players) {
+      if (!std::binary_search(range.first, range.second, Entry{server, player.info.sessionID}, less)) continue;
+      if (playerMatches(findPlayer, player)) callback(server, player, callbackData);
     }
   }
 }
@@ -77,7 +129,7 @@ int ExtInfoHost::addServer(const char *serverHost, const network::Address &addre
 
   if (server) {
     server->shouldBeDeleted = false;
-    server->serverHost = serverHost;
+    if (server->serverHost != serverHost) server->serverHost = serverHost;
     if (persist) server->persist = true;
     return 2;
   }
@@ -90,17 +142,69 @@ int ExtInfoHost::addServer(const char *serverHost, const network::Address &addre
   for (uint64_t &randomNumber : server->randomNumbers) randomNumber = getRandomNumber();
   event(SERVER_ADD, {server});
   servers.push_back(server);
+  server->infoChanged();
 
   return 1;
 }
 
+namespace {
+
+void serverHostResolved(const resolver::Request &request, const bool ok) {
+  ExtInfoHost *host = static_cast<ExtInfoHost *>(request.callbackData);
+
+  if (!ok) {
+    dbg << host->info.game << ": cannot resolve '" << request.hostName << "'" << dbg.endl();
+    return;
+  }
+
+  LockGuard(&host->mutex);
+  host->addServer(request.hostName.c_str(), request.address, request.callbackFlags != 0);
+}
+
+} // anonymous namespace
+
+int ExtInfoHost::resolveAndAddServer(const char *serverHost, const uint16_t serverPort, bool persist) {
+  network::Address serverAddress;
+  serverAddress.port = serverPort;
+
+  switch (resolver::resolve(serverHost, serverAddress, serverHostResolved, this, persist)) {
+  case resolver::RESOLVED:
+    return addServer(serverHost, serverAddress, persist);
+  case resolver::PENDING:
+    // Keep servers which are already known by this name
+    // alive until the resolver reports back.
+    for (Server *server : servers)
+      if (server->serverHost == serverHost && server->address.port - info.infoPortOffset == serverPort)
+        server->shouldBeDeleted = false;
+    return -1;
+  case resolver::FAILED:;
+  }
+
+  return 0;
+}
+
 void ExtInfoHost::deleteServer(decltype(servers)::iterator server) {
   (*server)->deleteAllPlayers();
   event(SERVER_DELETE, {*server});
+  addTombstone((*server)->address);
   delete *server;
   servers.erase(server);
 }
 
+uint64_t ExtInfoHost::addTombstone(const network::Address &address, const uint64_t sessionID) {
+  if (tombstones.size() >= MAX_TOMBSTONES) {
+    tombstoneHorizon = tombstones.front().generation;
+    tombstones.pop_front();
+  }
+
+  tombstones.push_back({++generation, address, sessionID});
+  return generation;
+}
+
+bool ExtInfoHost::isDeltaPossible(const uint64_t since) const {
+  return since >= tombstoneHorizon && since <= generation;
+}
+
 size_t ExtInfoHost::deleteOrphanedServers() {
   size_t numDeletedServers = 0;
 
@@ -118,6 +222,17 @@ void ExtInfoHost::markAllNonPersistServersForDeletion() {
   for (Server *server : servers) if (!server->persist) server->shouldBeDeleted = true;
 }
 
+void ExtInfoHost::addMasterServer(const char *masterHost, const uint16_t masterPort) {
+  if (findMasterServer(masterHost, masterPort)) return;
+  masters.push_back({masterHost, masterPort});
+}
+
+MasterServer *ExtInfoHost::findMasterServer(const std::string &masterHost, const uint16_t masterPort) {
+  for (MasterServer &master : masters)
+    if (master.port == masterPort && master.host == masterHost) return &master;
+  return nullptr;
+}
+
 bool ExtInfoHost::shouldUpdateFromMaster() const {
   return !masterUpdateThread &&
           ( !masterUpdateQueue.empty() || ( !lastMasterUpdate ||
@@ -128,41 +243,71 @@ bool ExtInfoHost::shouldUpdateFromMaster() const {
 }
 
 
+void ExtInfoHost::addServers(const CString &servers, ParseServersStatus &parseServersStatus) {
+  MasterListTokenizer tokenizer(servers);
+  MasterListEntry entry;
+  char serverHost[MAX_MASTER_LIST_HOST_LENGTH + 1];
+
+  while (tokenizer.next(entry)) {
+    std::memcpy(serverHost, *entry.host, entry.host.length());
+    serverHost[entry.host.length()] = '\0';
+
+    // IP addresses do not need to go through the resolver.
+    const int addServerStatus = entry.isIPv4 ? addServer(serverHost, {entry.ip, entry.port})
+                                             : resolveAndAddServer(serverHost, entry.port);
+
+    if (addServerStatus > 0) {
+      ++parseServersStatus.numServers;
+      if (addServerStatus == 1) ++parseServersStatus.newServers;
+    } else if (addServerStatus < 0) {
+      ++parseServersStatus.pendingServers;
+    }
+  }
+}
+
 void ExtInfoHost::parseServers(const CString &servers, ParseServersStatus *parseServersStatus, bool lock) {
   LockGuard(lock ? &mutex : nullptr);
 
   markAllNonPersistServersForDeletion();
 
-  if (!parseServersStatus) {
-    static ParseServersStatus dummy{};
-    parseServersStatus = &dummy;
-  }
+  ParseServersStatus dummy{};
+  if (!parseServersStatus) parseServersStatus = &dummy;
 
-  char command[120];
-  char serverHost[120];
-  int serverPort;
-  network::Address serverAddress;
-  const char *p = *servers;
-
-  while (true) {
-    int addServerStatus;
-    if (std::sscanf(p, "%119s %119s %d", command, serverHost, &serverPort) < 3) goto next;
-    if (std::strcmp(command, "addserver") || serverPort < 0 || serverPort > 0xFFFF) goto next;
-    if (!network::setHostAddress(serverHost, serverAddress)) goto next;
-    serverAddress.port = serverPort;
-    addServerStatus = addServer(serverHost, serverAddress);
-    if (addServerStatus) {
-      ++parseServersStatus->numServers;
-      if (addServerStatus == 1) ++parseServersStatus->newServers;
-    }
-    next:;
-    p = std::strchr(p, '\n');
-    if (!p || !*++p) break;
-  }
+  addServers(servers, *parseServersStatus);
 
   parseServersStatus->deletedServers = deleteOrphanedServers();
 }
 
+namespace {
+
+// Registers servers while the master server list is still being received,
+// so they get their first info ping before the transfer is complete.
+// Only the first master that sends data is followed; the complete reply
+// is parsed again once it has arrived (see updateFromMaster()).
+
+struct MasterListStream {
+  ExtInfoHost *host;
+  ssize_t source;
+  size_t parsed = 0;
+  ParseServersStatus status{};
+};
+
+void masterListDataReceived(const size_t source, const std::string &content, void *callbackData) {
+  MasterListStream *stream = static_cast<MasterListStream *>(callbackData);
+
+  if (stream->source == -1) stream->source = source;
+  else if (stream->source != static_cast<ssize_t>(source)) return;
+
+  const size_t end = content.rfind('\n');
+  if (end == std::string::npos || end < stream->parsed) return;
+
+  LockGuard(&stream->host->mutex);
+  stream->host->addServers({content.data() + stream->parsed, end + 1 - stream->parsed}, stream->status);
+  stream->parsed = end + 1;
+}
+
+} // anonymous namespace
+
 void ExtInfoHost::updateFromMaster(int id, bool queue) {
   if (queue) {
     for (const int updateID : masterUpdateQueue) if (updateID == id) return;
@@ -171,8 +316,9 @@ void ExtInfoHost::updateFromMaster(int id, bool queue) {
   }
 
   auto performUpdate = [](ExtInfoHost *host) {
-    std::string masterHost;
-    uint16_t masterPort;
+    std::vector<MasterServer> masters;
+    std::vector<network::TCPSource> sources;
+    std::vector<size_t> sourceMasters;
     std::string servers;
     size_t numServers = 0;
 
@@ -180,43 +326,105 @@ void ExtInfoHost::updateFromMaster(int id, bool queue) {
       LockGuard(&host->mutex);
       host->lastMasterUpdate = getMilliSeconds();
 
-      if (!host->masterHost.empty()) {
+      for (const MasterServer &master : host->masters) {
         // Avoid CoW.
-        masterHost = {host->masterHost.begin(), host->masterHost.end()};
-        masterPort = host->masterPort;
-      } else {
-        masterHost = host->info.masterHost;
-        masterPort = host->info.masterPort;
+        masters.push_back({{master.host.begin(), master.host.end()}, master.port});
       }
     }
 
-    if (!network::recvTCPData(masterHost.c_str(), masterPort, "list\n", servers, 100 * 1024, 20000)) {
+    for (size_t i = 0; i < masters.size(); ++i) {
+      network::TCPSource source{};
+
+      // Cached addresses are used right away. Anything else is looked up
+      // once recvTCPDataHedged() starts the source, so a slow or dead host
+      // name does not hold back the other masters.
+      switch (resolver::resolve(masters[i].host.c_str(), source.address)) {
+      case resolver::RESOLVED:
+        break;
+      case resolver::PENDING:
+        source.hostName = masters[i].host.c_str();
+        break;
+      default:
+        ++masters[i].numFailures; // Recorded below
+        continue;
+      }
+
+      source.address.port = masters[i].port;
+      sources.push_back(source);
+      sourceMasters.push_back(i);
+    }
+
+    MasterListStream stream{host, -1};
+
+    const int winner = network::recvTCPDataHedged(sources.data(), sources.size(), "list\n", servers,
+                                                  masterHedgeDelay, 100 * 1024, 20000,
+                                                  masterListDataReceived, &stream);
+    const bool banned = winner >= 0 && !servers.compare("banned");
+
+    {
       LockGuard(&host->mutex);
-      host->masterUpdateStatus.done = true;
-      host->masterUpdateStatus.success = -1;
-      return;
+
+      const TimeType currentTime = getMilliSeconds();
+
+      for (const MasterServer &masterCopy : masters) {
+        if (!masterCopy.numFailures) continue;
+        MasterServer *master = host->findMasterServer(masterCopy.host, masterCopy.port);
+        if (!master) continue;
+        ++master->numRequests;
+        ++master->numFailures;
+        master->lastFailure = currentTime;
+      }
+
+      for (size_t i = 0; i < sources.size(); ++i) {
+        const network::TCPSource &source = sources[i];
+        if (!source.started) continue;
+
+        const MasterServer &masterCopy = masters[sourceMasters[i]];
+        MasterServer *master = host->findMasterServer(masterCopy.host, masterCopy.port);
+        if (!master) continue;
+
+        ++master->numRequests;
+
+        if (static_cast<int>(i) == winner && !banned) {
+          ++master->numSuccesses;
+          master->lastSuccess = currentTime;
+          master->latency = master->latency ? (master->latency * 3 + source.latency) / 4 : source.latency;
+        } else if (source.failed || static_cast<int>(i) == winner) {
+          ++master->numFailures;
+          master->lastFailure = currentTime;
+        }
+      }
+
+      std::stable_sort(host->masters.begin(), host->masters.end(),
+                       [](const MasterServer &a, const MasterServer &b) {
+                         if (a.isHealthy() != b.isHealthy()) return a.isHealthy();
+                         return a.latency < b.latency;
+                       });
     }
 
-    if (!servers.compare("banned")) {
+    if (winner < 0) {
       LockGuard(&host->mutex);
       host->masterUpdateStatus.done = true;
-      host->masterUpdateStatus.success = -2;
+      host->masterUpdateStatus.success = winner == -2 ? -3 : -1;
       return;
     }
 
-    if (servers.empty()) {
+    if (!servers.compare("banned")) {
       LockGuard(&host->mutex);
       host->masterUpdateStatus.done = true;
-      host->masterUpdateStatus.success = -3;
+      host->masterUpdateStatus.success = -2;
       return;
     }
 
     {
       LockGuard(&host->mutex);
       host->parseServers(servers, &host->masterUpdateStatus, false);
+      // Servers registered while streaming are not new anymore.
+      host->masterUpdateStatus.newServers += stream.status.newServers;
       host->masterUpdateStatus.done = true;
       host->masterUpdateStatus.success = 1;
       host->lastSuccessMasterUpdate = host->lastMasterUpdate;
+      numServers = host->masterUpdateStatus.numServers + host->masterUpdateStatus.pendingServers;
     }
 
     if (numServers) {
@@ -244,6 +452,10 @@ void ExtInfoHost::processUpdateFromMaster() {
 
   event(MASTER_UPDATE, {{}, {}, {}, {&masterUpdateStatus}});
 
+  const HostMetrics &metrics = hostMetrics[index];
+  metrics.masterUpdateDuration.observe((now - lastMasterUpdate) * 1000);
+  metrics.masterUpdates[masterUpdateStatus.success < 0 ? std::min(-masterUpdateStatus.success, 3) : 0].add();
+
   switch (masterUpdateStatus.success) {
   case -1:
     *logFile << info.game << ": master update failed" << logFile->endl();
@@ -255,7 +467,9 @@ void ExtInfoHost::processUpdateFromMaster() {
     *logFile << info.game << ": master update failed: empty reply" << logFile->endl();
     break;
   default:
-    *logFile << info.game << ": received " << masterUpdateStatus.numServers << " servers from master server" << logFile->endl();
+    *logFile << info.game << ": received " << masterUpdateStatus.numServers << " servers from master server";
+    if (masterUpdateStatus.pendingServers) *logFile << " (" << masterUpdateStatus.pendingServers << " waiting for DNS)";
+    *logFile << logFile->endl();
   }
 
   masterUpdateThread->join();
@@ -276,13 +490,34 @@ void ExtInfoHost::deleteEventCallback(const EventCallback &eventCallback) {
 }
 
 void ExtInfoHost::event(const Event event, const EventData &eventData) const {
+  if (eventCallbacks.empty()) return;
+
+  const TimeType start = getMicroSeconds();
+
   for (const EventCallback eventCallback : eventCallbacks)
     eventCallback.fun(this, event, eventData, eventCallback.data);
+
+  hostMetrics[index].eventCallbackDuration.observe(getMicroSeconds() - start);
 }
 
 void ExtInfoHost::init(const size_t index_) {
   socket = network::newSocket();
   index = index_;
+  lastSnapshot = now;
+  SetLockName(&mutex, info.game);
+
+  // Generations from before a restart must not be
+  // mistaken for current ones by web clients. This stays
+  // below 2^53, so browsers can compare generations.
+  generation = static_cast<uint64_t>(time(nullptr)) << 20;
+  tombstoneHorizon = generation;
+
+  if (simulated) {
+    initSimulation();
+    return;
+  }
+
+  if (loadSnapshot()) return;
 
   FString file;
   struct stat st;
@@ -317,17 +552,24 @@ void ExtInfoHost::deinit() {
     usleep(1000);
   } while (true);
 
+  resolver::cancel(this);
   network::deleteSocket(socket);
 
+  if (snapshotInterval && !simulated) saveSnapshot();
+
   for (Server *server : servers) delete server;
 
   // Reset variables for reloading.
 
   enabled = false;
-  masterHost.clear();
+  simulated = false;
+  masters.clear();
   lastMasterUpdate = 0;
   lastSuccessMasterUpdate = 0;
+  lastSnapshot = 0;
   servers.clear();
+  playerNameIndex.clear();
+  tombstones.clear();
 
   assert(eventCallbacks.empty());
 }
@@ -18,15 +18,41 @@
  *  If not, see <http://www.gnu.org/licenses/>.                         *
  ************************************************************************/
 
+#include "metrics.h"
+
 namespace extinfo {
-PLUGIN_IMPORT extern size_t maxPingsPerSecond;
+PLUGIN_IMPORT extern int maxPingsPerSecond;
 PLUGIN_IMPORT extern TimeType pingInterval;
 PLUGIN_IMPORT extern TimeType extPlayerPingInterval;
 PLUGIN_IMPORT extern TimeType extUptimePingInterval;
 PLUGIN_IMPORT extern TimeType masterUpdateInterval;
 PLUGIN_IMPORT extern TimeType masterUpdateRetryInterval;
+PLUGIN_IMPORT extern TimeType masterHedgeDelay;
+PLUGIN_IMPORT extern TimeType snapshotInterval;
+PLUGIN_IMPORT extern TimeType snapshotMaxAge;
+PLUGIN_IMPORT extern int simulationServers;
+PLUGIN_IMPORT extern int simulationPlayers;
+PLUGIN_IMPORT extern int simulationChangesPerSecond;
 PLUGIN_IMPORT extern uint64_t playerSessionID;
 PLUGIN_IMPORT extern TimeType nowus;
 PLUGIN_IMPORT extern TimeType now;
 PLUGIN_IMPORT extern TimeType32 now32;
+
+// Exposed by the web plugin at /metrics
+struct HostMetrics {
+  metrics::Counter infoPings;
+  metrics::Counter extPlayerPings;
+  metrics::Counter extUptimePings;
+  metrics::Counter replies;
+  metrics::Counter unmatchedReplies;
+  metrics::Counter brokenInfoUpdates;
+  metrics::Counter masterUpdates[4]; // success, failed, banned, empty reply
+  metrics::Histogram masterUpdateDuration;
+  metrics::Histogram eventCallbackDuration;
+
+  explicit HostMetrics(const char *game);
+};
+
+PLUGIN_IMPORT extern HostMetrics hostMetrics[NUMGAMES]; // Indexed by ExtInfoHost::index
+PLUGIN_IMPORT extern metrics::Counter pingThrottles;
 } // namespace extinfo
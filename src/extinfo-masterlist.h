@@ -0,0 +1,113 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#ifndef __EXTINFO_MASTERLIST_H__
+#define __EXTINFO_MASTERLIST_H__
+
+#include "network.h"
+#include "tools.h"
+
+namespace extinfo {
+
+//
+// Master server list tokenizer
+//
+// Single pass over the list, no allocations and no NUL-terminated
+// input required. Only "addserver <host> <port>" lines are returned,
+// everything else is skipped.
+//
+
+constexpr size_t MAX_MASTER_LIST_HOST_LENGTH = 119;
+
+struct MasterListEntry {
+  CString host;    // Points into the list, not NUL-terminated
+  uint16_t port;
+  bool isIPv4;
+  uint32_t ip;     // Network byte order; only valid if isIPv4 is true
+};
+
+class MasterListTokenizer {
+private:
+  const char *p;
+  const char *end;
+
+  static bool isBlank(const char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  CString nextToken() {
+    while (p < end && isBlank(*p)) ++p;
+    const char *token = p;
+    while (p < end && *p != '\n' && !isBlank(*p)) ++p;
+    return {token, static_cast<size_t>(p - token)};
+  }
+
+  void skipLine() {
+    const char *newLine = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    p = newLine ? newLine + 1 : end;
+  }
+
+  static bool parsePort(const CString &token, uint16_t &port) {
+    const size_t length = token.length();
+    if (!length || length > 5) return false;
+
+    uint32_t val = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+      const char c = (*token)[i];
+      if (c < '0' || c > '9') return false;
+      val = val * 10 + (c - '0');
+    }
+
+    if (val > 0xFFFF) return false;
+
+    port = static_cast<uint16_t>(val);
+    return true;
+  }
+
+public:
+  // Returns false once the end of the list has been reached.
+  bool next(MasterListEntry &entry) {
+    while (p < end) {
+      const CString command = nextToken();
+      bool ok = command.length() == 9 && !std::memcmp(*command, "addserver", 9);
+
+      if (ok) {
+        entry.host = nextToken();
+        ok = !entry.host.empty() && entry.host.length() <= MAX_MASTER_LIST_HOST_LENGTH &&
+             parsePort(nextToken(), entry.port);
+      }
+
+      // Trailing tokens (e.g. server attributes) are ignored.
+      skipLine();
+
+      if (!ok) continue;
+
+      entry.isIPv4 = network::parseIPv4Address(*entry.host, entry.host.length(), entry.ip);
+      return true;
+    }
+
+    return false;
+  }
+
+  MasterListTokenizer(const CString &list) : p(*list), end(*list + list.length()) {}
+};
+
+} // namespace extinfo
+
+#endif //__EXTINFO_MASTERLIST_H__
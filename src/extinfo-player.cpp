@@ -18,6 +18,10 @@
  *  If not, see <http://www.gnu.org/licenses/>.                         *
  ************************************************************************/
 
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
 #include "extinfo.h"
 
 namespace extinfo {
@@ -43,13 +47,117 @@ const char *Player::Info::getCountry(const bool code) const {
 
 const char *Player::getName() const { return *name ? name : "<unknown>"; }
 const char *Player::getTeam() const { return *team ? team : "<unknown>"; }
+const char *Player::getNameUTF8() const { return *info.nameUTF8 ? info.nameUTF8 : "<unknown>"; }
+const char *Player::getTeamUTF8() const { return *info.teamUTF8 ? info.teamUTF8 : "<unknown>"; }
 bool Player::isBot() const { return cn >= 128; }
 
-void Player::update(const Player &player) {
+void Player::updateUTF8Strings(const bool name, const bool team) {
+  if (name) convertCubeToUTF8(static_cast<const char *>(this->name), info.nameUTF8);
+  if (team) convertCubeToUTF8(static_cast<const char *>(this->team), info.teamUTF8);
+}
+
+bool Player::hasChanged(const Player &player) const {
+  const Extended &e1 = extended;
+  const Extended &e2 = player.extended;
+
+  return std::abs(ping - player.ping) >= PING_CHANGE_THRESHOLD || std::strcmp(name, player.name) ||
+         std::strcmp(team, player.team) || frags != player.frags || flags != player.flags ||
+         deaths != player.deaths || teamkills != player.teamkills || accuracy != player.accuracy ||
+         health != player.health || armour != player.armour || gun != player.gun || priv != player.priv ||
+         state != player.state || e1.infoOK != e2.infoOK || e1.suicides != e2.suicides ||
+         e1.shotdamage != e2.shotdamage || e1.damage != e2.damage || e1.explosivedamage != e2.explosivedamage ||
+         e1.hits != e2.hits || e1.misses != e2.misses || e1.shots != e2.shots || e1.captured != e2.captured ||
+         e1.stolen != e2.stolen || e1.defended != e2.defended;
+}
+
+bool Player::update(const Player &player) {
+  const bool changed = hasChanged(player);
+  const bool nameChanged = std::strcmp(name, player.name);
+  const bool teamChanged = std::strcmp(team, player.team);
   Info infoTmp = info;
   *this = player;
   info = infoTmp;
   info.lastUpdate = player.info.lastUpdate;
+  if (nameChanged || teamChanged) updateUTF8Strings(nameChanged, teamChanged);
+  return changed;
+}
+
+//
+// Player Name Index
+//
+
+namespace {
+
+constexpr size_t MAX_TRIGRAMS = sizeof(ShortString);
+
+// Distinct trigrams of the lower-cased string (as compared by strcasestr())
+size_t getTrigrams(const CString &str, uint32_t (&trigrams)[MAX_TRIGRAMS]) {
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(*str);
+  size_t numTrigrams = 0;
+
+  for (size_t i = 0; i + 3 <= str.length() && numTrigrams < MAX_TRIGRAMS; ++i) {
+    const uint32_t trigram = std::tolower(s[i]) << 16 | std::tolower(s[i + 1]) << 8 | std::tolower(s[i + 2]);
+    if (std::find(trigrams, trigrams + numTrigrams, trigram) == trigrams + numTrigrams)
+      trigrams[numTrigrams++] = trigram;
+  }
+
+  return numTrigrams;
+}
+
+} // anonymous namespace
+
+// getName() is indexed rather than name, it is what findPlayer() matches
+
+void PlayerNameIndex::add(const Server *server, const Player &player) {
+  uint32_t playerTrigrams[MAX_TRIGRAMS];
+  const size_t numTrigrams = getTrigrams(player.getName(), playerTrigrams);
+
+  for (size_t i = 0; i < numTrigrams; ++i) trigrams[playerTrigrams[i]].push_back({server, player.info.sessionID});
+}
+
+void PlayerNameIndex::remove(const Server *server, const Player &player) {
+  uint32_t playerTrigrams[MAX_TRIGRAMS];
+  const size_t numTrigrams = getTrigrams(player.getName(), playerTrigrams);
+
+  for (size_t i = 0; i < numTrigrams; ++i) {
+    auto it = trigrams.find(playerTrigrams[i]);
+    if (it == trigrams.end()) continue;
+
+    std::vector<Entry> &entries = it->second;
+
+    for (Entry &entry : entries) {
+      if (entry.server != server || entry.sessionID != player.info.sessionID) continue;
+      entry = entries.back();
+      entries.pop_back();
+      break;
+    }
+
+    if (entries.empty()) trigrams.erase(it);
+  }
+}
+
+bool PlayerNameIndex::find(const CString &str, std::vector<Entry> &candidates) const {
+  uint32_t strTrigrams[MAX_TRIGRAMS];
+  const size_t numTrigrams = getTrigrams(str, strTrigrams);
+
+  if (!numTrigrams) return false;
+
+  // Every match contains all trigrams, the shortest list is enough
+  const std::vector<Entry> *shortest = nullptr;
+
+  for (size_t i = 0; i < numTrigrams; ++i) {
+    auto it = trigrams.find(strTrigrams[i]);
+
+    if (it == trigrams.end()) {
+      candidates.clear();
+      return true;
+    }
+
+    if (!shortest || it->second.size() < shortest->size()) shortest = &it->second;
+  }
+
+  candidates = *shortest;
+  return true;
 }
 
 } // namespace extinfo
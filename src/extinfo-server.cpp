@@ -219,6 +219,30 @@ const char *Server::getMapName() const {
   return "<no map set>";
 }
 
+const char *Server::getDescriptionUTF8() const {
+  if (*descriptionUTF8) return descriptionUTF8;
+  return "<no server description>";
+}
+
+const char *Server::getMapNameUTF8() const {
+  if (*mapNameUTF8) return mapNameUTF8;
+  return "<no map set>";
+}
+
+// The UTF-8 versions are only converted when something changes
+
+void Server::setDescription(const char *str) {
+  if (!std::strcmp(description, str)) return;
+  strxcpy(description, str, sizeof(description));
+  convertCubeToUTF8(static_cast<const char *>(description), descriptionUTF8);
+}
+
+void Server::setMapName(const char *str) {
+  if (!std::strcmp(mapName, str)) return;
+  strxcpy(mapName, str, sizeof(mapName));
+  convertCubeToUTF8(static_cast<const char *>(mapName), mapNameUTF8);
+}
+
 int Server::getUptime() const {
   if (!extended.infoOK || extended.uptime < 0) return -1;
   return extended.uptime;
@@ -250,6 +274,9 @@ bool Server::addPlayer(const Player &player) {
   Player &newPlayer = players.back();
 
   newPlayer.info.sessionID = ++playerSessionID;
+  newPlayer.updateUTF8Strings();
+  playerChanged(newPlayer);
+  host->playerNameIndex.add(this, newPlayer);
 
   if (newPlayer.extended.infoOK && newPlayer.extended.countryCode[0])
     geoip::country(newPlayer.extended.countryCode,newPlayer.info.country, sizeof(newPlayer.info.country));
@@ -276,16 +303,33 @@ bool Server::addOrUpdatePlayer(const Player &player) {
   }
 
   if (oldPlayer) {
-    if (std::strcmp(oldPlayer->name, player.name)) host->event(PLAYER_RENAME, {this, {oldPlayer, &player}});
-    oldPlayer->update(player);
+    const bool renamed = std::strcmp(oldPlayer->name, player.name);
+
+    if (renamed) {
+      host->event(PLAYER_RENAME, {this, {oldPlayer, &player}});
+      host->playerNameIndex.remove(this, *oldPlayer);
+    }
+
+    if (oldPlayer->update(player)) playerChanged(*oldPlayer);
+    if (renamed) host->playerNameIndex.add(this, *oldPlayer);
+
     return true;
   }
 
   return addPlayer(player);
 }
 
+void Server::infoChanged() { generation = ++host->generation; }
+
+void Server::playerChanged(Player &player) {
+  playerGeneration = ++host->generation;
+  player.info.generation = playerGeneration;
+}
+
 void Server::deletePlayer(decltype(players)::iterator player) {
   host->event(PLAYER_DISCONNECT, {this, {&*player}});
+  host->playerNameIndex.remove(this, *player);
+  playerGeneration = host->addTombstone(address, player->info.sessionID);
   players.erase(player);
 }
 
@@ -429,6 +473,7 @@ bool Server::infoPing() {
   pb.addInt(1);
   pingVal = nowus;
   info.lastPing = now;
+  hostMetrics[host->index].infoPings.add();
   return sendPing(pb, info);
 }
 
@@ -442,6 +487,7 @@ bool Server::extPlayerPing() {
   player.lastPing = now;
   havePlayerCNs = false;
   deleteAllPlayersFromReceiveTmp();
+  hostMetrics[host->index].extPlayerPings.add();
   return sendPing(pb, player);
 }
 
@@ -452,6 +498,7 @@ bool Server::extUptimePing() {
   pb.addInt(EXT_UPTIME + extInfoOffset);
   pb.addByte(1); // request server mod
   uptime.lastPing = now;
+  hostMetrics[host->index].extUptimePings.add();
   return sendPing(pb, uptime);
 }
 
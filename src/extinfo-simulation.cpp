@@ -0,0 +1,294 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Simulated data source.
+//
+// Fills a game with generated servers and players instead of asking
+// master servers and pinging servers, and keeps changing them (frags,
+// joins, leaves, renames, map changes) so generations, deltas and events
+// get exercised like with real data.
+//
+// Used by bench/httpload and for working on frontends offline.
+// Enabled through extinfo.simulation in the configuration.
+//
+
+#include "main.h"
+#include "extinfo.h"
+#include "extinfo-internal.h"
+#include <cstdio>
+#include <algorithm>
+
+namespace extinfo {
+
+namespace {
+
+struct SimulationState {
+  uint64_t random;
+  TimeType lastUpdate;
+  TimeType lastPong;
+  uint64_t pendingChanges; // In thousandths
+  size_t numPlayers;
+};
+
+SimulationState simulationStates[NUMGAMES];
+
+// 198.18.0.0/15 is reserved for benchmarking (RFC 2544)
+constexpr uint32_t SIMULATION_NETWORK = 0xC6120000;
+
+constexpr const char *SIMULATION_MAPS[] = {
+  "complex", "dust2", "ot", "turbine", "hashi", "forge", "reissen", "frozen", "mbt2", "tartech", "haste", "memento"
+};
+
+constexpr const char *SIMULATION_SYLLABLES[] = {
+  "ka", "ro", "mi", "zu", "te", "la", "do", "ne", "fi", "xo", "ba", "ry", "qua", "sh", "ek", "lo"
+};
+
+constexpr const char *SIMULATION_CLANS[] = {"|RB|", "[TBMC]", ".rC|", "|DM|", "oo|"};
+
+constexpr const char *SIMULATION_COUNTRIES[] = {"DE", "US", "FR", "NL", "PL", "BR", "RU", "GB", "FI", "SE", "ES"};
+
+int simulationProtocolVersion(const GameIdentifier game) {
+  switch (game) {
+  case SAUERBRATEN: return 259;
+  case TESSERACT: return 2;
+  case REDECLIPSE: return 226;
+  case ASSAULTCUBE: return 1201;
+  }
+  return 0;
+}
+
+// xorshift64*, the simulation does not need anything better
+uint64_t nextRandom(SimulationState &state) {
+  state.random ^= state.random >> 12;
+  state.random ^= state.random << 25;
+  state.random ^= state.random >> 27;
+  return state.random * 0x2545F4914F6CDD1Dull;
+}
+
+int randomInt(SimulationState &state, const int min, const int max) {
+  return min + static_cast<int>(nextRandom(state) % static_cast<uint64_t>(max - min + 1));
+}
+
+template <typename T, size_t N> T randomElement(SimulationState &state, T (&array)[N]) {
+  return array[nextRandom(state) % N];
+}
+
+void randomName(SimulationState &state, char (&name)[MAX_NAME_LENGTH + 1]) {
+  name[0] = '\0';
+  size_t length = 0;
+
+  auto append = [&](const char *str) {
+    length += /*std::*/snprintf(name + length, sizeof(name) - length, "%s", str);
+    if (length >= sizeof(name)) length = sizeof(name) - 1;
+  };
+
+  if (!randomInt(state, 0, 4)) append(randomElement(state, SIMULATION_CLANS));
+  for (int i = randomInt(state, 2, 4); i > 0; --i) append(randomElement(state, SIMULATION_SYLLABLES));
+}
+
+void randomMap(SimulationState &state, Server *server) {
+  server->setMapName(randomElement(state, SIMULATION_MAPS));
+  server->gameMode = randomInt(state, 0, 6);
+  server->secondsLeft = 600;
+}
+
+bool addRandomPlayer(SimulationState &state, Server *server) {
+  if (server->players.size() >= static_cast<size_t>(server->maxPlayers)) return false;
+
+  Player player{};
+  int cn = 0;
+
+  for (const Player &otherPlayer : server->players) cn = std::max(cn, otherPlayer.cn + 1);
+
+  player.cn = cn;
+  player.ping = randomInt(state, 5, 250);
+  randomName(state, player.name);
+  if (server->isTeamMode()) /*std::*/snprintf(player.team, sizeof(player.team), "%s", cn % 2 ? "evil" : "good");
+  player.frags = randomInt(state, -2, 40);
+  player.deaths = randomInt(state, 0, 40);
+  player.teamkills = !randomInt(state, 0, 9);
+  player.accuracy = randomInt(state, 5, 70);
+  player.health = 100;
+  player.gun = randomInt(state, 0, 6);
+  player.priv = !randomInt(state, 0, 19);
+  player.ip.ui32 = network::hostToNet(SIMULATION_NETWORK | static_cast<uint32_t>(nextRandom(state) & 0x1FFFF));
+  player.extended.infoOK = true;
+  /*std::*/snprintf(player.extended.countryCode, sizeof(player.extended.countryCode), "%s",
+                    randomElement(state, SIMULATION_COUNTRIES));
+  player.info.connectTime = now - static_cast<TimeType>(randomInt(state, 0, 2 * 60 * 60)) * oneSecond;
+  player.info.lastUpdate = now;
+
+  return server->addPlayer(player);
+}
+
+void playersChanged(ExtInfoHost &host, Server *server) {
+  server->numPlayers = static_cast<int>(server->players.size());
+  server->infoChanged();
+  host.event(SERVER_UPDATE, {server});
+}
+
+void applyRandomChange(ExtInfoHost &host, SimulationState &state) {
+  Server *server = host.servers[nextRandom(state) % host.servers.size()];
+  const int change = randomInt(state, 0, 99);
+
+  if (change >= 95) {
+    randomMap(state, server);
+    server->infoChanged();
+    host.event(SERVER_UPDATE, {server});
+    return;
+  }
+
+  // Players join and leave at the same rate once the configured number is reached
+  if (change < 25 && randomInt(state, 0, 2 * simulationPlayers) >= static_cast<int>(state.numPlayers)) {
+    if (!addRandomPlayer(state, server)) return;
+    ++state.numPlayers;
+    playersChanged(host, server);
+    return;
+  }
+
+  if (server->players.empty()) return;
+
+  const auto it = server->players.begin() + nextRandom(state) % server->players.size();
+
+  if (change < 25) {
+    server->deletePlayer(it);
+    --state.numPlayers;
+    playersChanged(host, server);
+    return;
+  }
+
+  Player player = *it;
+
+  if (change < 30) {
+    randomName(state, player.name);
+  } else {
+    if (randomInt(state, 0, 3)) ++player.frags;
+    else ++player.deaths;
+    player.ping = std::max(5, player.ping + randomInt(state, -30, 30));
+    player.accuracy = std::min(100, std::max(0, player.accuracy + randomInt(state, -2, 2)));
+  }
+
+  player.info.lastUpdate = now;
+  server->addOrUpdatePlayer(player);
+}
+
+} // anonymous namespace
+
+void ExtInfoHost::initSimulation() {
+  SimulationState &state = simulationStates[index];
+
+  state = {};
+  state.random = getRandomNumber() | 1;
+  state.lastUpdate = now;
+  state.lastPong = now;
+
+  LockGuard(&mutex);
+
+  const size_t numServers = std::min(static_cast<size_t>(simulationServers), MAX_SERVERS);
+  const int protocolVersion = simulationProtocolVersion(info.identifier);
+  char serverHost[32];
+
+  for (size_t i = 0; i < numServers; ++i) {
+    const uint32_t address = SIMULATION_NETWORK | static_cast<uint32_t>(index) << 10 | static_cast<uint32_t>(i + 1);
+    /*std::*/snprintf(serverHost, sizeof(serverHost), "%u.%u.%u.%u", address >> 24, address >> 16 & 0xFF,
+                      address >> 8 & 0xFF, address & 0xFF);
+
+    if (addServer(serverHost, {network::hostToNet(address), 28785}, true) != 1) continue;
+
+    Server *server = servers.back();
+    ShortString description;
+
+    /*std::*/snprintf(description, sizeof(description), "Simulated Server #%zu", i + 1);
+
+    server->infoOK = true;
+    server->info.lastPong = now;
+    server->lastPong = now;
+    server->info.numPackets = 3; // Connect times of new players are known
+    server->ping = randomInt(state, 10, 200);
+    server->highResPing = static_cast<float>(server->ping);
+    server->protocolVersion = protocolVersion;
+    server->maxPlayers = randomInt(state, 2, 8) * 4;
+    server->masterMode = randomInt(state, 0, 3) ? 0 : randomInt(state, 1, 3);
+    server->gameSpeed = 100;
+    server->setDescription(description);
+    randomMap(state, server);
+
+    server->extended.infoOK = info.extInfoSupported;
+    server->extended.uptime = randomInt(state, 60, 60 * 60 * 24 * 30);
+    server->uptime.lastPong = now;
+  }
+
+  for (int i = 0; i < simulationPlayers && !servers.empty(); ++i) {
+    // Favor a few busy servers like real data does
+    Server *server = servers[nextRandom(state) % (randomInt(state, 0, 1) ? servers.size() : servers.size() / 8 + 1)];
+    if (addRandomPlayer(state, server) || addRandomPlayer(state, servers[nextRandom(state) % servers.size()]))
+      ++state.numPlayers;
+  }
+
+  for (Server *server : servers) playersChanged(*this, server);
+
+  *logFile << info.game << ": simulating " << servers.size() << " servers and " << state.numPlayers << " players"
+           << logFile->endl();
+}
+
+// Requires locking
+void ExtInfoHost::processSimulation() {
+  SimulationState &state = simulationStates[index];
+
+  // Answer master updates right away, there is no master server to ask
+  while (!masterUpdateQueue.empty()) {
+    masterUpdateStatus.reset();
+    masterUpdateStatus.done = true;
+    masterUpdateStatus.id = masterUpdateQueue.front();
+    masterUpdateStatus.success = 1;
+    masterUpdateStatus.numServers = servers.size();
+    masterUpdateQueue.pop_front();
+
+    lastMasterUpdate = now;
+    lastSuccessMasterUpdate = now;
+    event(MASTER_UPDATE, {{}, {}, {}, {&masterUpdateStatus}});
+  }
+
+  if (now - state.lastPong >= oneSecond) {
+    state.lastPong = now;
+
+    for (Server *server : servers) {
+      server->info.lastPong = now;
+      server->lastPong = now;
+      server->uptime.lastPong = now;
+    }
+  }
+
+  state.pendingChanges += (now - state.lastUpdate) * static_cast<uint64_t>(simulationChangesPerSecond);
+  state.lastUpdate = now;
+
+  // Do not catch up on more than one second of changes
+  state.pendingChanges = std::min(state.pendingChanges, static_cast<uint64_t>(simulationChangesPerSecond) * 1000);
+
+  if (servers.empty()) {
+    state.pendingChanges = 0;
+    return;
+  }
+
+  for (; state.pendingChanges >= 1000; state.pendingChanges -= 1000) applyRandomChange(*this, state);
+}
+
+} // namespace extinfo
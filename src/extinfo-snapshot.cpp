@@ -0,0 +1,422 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Binary snapshot of the server state.
+//
+// Written periodically and on shutdown, read back on startup so the
+// browser does not start out with an empty server list.
+//
+// Layout: SnapshotHeader | SnapshotServer[numServers] | SnapshotPlayer[numPlayers]
+//
+// All records are fixed size and 8-byte aligned, which allows reading
+// them in place from a memory mapped file. Times are stored relative to
+// the time the snapshot was written, as our clock is not persistent.
+//
+
+#include "main.h"
+#include "extinfo.h"
+#include "extinfo-internal.h"
+#include <ctime>
+#include <type_traits>
+
+namespace extinfo {
+
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[4] = {'C', 'S', 'B', 'S'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+constexpr uint32_t SNAPSHOT_NO_TIME = static_cast<uint32_t>(-1);
+
+struct SnapshotHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t game;
+  uint32_t serverRecordSize;
+  uint32_t playerRecordSize;
+  uint32_t numServers;
+  uint32_t numPlayers;
+  int64_t timeStamp; // Unix time
+  uint32_t masterUpdateAge;
+  uint32_t reserved;
+};
+
+struct SnapshotServer {
+  char serverHost[120];
+  uint32_t host;
+  uint16_t port; // Without info port offset
+  uint8_t infoOK;
+  uint8_t extInfoOK;
+  int32_t extInfoOffset;
+  int32_t ping;
+  int32_t numPlayers;
+  int32_t protocolVersion;
+  int32_t gameMode;
+  int32_t secondsLeft;
+  int32_t maxPlayers;
+  int32_t masterMode;
+  int32_t gameSpeed;
+  int32_t mutators;
+  int32_t gamePaused;
+  float highResPing;
+  char mapName[sizeof(ShortString)];
+  char description[sizeof(ShortString)];
+  int32_t uptime;
+  int32_t serverMod; // SM_INVALID if unset
+  uint32_t infoAge;
+  uint32_t uptimeAge;
+  uint32_t firstPlayer;
+  uint32_t numPlayerRecords;
+  int64_t reserved;
+};
+
+struct SnapshotPlayer {
+  int32_t cn;
+  int32_t ping;
+  char name[MAX_NAME_LENGTH + 1];
+  char team[MAX_TEAM_LENGTH + 6];
+  int32_t frags;
+  int32_t flags;
+  int32_t deaths;
+  int32_t teamkills;
+  int32_t accuracy;
+  int32_t health;
+  int32_t armour;
+  int32_t gun;
+  int32_t priv;
+  int32_t state;
+  uint32_t ip;
+  uint8_t extInfoOK;
+  char countryCode[4];
+  uint8_t reserved[3];
+  uint32_t extSetMask;
+  int32_t extVals[12];
+  uint32_t updateAge;
+  int64_t onlineTime; // -1 if unknown
+};
+
+static_assert(std::is_trivially_copyable<SnapshotHeader>::value &&
+              std::is_trivially_copyable<SnapshotServer>::value &&
+              std::is_trivially_copyable<SnapshotPlayer>::value, "");
+
+static_assert(!(sizeof(SnapshotHeader) % 8) && !(sizeof(SnapshotServer) % 8) &&
+              !(sizeof(SnapshotPlayer) % 8), "snapshot records must be 8-byte aligned");
+
+template <size_t size> void copyString(char (&dst)[size], const char *src) {
+  strxcpy(dst, src, size);
+}
+
+uint32_t getAge(const TimeType time) {
+  if (!time || time > now) return SNAPSHOT_NO_TIME;
+  return static_cast<uint32_t>(std::min<TimeType>(now - time, SNAPSHOT_NO_TIME - 1));
+}
+
+// Converts an age back into a point in time; 0 if that is not possible.
+TimeType getTime(const uint32_t age, const TimeType snapshotAge) {
+  if (age == SNAPSHOT_NO_TIME || now <= age + snapshotAge) return TimeType();
+  return now - age - snapshotAge;
+}
+
+template <typename T> T *getRecords(const MappedFile &file, const size_t offset, const size_t count) {
+  if (offset > file.size() || (file.size() - offset) / sizeof(T) < count) return nullptr;
+  return reinterpret_cast<T *>(file.data() + offset);
+}
+
+// Maps the extended player variables to snapshot slots.
+
+template <typename F> void forEachExtVar(Player::Extended &extended, F f) {
+  ExtVar<int> *const vars[] = {
+    &extended.sessionID, &extended.suicides, &extended.shotdamage, &extended.damage,
+    &extended.explosivedamage, &extended.hits, &extended.misses, &extended.shots,
+    &extended.captured, &extended.stolen, &extended.defended
+  };
+  for (size_t i = 0; i < sizeofarray(vars); ++i) f(i, *vars[i]);
+}
+
+} // anonymous namespace
+
+const char *ExtInfoHost::getSnapshotFileName(FString &file) const {
+  file.clear();
+  file << TMP_DIR << PATH_DIV << info.game << ".snapshot";
+  return file.c_str();
+}
+
+bool ExtInfoHost::shouldSaveSnapshot() const {
+  return snapshotInterval && !simulated && (!lastSnapshot || now - lastSnapshot >= snapshotInterval);
+}
+
+bool ExtInfoHost::saveSnapshot() {
+  std::string data;
+  SnapshotHeader header{};
+
+  lastSnapshot = now;
+
+  {
+    SharedLockGuard(&mutex);
+
+    size_t numPlayers = 0;
+    for (const Server *server : servers) numPlayers += server->players.size();
+
+    data.resize(sizeof(SnapshotHeader) + servers.size() * sizeof(SnapshotServer) +
+                numPlayers * sizeof(SnapshotPlayer));
+
+    SnapshotServer *serverRecord = reinterpret_cast<SnapshotServer *>(&data[sizeof(SnapshotHeader)]);
+    SnapshotPlayer *playerRecord = reinterpret_cast<SnapshotPlayer *>(serverRecord + servers.size());
+    uint32_t playerIndex = 0;
+
+    for (Server *server : servers) {
+      SnapshotServer &s = *serverRecord++;
+
+      copyString(s.serverHost, server->serverHost.c_str());
+      s.host = server->address.host;
+      s.port = server->address.port - info.infoPortOffset;
+      s.infoOK = server->infoOK;
+      s.extInfoOK = server->extended.infoOK;
+      s.extInfoOffset = server->extInfoOffset;
+      s.ping = server->ping;
+      s.numPlayers = server->numPlayers;
+      s.protocolVersion = server->protocolVersion;
+      s.gameMode = server->gameMode;
+      s.secondsLeft = server->secondsLeft;
+      s.maxPlayers = server->maxPlayers;
+      s.masterMode = server->masterMode;
+      s.gameSpeed = server->gameSpeed;
+      s.mutators = server->mutators;
+      s.gamePaused = server->gamePaused;
+      s.highResPing = server->highResPing;
+      copyString(s.mapName, server->mapName);
+      copyString(s.description, server->description);
+      s.uptime = server->extended.uptime;
+      s.serverMod = server->extended.serverMod.isSet() ? *server->extended.serverMod : SM_INVALID;
+      s.infoAge = getAge(server->info.lastPong);
+      s.uptimeAge = getAge(server->uptime.lastPong);
+      s.firstPlayer = playerIndex;
+      s.numPlayerRecords = server->players.size();
+
+      for (Player &player : server->players) {
+        SnapshotPlayer &p = *playerRecord++;
+
+        p.cn = player.cn;
+        p.ping = player.ping;
+        copyString(p.name, player.name);
+        copyString(p.team, player.team);
+        p.frags = player.frags;
+        p.flags = player.flags;
+        p.deaths = player.deaths;
+        p.teamkills = player.teamkills;
+        p.accuracy = player.accuracy;
+        p.health = player.health;
+        p.armour = player.armour;
+        p.gun = player.gun;
+        p.priv = player.priv;
+        p.state = player.state;
+        p.ip = player.ip.ui32;
+        p.extInfoOK = player.extended.infoOK;
+        copyString(p.countryCode, player.extended.countryCode);
+
+        if (player.extended.serverMod.isSet()) {
+          p.extSetMask |= 1u << 11;
+          p.extVals[11] = *player.extended.serverMod;
+        }
+
+        forEachExtVar(player.extended, [&](const size_t i, const ExtVar<int> &var) {
+          if (!var.isSet()) return;
+          p.extSetMask |= 1u << i;
+          p.extVals[i] = *var;
+        });
+
+        p.updateAge = getAge(player.info.lastUpdate);
+        p.onlineTime = player.info.connectTime != UNKNOWN_ONLINE_TIME ? player.info.getOnlineTime(now) : -1;
+
+        ++playerIndex;
+      }
+    }
+
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.game = info.identifier;
+    header.serverRecordSize = sizeof(SnapshotServer);
+    header.playerRecordSize = sizeof(SnapshotPlayer);
+    header.numServers = servers.size();
+    header.numPlayers = playerIndex;
+    header.timeStamp = time(nullptr);
+    header.masterUpdateAge = getAge(lastSuccessMasterUpdate);
+
+    std::memcpy(&data[0], &header, sizeof(header));
+  }
+
+  FString file;
+
+  if (!writeFileAtomically(getSnapshotFileName(file), data)) {
+    warn << info.game << ": cannot write snapshot '" << file << "'" << warn.endl();
+    return false;
+  }
+
+  return true;
+}
+
+bool ExtInfoHost::loadSnapshot() {
+  FString file;
+  MappedFile snapshot;
+
+  if (!snapshot.open(getSnapshotFileName(file))) return false;
+
+  auto invalid = [&](const char *reason) {
+    warn << info.game << ": ignoring snapshot '" << file << "': " << reason << warn.endl();
+    return false;
+  };
+
+  const SnapshotHeader *header = getRecords<const SnapshotHeader>(snapshot, 0, 1);
+
+  if (!header || std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))) return invalid("bad magic");
+  if (header->version != SNAPSHOT_VERSION) return invalid("version mismatch");
+
+  if (header->byteOrder != SNAPSHOT_BYTE_ORDER || header->serverRecordSize != sizeof(SnapshotServer) ||
+      header->playerRecordSize != sizeof(SnapshotPlayer))
+    return invalid("incompatible record layout");
+
+  if (header->game != static_cast<uint32_t>(info.identifier)) return invalid("game mismatch");
+  if (header->numServers > MAX_SERVERS || header->numPlayers > MAX_SERVERS * MAX_PLAYERS) return invalid("corrupt");
+
+  const SnapshotServer *serverRecords =
+      getRecords<const SnapshotServer>(snapshot, sizeof(SnapshotHeader), header->numServers);
+  const SnapshotPlayer *playerRecords = getRecords<const SnapshotPlayer>(
+      snapshot, sizeof(SnapshotHeader) + header->numServers * sizeof(SnapshotServer), header->numPlayers);
+
+  if (!serverRecords || !playerRecords) return invalid("truncated");
+
+  const int64_t currentTime = time(nullptr);
+  const TimeType snapshotAge = currentTime > header->timeStamp ? (currentTime - header->timeStamp) * 1000 : 0;
+
+  // Old snapshots are only good for the server list.
+  const bool restoreState = snapshotAge < snapshotMaxAge;
+
+  LockGuard(&mutex);
+
+  size_t numServers = 0;
+  size_t numPlayers = 0;
+
+  for (uint32_t i = 0; i < header->numServers; ++i) {
+    const SnapshotServer &s = serverRecords[i];
+
+    if (s.serverHost[sizeof(s.serverHost) - 1] || !s.serverHost[0]) continue;
+    if (addServer(s.serverHost, {s.host, s.port}) != 1) continue;
+
+    ++numServers;
+
+    Server *server = servers.back();
+
+    // Spread the initial pings over one ping interval
+    // instead of pinging all servers at once.
+
+    if (now > pingInterval) server->info.lastPing = now - pingInterval + (pingInterval * i) / header->numServers + 1;
+
+    if (!restoreState || !s.infoOK) continue;
+
+    const TimeType lastPong = getTime(s.infoAge, snapshotAge);
+    if (!lastPong) continue;
+
+    server->infoOK = true;
+    server->info.lastPong = lastPong;
+    server->lastPong = lastPong;
+    server->info.numPackets = 3; // Connect times of new players are known
+    server->extInfoOffset = s.extInfoOffset;
+    server->ping = s.ping;
+    server->numPlayers = s.numPlayers;
+    server->protocolVersion = s.protocolVersion;
+    server->gameMode = s.gameMode;
+    server->secondsLeft = s.secondsLeft;
+    server->maxPlayers = s.maxPlayers;
+    server->masterMode = s.masterMode;
+    server->gameSpeed = s.gameSpeed;
+    server->mutators = s.mutators;
+    server->gamePaused = s.gamePaused;
+    server->highResPing = s.highResPing;
+
+    ShortString str;
+    copyString(str, s.mapName);
+    server->setMapName(str);
+    copyString(str, s.description);
+    server->setDescription(str);
+
+    if (s.extInfoOK) {
+      server->extended.infoOK = true;
+      server->extended.uptime = s.uptime;
+      server->uptime.lastPong = getTime(s.uptimeAge, snapshotAge);
+      if (s.serverMod != SM_INVALID) server->extended.serverMod = static_cast<ServerMod>(s.serverMod);
+    }
+
+    if (s.firstPlayer > header->numPlayers || header->numPlayers - s.firstPlayer < s.numPlayerRecords) continue;
+
+    for (uint32_t j = 0; j < s.numPlayerRecords; ++j) {
+      const SnapshotPlayer &p = playerRecords[s.firstPlayer + j];
+      Player player{};
+
+      player.cn = p.cn;
+      player.ping = p.ping;
+      copyString(player.name, p.name);
+      copyString(player.team, p.team);
+      player.frags = p.frags;
+      player.flags = p.flags;
+      player.deaths = p.deaths;
+      player.teamkills = p.teamkills;
+      player.accuracy = p.accuracy;
+      player.health = p.health;
+      player.armour = p.armour;
+      player.gun = p.gun;
+      player.priv = p.priv;
+      player.state = p.state;
+      player.ip.ui32 = p.ip;
+      player.extended.infoOK = p.extInfoOK;
+      copyString(player.extended.countryCode, p.countryCode);
+
+      if (p.extSetMask & 1u << 11) player.extended.serverMod = static_cast<ServerMod>(p.extVals[11]);
+
+      forEachExtVar(player.extended, [&](const size_t i, ExtVar<int> &var) {
+        if (p.extSetMask & 1u << i) var = p.extVals[i];
+      });
+
+      player.info.lastUpdate = getTime(p.updateAge, snapshotAge);
+
+      if (p.onlineTime >= 0 && now > static_cast<TimeType>(p.onlineTime) + snapshotAge)
+        player.info.connectTime = now - p.onlineTime - snapshotAge;
+      else
+        player.info.connectTime = UNKNOWN_ONLINE_TIME;
+
+      if (server->addPlayer(player)) ++numPlayers;
+    }
+  }
+
+  if (header->masterUpdateAge != SNAPSHOT_NO_TIME) {
+    // This is OK to wrap
+    lastMasterUpdate = now - header->masterUpdateAge - snapshotAge;
+    lastSuccessMasterUpdate = lastMasterUpdate;
+  }
+
+  *logFile << info.game << ": restored " << numServers << " servers and " << numPlayers
+           << " players from snapshot (" << snapshotAge / oneSecond << " seconds old)" << logFile->endl();
+
+  return true;
+}
+
+} // namespace extinfo
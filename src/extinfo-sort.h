@@ -19,6 +19,8 @@
  ************************************************************************/
 
 #include <algorithm>
+#include <cctype>
+#include <string>
 
 namespace extinfo {
 
@@ -70,15 +72,16 @@ enum PlayerSorter getPlayerSorter(const char *str) {
     PlayerSorter dec;
   } sorters[] = {
     {"name", PS_NAME_ASC, PS_NAME_DEC},
+    {"teamkills", PS_TEAMKILLS_ASC, PS_TEAMKILLS_DEC}, // Before "team"
     {"team", PS_TEAM_ASC, PS_TEAM_DEC},
     {"frags", PS_FRAGS_ASC, PS_FRAGS_DEC},
     {"deaths", PS_DEATHS_ASC, PS_DEATHS_DEC},
     {"acc", PS_ACCURACY_ASC, PS_ACCURACY_DEC},
-    {"teamkills", PS_TEAMKILLS_ASC, PS_TEAMKILLS_DEC},
     {"health", PS_HEALTH_ASC, PS_HEALTH_DEC},
     {"armour", PS_ARMOUR_ASC, PS_ARMOUR_DEC},
     {"ping", PS_PING_ASC, PS_PING_DEC},
     {"cn", PS_CLIENTNUM_ASC, PS_CLIENTNUM_DEC},
+    {"onlinetime", PS_ONLINETIME_ASC, PS_ONLINETIME_DEC},
     {"country", PS_COUNTRY_ASC, PS_COUNTRY_DEC},
   };
 
@@ -325,8 +328,6 @@ struct SortServer {
   const Server *server;
   FString host;
   FString players;
-  ShortString descriptionUTF8;
-  ShortString mapUTF8;
   ShortString uptimeStr;    // may not be used
   ShortString versionStr;   // may not be used
   const char *uptime;
@@ -364,6 +365,43 @@ enum ServerSorter : int {
   COUNTRYNAME_DEC
 };
 
+namespace {
+
+enum ServerSorter getServerSorter(const char *str) {
+  constexpr ServerSorter DEFAULT_SERVER_SORTER = PLAYERS_DEC;
+
+  if (!str) return DEFAULT_SERVER_SORTER;
+
+  // Names containing other names come first
+  constexpr struct {
+    const char *name;
+    ServerSorter asc;
+    ServerSorter dec;
+  } sorters[] = {
+    {"mastermodename", MASTERMODENAME_ASC, MASTERMODENAME_DEC},
+    {"mastermode", MASTERMODE_ASC, MASTERMODE_DEC},
+    {"gamemode", GAMEMODENAME_ASC, GAMEMODENAME_DEC},
+    {"servermod", SERVERMODNAME_ASC, SERVERMODNAME_DEC},
+    {"currentuptime", CURRENTUPTIME_ASC, CURRENTUPTIME_DEC},
+    {"uptime", UPTIME_ASC, UPTIME_DEC},
+    {"description", DESCRIPTION_ASC, DESCRIPTION_DEC},
+    {"protocol", PROTOCOL_ASC, PROTOCOL_DEC},
+    {"ping", PING_ASC, PING_DEC},
+    {"map", MAPNAME_ASC, MAPNAME_DEC},
+    {"players", PLAYERS_ASC, PLAYERS_DEC},
+    {"host", HOST_ASC, HOST_DEC},
+    {"country", COUNTRYNAME_ASC, COUNTRYNAME_DEC},
+  };
+
+  for (auto &sorter : sorters)
+    if (strcasestr(str, sorter.name))
+      return strcasestr(str, "asc") ? sorter.asc : sorter.dec;
+
+  return DEFAULT_SERVER_SORTER;
+}
+
+} // anonymous namespace
+
 template <typename T>
 void sortServers(std::vector<T> &servers, const ServerSorter sorter) {
   struct sortServersByHostAsc {
@@ -380,13 +418,13 @@ void sortServers(std::vector<T> &servers, const ServerSorter sorter) {
 
   struct sortServersByDescriptionAsc {
     bool operator()(const SortServerPtr &a, const SortServerPtr &b) const {
-      return strcasecmp(a->descriptionUTF8, b->descriptionUTF8) < 0;
+      return strcasecmp(a->server->getDescriptionUTF8(), b->server->getDescriptionUTF8()) < 0;
     }
   };
 
   struct sortServersByDescriptionDec {
     bool operator()(const SortServerPtr &a, const SortServerPtr &b) const {
-      return strcasecmp(a->descriptionUTF8, b->descriptionUTF8) > 0;
+      return strcasecmp(a->server->getDescriptionUTF8(), b->server->getDescriptionUTF8()) > 0;
     }
   };
 
@@ -428,13 +466,13 @@ void sortServers(std::vector<T> &servers, const ServerSorter sorter) {
 
   struct sortServersByMapNameAsc {
     bool operator()(const SortServerPtr &a, const SortServerPtr &b) const {
-      return strcasecmp(a->server->getMapName(), b->server->getMapName()) < 0;
+      return strcasecmp(a->server->getMapNameUTF8(), b->server->getMapNameUTF8()) < 0;
     }
   };
 
   struct sortServersByMapNameDec {
     bool operator()(const SortServerPtr &a, const SortServerPtr &b) const {
-      return strcasecmp(a->server->getMapName(), b->server->getMapName()) > 0;
+      return strcasecmp(a->server->getMapNameUTF8(), b->server->getMapNameUTF8()) > 0;
     }
   };
 
@@ -607,4 +645,85 @@ void sortServers(std::vector<T> &servers, const ServerSorter sorter) {
   }
 }
 
+// Top-K sorting
+//
+// Sort keys are computed once per element (strings are lower-cased up
+// front), so comparisons are plain integer / memcmp compares instead of
+// strcasecmp() calls. Only the first elements that are actually needed
+// are sorted (std::partial_sort()).
+
+template <typename T> struct SortItem {
+  const T *obj;
+  const Server *server; // Players only
+  size_t index;         // Equal keys keep the original order
+  int64_t num;
+  std::string str;
+};
+
+inline void setSortKey(std::string &key, const char *str) {
+  key.clear();
+  for (; *str; ++str) key += static_cast<char>(std::tolower(static_cast<unsigned char>(*str)));
+}
+
+inline void setPlayerSortKey(SortItem<Player> &item, const PlayerSorter sorter, const TimeType now) {
+  const Player &player = *item.obj;
+
+  switch (sorter) {
+  case PS_NAME_ASC: case PS_NAME_DEC: setSortKey(item.str, player.getName()); break;
+  case PS_TEAM_ASC: case PS_TEAM_DEC: setSortKey(item.str, player.getTeam()); break;
+  case PS_FRAGS_ASC: case PS_FRAGS_DEC: item.num = player.frags; break;
+  case PS_DEATHS_ASC: case PS_DEATHS_DEC: item.num = player.deaths; break;
+  case PS_ACCURACY_ASC: case PS_ACCURACY_DEC: item.num = player.accuracy; break;
+  case PS_TEAMKILLS_ASC: case PS_TEAMKILLS_DEC: item.num = player.teamkills; break;
+  case PS_HEALTH_ASC: case PS_HEALTH_DEC: item.num = player.health; break;
+  case PS_ARMOUR_ASC: case PS_ARMOUR_DEC: item.num = player.armour; break;
+  case PS_PING_ASC: case PS_PING_DEC: item.num = player.ping; break;
+  case PS_CLIENTNUM_ASC: case PS_CLIENTNUM_DEC: item.num = player.cn; break;
+  case PS_ONLINETIME_ASC: case PS_ONLINETIME_DEC: {
+    const TimeType onlineTime = player.info.getOnlineTime(now);
+    item.num = onlineTime != UNKNOWN_ONLINE_TIME ? onlineTime : 0;
+    break;
+  }
+  case PS_COUNTRY_ASC: case PS_COUNTRY_DEC: setSortKey(item.str, player.info.getCountry()); break;
+  }
+}
+
+inline void setServerSortKey(SortItem<Server> &item, const ServerSorter sorter, const TimeType now) {
+  const Server &server = *item.obj;
+
+  switch (sorter) {
+  case HOST_ASC: case HOST_DEC:
+    item.num = static_cast<int64_t>(network::netToHost(server.address.host)) << 16 | server.address.port;
+    break;
+  case DESCRIPTION_ASC: case DESCRIPTION_DEC: setSortKey(item.str, server.getDescriptionUTF8()); break;
+  case PROTOCOL_ASC: case PROTOCOL_DEC: item.num = server.protocolVersion; break;
+  case PING_ASC: case PING_DEC: item.num = static_cast<int64_t>(server.highResPing * 1000.0f); break;
+  case GAMEMODENAME_ASC: case GAMEMODENAME_DEC: setSortKey(item.str, server.getGameModeName()); break;
+  case MAPNAME_ASC: case MAPNAME_DEC: setSortKey(item.str, server.getMapNameUTF8()); break;
+  case PLAYERS_ASC: case PLAYERS_DEC: item.num = server.numPlayers; break;
+  case MASTERMODE_ASC: case MASTERMODE_DEC: item.num = server.masterMode; break;
+  case MASTERMODENAME_ASC: case MASTERMODENAME_DEC: setSortKey(item.str, server.getMasterModeName()); break;
+  case SERVERMODNAME_ASC: case SERVERMODNAME_DEC: setSortKey(item.str, server.getServerModName()); break;
+  case UPTIME_ASC: case UPTIME_DEC: item.num = server.getUptime(); break;
+  case CURRENTUPTIME_ASC: case CURRENTUPTIME_DEC: item.num = server.getCurrentUptime(now); break;
+  case COUNTRYNAME_ASC: case COUNTRYNAME_DEC: setSortKey(item.str, server.getCountry()); break;
+  }
+}
+
+// Sorts the first `count` items; the order of the remaining ones is unspecified
+template <typename T>
+void sortItems(std::vector<SortItem<T>> &items, const bool descending, const size_t count) {
+  auto less = [descending](const SortItem<T> &a, const SortItem<T> &b) {
+    if (a.num != b.num) return (a.num < b.num) != descending;
+    if (const int cmp = a.str.compare(b.str)) return (cmp < 0) != descending;
+    return a.index < b.index;
+  };
+
+  if (count < items.size()) std::partial_sort(items.begin(), items.begin() + count, items.end(), less);
+  else std::sort(items.begin(), items.end(), less);
+}
+
+// *_DEC sorters are odd
+inline bool isDescending(const int sorter) { return sorter & 1; }
+
 } // namespace extinfo
@@ -25,6 +25,7 @@
 #include <cmath>
 #include <algorithm>
 #include "extinfo.h"
+#include "extinfo-internal.h"
 #include "geoip.h"
 #include "main.h"
 #include "tools.h"
@@ -39,6 +40,13 @@ TimeType extPlayerPingInterval;
 TimeType extUptimePingInterval;
 TimeType masterUpdateInterval;
 TimeType masterUpdateRetryInterval;
+TimeType masterHedgeDelay;
+TimeType snapshotInterval;
+TimeType snapshotMaxAge;
+bool simulation;
+int simulationServers;
+int simulationPlayers;
+int simulationChangesPerSecond;
 uint64_t playerSessionID;
 TimeType nowus;
 TimeType now;
@@ -67,6 +75,58 @@ ExtInfoHost hosts[NUMGAMES] = {
   {GAME_INFO_REDECLIPSE}, {GAME_INFO_ASSAULTCUBE}
 };
 
+//
+// Metrics
+//
+
+namespace {
+
+constexpr uint64_t MASTER_UPDATE_BOUNDS[] = {
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 20000000, 30000000, 60000000
+};
+
+std::string gameLabels(const char *game, const char *labels = nullptr) {
+  std::string str = "game=\"";
+  str += game;
+  str += '"';
+  if (labels) str += ',';
+  if (labels) str += labels;
+  return str;
+}
+
+} // anonymous namespace
+
+HostMetrics::HostMetrics(const char *game)
+    : infoPings("csb_pings_total", "Pings sent to game servers.", gameLabels(game, "kind=\"info\"").c_str()),
+      extPlayerPings("csb_pings_total", "Pings sent to game servers.", gameLabels(game, "kind=\"player\"").c_str()),
+      extUptimePings("csb_pings_total", "Pings sent to game servers.", gameLabels(game, "kind=\"uptime\"").c_str()),
+      replies("csb_replies_total", "Replies received from game servers.", gameLabels(game).c_str()),
+      unmatchedReplies("csb_unmatched_replies_total", "Packets received from unknown addresses.",
+                       gameLabels(game).c_str()),
+      brokenInfoUpdates("csb_broken_info_updates_total", "Server info replies which could not be parsed.",
+                        gameLabels(game).c_str()),
+      masterUpdates{
+        {"csb_master_updates_total", "Master server updates by result.",
+         gameLabels(game, "result=\"success\"").c_str()},
+        {"csb_master_updates_total", "Master server updates by result.",
+         gameLabels(game, "result=\"failed\"").c_str()},
+        {"csb_master_updates_total", "Master server updates by result.",
+         gameLabels(game, "result=\"banned\"").c_str()},
+        {"csb_master_updates_total", "Master server updates by result.",
+         gameLabels(game, "result=\"empty\"").c_str()}
+      },
+      masterUpdateDuration("csb_master_update_duration_seconds", "Duration of master server updates.",
+                           gameLabels(game).c_str(), MASTER_UPDATE_BOUNDS),
+      eventCallbackDuration("csb_event_callback_duration_seconds", "Time spent in event callbacks per event.",
+                            gameLabels(game).c_str()) {}
+
+HostMetrics hostMetrics[NUMGAMES] = {
+  HostMetrics(GAME_INFO_SAUERBRATEN.game), HostMetrics(GAME_INFO_TESSERACT.game),
+  HostMetrics(GAME_INFO_REDECLIPSE.game), HostMetrics(GAME_INFO_ASSAULTCUBE.game)
+};
+
+metrics::Counter pingThrottles("csb_ping_throttles_total", "Times pinging was deferred by maxPingsPerSecond.");
+
 ExtInfoHost *getExtInfoHost(const char *game) {
   for (ExtInfoHost &host : hosts)
     if (host.enabled && !std::strcmp(host.info.game, game))
@@ -267,14 +327,18 @@ void readInfoReply(ExtInfoHost *host, Server *server, network::PacketBuf &pb) {
   server->highResPing = (nowus - server->pingVal) / 1000.0f;
   server->ping = std::floor(server->highResPing + 0.5f);
 
+  ShortString str;
+
   auto getMapString = [&]() {
     pb.getString(text, sizeof(text));
-    cubetools::filtertext(server->mapName, sizeof(server->mapName), text, false, false, sizeof(server->mapName) - 1);
+    cubetools::filtertext(str, sizeof(str), text, false, false, sizeof(str) - 1);
+    server->setMapName(str);
   };
 
   auto getServerDescriptionString = [&]() {
     pb.getString(text, sizeof(text));
-    cubetools::filtertext(server->description, sizeof(server->description), text, true, false, sizeof(server->description) - 1);
+    cubetools::filtertext(str, sizeof(str), text, true, false, sizeof(str) - 1);
+    server->setDescription(str);
   };
 
   switch (host->info.identifier) {
@@ -359,6 +423,7 @@ void readInfoReply(ExtInfoHost *host, Server *server, network::PacketBuf &pb) {
 
   if (!server->infoOK || server->numPlayers <= 0) {
     if (!server->infoOK || server->numPlayers < 0) {
+      hostMetrics[host->index].brokenInfoUpdates.add();
       dbg << host->info.game << ": " << server->serverHost << ":"
           << server->address.port - server->host->info.infoPortOffset
           << ": broken info update" << dbg.endl();
@@ -369,6 +434,46 @@ void readInfoReply(ExtInfoHost *host, Server *server, network::PacketBuf &pb) {
   host->event(SERVER_UPDATE, {server});
 }
 
+// Server info fields which are visible to clients.
+// Used to detect whether a reply actually changed anything.
+
+struct ServerInfoState {
+  bool infoOK;
+  int ping;
+  int numPlayers;
+  int protocolVersion;
+  int gameMode;
+  int secondsLeft;
+  int maxPlayers;
+  int masterMode;
+  bool gamePaused;
+  int gameSpeed;
+  int mutators;
+  ShortString mapName;
+  ShortString description;
+  bool extInfoOK;
+  ExtVar<ServerMod> serverMod;
+
+  bool operator!=(const ServerInfoState &in) const {
+    return infoOK != in.infoOK || std::abs(ping - in.ping) >= PING_CHANGE_THRESHOLD ||
+           numPlayers != in.numPlayers || protocolVersion != in.protocolVersion || gameMode != in.gameMode ||
+           secondsLeft != in.secondsLeft || maxPlayers != in.maxPlayers || masterMode != in.masterMode ||
+           gamePaused != in.gamePaused || gameSpeed != in.gameSpeed || mutators != in.mutators ||
+           std::strcmp(mapName, in.mapName) || std::strcmp(description, in.description) ||
+           extInfoOK != in.extInfoOK || serverMod != in.serverMod;
+  }
+
+  ServerInfoState(const Server *server)
+      : infoOK(server->infoOK), ping(server->ping), numPlayers(server->numPlayers),
+        protocolVersion(server->protocolVersion), gameMode(server->gameMode), secondsLeft(server->secondsLeft),
+        maxPlayers(server->maxPlayers), masterMode(server->masterMode), gamePaused(server->gamePaused),
+        gameSpeed(server->gameSpeed), mutators(server->mutators), extInfoOK(server->extended.infoOK),
+        serverMod(server->extended.serverMod) {
+    std::memcpy(mapName, server->mapName, sizeof(mapName));
+    std::memcpy(description, server->description, sizeof(description));
+  }
+};
+
 void read(const network::SelectSocket &socket) {
   network::Address address;
   network::PacketBuf5K pb;
@@ -376,9 +481,17 @@ void read(const network::SelectSocket &socket) {
   ExtInfoHost *host = static_cast<ExtInfoHost *>(socket.data);
   LockGuard(&host->mutex);
   Server *server = const_cast<Server *>(host->findServer(address));
-  if (!server) return;
+
+  if (!server) {
+    hostMetrics[host->index].unmatchedReplies.add();
+    return;
+  }
+
+  hostMetrics[host->index].replies.add();
   updateTime();
+  const ServerInfoState prevState(server);
   readInfoReply(host, server, pb);
+  if (ServerInfoState(server) != prevState) server->infoChanged();
 }
 
 bool limitPings() {
@@ -397,6 +510,7 @@ bool limitPings() {
     return false;
   }
 
+  pingThrottles.add();
   return true;
 }
 
@@ -408,8 +522,15 @@ void process() {
   for (ExtInfoHost &host : hosts) {
     if (!host.enabled) continue;
 
+    if (host.shouldSaveSnapshot()) host.saveSnapshot();
+
     LockGuard(&host.mutex);
 
+    if (host.simulated) {
+      host.processSimulation();
+      continue;
+    }
+
     if (host.masterUpdateThread) host.processUpdateFromMaster();
     if (host.shouldUpdateFromMaster()) host.updateFromMaster();
 
@@ -417,6 +538,7 @@ void process() {
       if (server->infoOK && !server->players.empty() && now - server->lastPong >= oneMinute) {
         server->numPlayers = 0;
         server->deleteAllPlayers();
+        server->infoChanged();
       }
 
       if (server->shouldInfoPing()) {
@@ -462,6 +584,13 @@ bool init() {
   extUptimePingInterval = cfg->getInt("extinfo.serverExtUptimePingInterval", oneSecond * 5, oneHour, oneMinute * 2);
   masterUpdateInterval = cfg->getInt("extinfo.masterUpdateInterval", oneMinute * 5, oneDay, oneHour);
   masterUpdateRetryInterval = cfg->getInt("extinfo.masterUpdateRetryInterval", oneMinute * 5, oneDay, oneHour);
+  masterHedgeDelay = cfg->getInt("extinfo.masterHedgeDelay", 100, oneSecond * 20, oneSecond * 2);
+  snapshotInterval = cfg->getInt("extinfo.snapshotInterval", 0, oneDay, oneMinute * 5);
+  snapshotMaxAge = cfg->getInt("extinfo.snapshotMaxAge", 0, oneDay, oneMinute * 10);
+  simulation = cfg->getBool("extinfo.simulation.enabled", false);
+  simulationServers = cfg->getInt("extinfo.simulation.servers", 1, MAX_SERVERS, 250);
+  simulationPlayers = cfg->getInt("extinfo.simulation.players", 0, MAX_SERVERS * MAX_PLAYERS, 1500);
+  simulationChangesPerSecond = cfg->getInt("extinfo.simulation.changesPerSecond", 0, 100000, 200);
 
   playerSessionID = getRandomNumber();
 
@@ -477,25 +606,40 @@ bool init() {
 
     if (cfg->getBool(*tmpAppend<>(configEntry, ".enabled"), false)) {
       host.enabled = true;
+      host.simulated = simulation;
       host.init(gameIndex - 1);
       ++numEnabledGames;
 
-      const char *masterServer = cfg->getString(*tmpAppend<>(configEntry, ".masterServer"));
+      if (host.simulated) continue;
 
-      if (masterServer) {
+      auto addMasterServer = [&](const char *masterServer) {
         char masterHost[256];
-        if (std::sscanf(masterServer, "%255s %hu", masterHost, &host.masterPort) == 2) host.masterHost = masterHost;
+        uint16_t masterPort;
+        if (std::sscanf(masterServer, "%255s %hu", masterHost, &masterPort) == 2)
+          host.addMasterServer(masterHost, masterPort);
+      };
+
+      const char *masterServer = cfg->getString(*tmpAppend<>(configEntry, ".masterServer"));
+      if (masterServer) addMasterServer(masterServer);
+
+      const char **masterServers = cfg->getStringArray(*tmpAppend<>(configEntry, ".masterServers"));
+
+      if (masterServers) {
+        for (const char **masterServer = masterServers; *masterServer; ++masterServer) addMasterServer(*masterServer);
+        delete[] masterServers;
       }
 
+      if (host.masters.empty()) host.addMasterServer(host.info.masterHost, host.info.masterPort);
+
       const char **additionalServers = cfg->getStringArray(*tmpAppend<>(configEntry, ".additionalServers"));
       if (!additionalServers) continue;
 
       for (const char **server = additionalServers; *server; ++server) {
-        network::Address serverAddress;
         char serverHost[256];
-        if (std::sscanf(*server, "%255s %hu", serverHost, &serverAddress.port) != 2) continue;
-        if (!network::setHostAddress(serverHost, serverAddress)) continue;
-        host.addServer(serverHost, serverAddress, true);
+        uint16_t serverPort;
+        if (std::sscanf(*server, "%255s %hu", serverHost, &serverPort) != 2) continue;
+        LockGuard(&host.mutex);
+        host.resolveAndAddServer(serverHost, serverPort, true);
       }
 
       delete[] additionalServers;
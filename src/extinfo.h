@@ -27,6 +27,7 @@
 #include <deque>
 #include <list>
 #include <string>
+#include <unordered_map>
 #include "network.h"
 #include "tools.h"
 
@@ -98,6 +99,12 @@ constexpr size_t MAX_SERVERS = 512;
 
 constexpr TimeType UNKNOWN_ONLINE_TIME = static_cast<TimeType>(-1);
 
+// Smaller ping changes do not count as a change of a server or player
+constexpr int PING_CHANGE_THRESHOLD = 20;
+
+// Number of deleted servers and players remembered for delta updates
+constexpr size_t MAX_TOMBSTONES = 8192;
+
 enum ServerMod : int {
   SM_INVALID = 0,
   SM_HOPMOD = -2,
@@ -203,7 +210,10 @@ struct Player {
     TimeType connectTime;
     TimeType lastUpdate;
     uint64_t sessionID; // Session ID set by this application
+    uint64_t generation; // Last change (ExtInfoHost::generation)
     const char *country[2];
+    char nameUTF8[(MAX_NAME_LENGTH + 1) * 2]; // Converted when the name changes
+    char teamUTF8[(MAX_TEAM_LENGTH + 6) * 2];
 
     TimeType getOnlineTime(TimeType now = TimeType()) const;
     const char *getOnlineTime(TimeType now, char *buf, size_t size) const;
@@ -216,8 +226,12 @@ struct Player {
 
   const char *getName() const;
   const char *getTeam() const;
+  const char *getNameUTF8() const;
+  const char *getTeamUTF8() const;
 
-  void update(const Player &player);
+  void updateUTF8Strings(const bool name = true, const bool team = true);
+  bool hasChanged(const Player &player) const;
+  bool update(const Player &player); // Returns true if hasChanged()
 };
 
 //
@@ -243,6 +257,9 @@ struct Server {
   bool shouldBeDeleted;
   uint64_t randomNumbers[3];
 
+  uint64_t generation;       // Last change of the server info
+  uint64_t playerGeneration; // Last change of any player, including disconnects
+
   TimeType pingVal;
 
   Ping info;
@@ -267,6 +284,8 @@ struct Server {
   int gameSpeed;
   ShortString mapName;
   ShortString description;
+  char mapNameUTF8[sizeof(ShortString) * 2]; // Set through setMapName() / setDescription()
+  char descriptionUTF8[sizeof(ShortString) * 2];
   int mutators;
   bool infoOK;
 
@@ -288,10 +307,18 @@ struct Server {
   const char *getDescription() const;
   const std::string &getUniqueDescription(FString &description) const;
   const char *getMapName() const;
+  const char *getDescriptionUTF8() const;
+  const char *getMapNameUTF8() const;
+
+  void setDescription(const char *str);
+  void setMapName(const char *str);
 
   int getUptime() const;
   int getCurrentUptime(TimeType now = TimeType()) const;
 
+  void infoChanged();
+  void playerChanged(Player &player);
+
   bool addPlayer(const Player &player);
   bool addOrUpdatePlayer(const Player &player);
   void deletePlayer(decltype(players)::iterator player);
@@ -335,6 +362,7 @@ struct Server {
 struct ParseServersStatus {
   size_t numServers;
   size_t newServers;
+  size_t pendingServers; // waiting for DNS resolution
   size_t deletedServers;
 };
 
@@ -345,19 +373,67 @@ struct MasterUpdateStatus : ParseServersStatus {
   void reset() { std::memset(this, 0, sizeof(*this)); }
 };
 
+struct MasterServer {
+  std::string host;
+  uint16_t port;
+  uint64_t numRequests = 0;
+  uint64_t numSuccesses = 0;
+  uint64_t numFailures = 0;
+  TimeType latency = 0; // Moving average of successful requests (ms)
+  TimeType lastSuccess = 0;
+  TimeType lastFailure = 0;
+
+  bool isHealthy() const { return !lastFailure || lastSuccess > lastFailure; }
+};
+
+// Trigram index over the lower-cased names of all players of a host.
+// Used to narrow down case-insensitive substring searches (findPlayer())
+// to players whose names contain every trigram of the search string.
+
+class PlayerNameIndex {
+public:
+  struct Entry {
+    const Server *server;
+    uint64_t sessionID; // Player::Info::sessionID
+  };
+
+  void add(const Server *server, const Player &player);
+  void remove(const Server *server, const Player &player);
+
+  // Returns false if the string is too short to be looked up
+  bool find(const CString &str, std::vector<Entry> &candidates) const;
+
+  void clear() { trigrams.clear(); }
+
+private:
+  std::unordered_map<uint32_t, std::vector<Entry>> trigrams;
+};
+
+// A deleted server (sessionID == 0) or player
+struct Tombstone {
+  uint64_t generation;
+  network::Address address;
+  uint64_t sessionID;
+};
+
 struct ExtInfoHost {
   const GameInfo info;
   bool enabled;
-  std::string masterHost;
-  uint16_t masterPort;
+  bool simulated; // Generated data, see extinfo-simulation.cpp
+  std::vector<MasterServer> masters; // Fastest healthy master first
   std::deque<int> masterUpdateQueue;
   std::thread *masterUpdateThread;
   MasterUpdateStatus masterUpdateStatus;
   TimeType lastMasterUpdate;
   TimeType lastSuccessMasterUpdate;
+  TimeType lastSnapshot;
   network::Socket socket;
   std::vector<Server *> servers;
+  uint64_t generation; // Bumped whenever server or player data changes
+  std::deque<Tombstone> tombstones;
+  uint64_t tombstoneHorizon; // Deltas since older generations are incomplete
   std::vector<EventCallback> eventCallbacks;
+  PlayerNameIndex playerNameIndex;
   SharedMutex mutex;
   size_t index;
 
@@ -367,20 +443,36 @@ struct ExtInfoHost {
   const Server *findServer(network::Address address, bool extInfoPort = true) const;
 
   int addServer(const char *serverHost, const network::Address &address, bool persist = false);
+  int resolveAndAddServer(const char *serverHost, const uint16_t serverPort, bool persist = false);
   void deleteServer(decltype(servers)::iterator);
   size_t deleteOrphanedServers();
   void markAllNonPersistServersForDeletion();
 
+  uint64_t addTombstone(const network::Address &address, const uint64_t sessionID = 0);
+  bool isDeltaPossible(const uint64_t since) const;
+
   void addEventCallback(const EventCallback &eventCallback);
   void deleteEventCallback(const EventCallback &eventCallback);
   void event(const Event event, const EventData &eventData) const;
 
+  void addMasterServer(const char *masterHost, const uint16_t masterPort);
+  MasterServer *findMasterServer(const std::string &masterHost, const uint16_t masterPort);
+
   bool shouldUpdateFromMaster() const;
 
   void updateFromMaster(int id = -1, bool queue = false);
+  void addServers(const CString &servers, ParseServersStatus &parseServersStatus); // Requires locking
   void parseServers(const CString &servers, ParseServersStatus *parseServersStatus = nullptr, bool lock = true);
   void processUpdateFromMaster();
 
+  const char *getSnapshotFileName(FString &file) const;
+  bool shouldSaveSnapshot() const;
+  bool saveSnapshot();
+  bool loadSnapshot();
+
+  void initSimulation();
+  void processSimulation(); // Requires locking
+
   // Do not call these before network::init()
   void init(const size_t index);
   void deinit();
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <atomic>
 #include "network.h"
+#include "resolver.h"
 #include "geoip.h"
 #include "extinfo.h"
 #include "plugin.h"
@@ -100,7 +101,7 @@ int main() {
     }
 #endif
 
-    if (tools::init() && network::init() && geoip::init() && extinfo::init() && plugin::init()) {
+    if (tools::init() && network::init() && resolver::init() && geoip::init() && extinfo::init() && plugin::init()) {
 
 #ifndef _WIN32
       if (child && !once) {
@@ -120,6 +121,7 @@ int main() {
       *logFile << "*** " << getApplicationNameLC() << " started ***" << logFile->endl();
 
       while (!shutdownRequest && !reloadRequest) {
+        resolver::process();
         extinfo::process();
         plugin::process();
 
@@ -145,6 +147,7 @@ int main() {
 
     plugin::deinit();
     extinfo::deinit();
+    resolver::deinit();
     geoip::deinit();
     network::deinit();
     tools::deinit();
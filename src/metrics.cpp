@@ -0,0 +1,249 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "metrics.h"
+#include "main.h"
+#include "tools.h"
+
+namespace metrics {
+
+namespace {
+
+enum Type {
+  COUNTER,
+  HISTOGRAM
+};
+
+struct Metric {
+  std::string name;
+  std::string help;
+  std::string labels;
+  Type type;
+  size_t index;
+  std::vector<uint64_t> bounds;
+};
+
+struct Values {
+  std::atomic<uint64_t> values[MAX_VALUES];
+  Values() { for (std::atomic<uint64_t> &value : values) value.store(0, std::memory_order_relaxed); }
+};
+
+// The last value catches metrics which did not fit in anymore
+constexpr size_t OVERFLOW_INDEX = MAX_VALUES - 1;
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<Metric> metrics;
+  size_t numValues = 0;
+  std::vector<Values *> threadValues;
+  Values retired; // Of threads which have exited
+};
+
+// Also used by static initializers of other translation units
+Registry &getRegistry() {
+  static Registry *registry = new Registry;
+  return *registry;
+}
+
+size_t registerMetric(const char *name, const char *help, const char *labels, const Type type,
+                      const uint64_t *bounds = nullptr, const size_t numBounds = 0) {
+  Registry &registry = getRegistry();
+  LockGuard(&registry.mutex);
+
+  if (!labels) labels = "";
+
+  for (const Metric &metric : registry.metrics)
+    if (metric.type == type && metric.name == name && metric.labels == labels) return metric.index;
+
+  const size_t numValues = type == HISTOGRAM ? numBounds + 2 : 1;
+
+  if (registry.numValues + numValues > OVERFLOW_INDEX) {
+    err << "metrics: no space left for " << name << ", increase MAX_VALUES" << err.endl();
+    return OVERFLOW_INDEX;
+  }
+
+  registry.metrics.push_back({name, help, labels, type, registry.numValues, {bounds, bounds + numBounds}});
+  registry.numValues += numValues;
+
+  return registry.metrics.back().index;
+}
+
+#ifdef TLS_SUPPORTED
+struct ValuesOwner {
+  Values *values;
+
+  ValuesOwner() : values(new Values) {
+    Registry &registry = getRegistry();
+    LockGuard(&registry.mutex);
+    registry.threadValues.push_back(values);
+  }
+
+  ~ValuesOwner() {
+    Registry &registry = getRegistry();
+    LockGuard(&registry.mutex);
+
+    for (size_t i = 0; i < MAX_VALUES; ++i)
+      registry.retired.values[i].fetch_add(values->values[i].load(std::memory_order_relaxed),
+                                           std::memory_order_relaxed);
+
+    registry.threadValues.erase(std::find(registry.threadValues.begin(), registry.threadValues.end(), values));
+    delete values;
+  }
+};
+
+inline void addValue(const size_t index, const uint64_t value) {
+  thread_local ValuesOwner owner;
+  std::atomic<uint64_t> &v = owner.values->values[index];
+
+  // Only this thread writes to it
+  v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+#else
+// All threads share the values of exited threads
+inline void addValue(const size_t index, const uint64_t value) {
+  getRegistry().retired.values[index].fetch_add(value, std::memory_order_relaxed);
+}
+#endif
+
+// Requires locking
+uint64_t sumValues(const Registry &registry, const size_t index) {
+  uint64_t sum = registry.retired.values[index].load(std::memory_order_relaxed);
+  for (const Values *values : registry.threadValues) sum += values->values[index].load(std::memory_order_relaxed);
+  return sum;
+}
+
+void appendSeconds(std::string &out, const uint64_t microSeconds) {
+  char buf[32];
+  /*std::*/snprintf(buf, sizeof(buf), "%.6f", microSeconds / 1000000.0);
+  out += buf;
+}
+
+void appendSample(std::string &out, const std::string &name, const char *suffix, const std::string &labels,
+                  const char *extraLabel = nullptr) {
+  out += name;
+  out += suffix;
+
+  if (!labels.empty() || extraLabel) {
+    out += '{';
+    out += labels;
+    if (!labels.empty() && extraLabel) out += ',';
+    if (extraLabel) out += extraLabel;
+    out += '}';
+  }
+
+  out += ' ';
+}
+
+} // anonymous namespace
+
+//
+// Counter
+//
+
+void Counter::add(const uint64_t value) const { addValue(index, value); }
+
+Counter::Counter(const char *name, const char *help, const char *labels)
+    : index(registerMetric(name, help, labels, COUNTER)) {}
+
+//
+// Histogram
+//
+
+void Histogram::observe(const uint64_t microSeconds) const {
+  if (index == OVERFLOW_INDEX) return;
+
+  const size_t bucket = std::lower_bound(bounds, bounds + numBounds, microSeconds) - bounds;
+
+  addValue(index + bucket, 1);
+  addValue(index + numBounds + 1, microSeconds);
+}
+
+Histogram::Histogram(const char *name, const char *help, const char *labels, const uint64_t *bounds,
+                     size_t numBounds)
+    : index(registerMetric(name, help, labels, HISTOGRAM, bounds, numBounds)), bounds(bounds),
+      numBounds(numBounds) {}
+
+//
+// Rendering
+//
+
+void render(std::string &out) {
+  Registry &registry = getRegistry();
+  LockGuard(&registry.mutex);
+
+  // Samples of the same metric must be grouped together
+  std::vector<const Metric *> metrics;
+  for (const Metric &metric : registry.metrics) metrics.push_back(&metric);
+  std::stable_sort(metrics.begin(), metrics.end(), [](const Metric *a, const Metric *b) { return a->name < b->name; });
+
+  const std::string *previousName = nullptr;
+  char buf[64];
+
+  for (const Metric *metric : metrics) {
+    if (!previousName || *previousName != metric->name) {
+      out += "# HELP ";
+      out += metric->name;
+      out += ' ';
+      out += metric->help;
+      out += "\n# TYPE ";
+      out += metric->name;
+      out += metric->type == HISTOGRAM ? " histogram\n" : " counter\n";
+      previousName = &metric->name;
+    }
+
+    if (metric->type == COUNTER) {
+      appendSample(out, metric->name, "", metric->labels);
+      out += std::to_string(sumValues(registry, metric->index));
+      out += '\n';
+      continue;
+    }
+
+    uint64_t count = 0;
+
+    for (size_t i = 0; i <= metric->bounds.size(); ++i) {
+      count += sumValues(registry, metric->index + i);
+
+      if (i < metric->bounds.size()) {
+        /*std::*/snprintf(buf, sizeof(buf), "le=\"%.6g\"", metric->bounds[i] / 1000000.0);
+        appendSample(out, metric->name, "_bucket", metric->labels, buf);
+      } else {
+        appendSample(out, metric->name, "_bucket", metric->labels, "le=\"+Inf\"");
+      }
+
+      out += std::to_string(count);
+      out += '\n';
+    }
+
+    appendSample(out, metric->name, "_sum", metric->labels);
+    appendSeconds(out, sumValues(registry, metric->index + metric->bounds.size() + 1));
+    out += '\n';
+    appendSample(out, metric->name, "_count", metric->labels);
+    out += std::to_string(count);
+    out += '\n';
+  }
+}
+
+} // namespace metrics
@@ -0,0 +1,85 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+//
+// Counters and histograms, rendered in the Prometheus text exposition format.
+//
+// Every thread increments a copy of its own (no locked instructions,
+// no shared cache lines), the copies are only summed up by render().
+// Metrics are registered once and live until the process exits;
+// registering the same name and labels again returns the same metric,
+// so plugins can be reloaded.
+//
+
+namespace metrics {
+
+// Values per thread. A counter takes one, a histogram
+// takes one per bucket plus two (+Inf bucket and sum).
+constexpr size_t MAX_VALUES = 4096;
+
+// Upper bounds of the default duration buckets in microseconds
+constexpr uint64_t DURATION_BOUNDS[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+class Counter {
+private:
+  size_t index;
+
+public:
+  void add(const uint64_t value = 1) const;
+
+  // labels: e.g. game="sauerbraten",kind="info" or nullptr
+  Counter(const char *name, const char *help, const char *labels = nullptr);
+};
+
+// Observes durations in microseconds, rendered in seconds
+class Histogram {
+private:
+  size_t index;
+  const uint64_t *bounds;
+  size_t numBounds;
+
+public:
+  void observe(const uint64_t microSeconds) const;
+
+  Histogram(const char *name, const char *help, const char *labels, const uint64_t *bounds, size_t numBounds);
+
+  template <size_t N>
+  Histogram(const char *name, const char *help, const char *labels, const uint64_t (&bounds)[N])
+      : Histogram(name, help, labels, bounds, N) {}
+
+  Histogram(const char *name, const char *help, const char *labels = nullptr)
+      : Histogram(name, help, labels, DURATION_BOUNDS) {}
+};
+
+// Appends all metrics to out
+void render(std::string &out);
+
+} // namespace metrics
+
+#endif // __METRICS_H__
@@ -22,6 +22,7 @@
 #include <cstring>
 #include <cerrno>
 #include <algorithm>
+#include <vector>
 #include <enet/enet.h>
 
 #ifdef _WIN32
@@ -209,73 +210,171 @@ int socketSelect(const SelectSocket *sockets, const size_t numSockets,
 
 bool recvTCPData(const char *hostName, const uint16_t hostPort, const char *request,
                  std::string &content, const size_t limit, const uint32_t timeout) {
-  Address address;
-  uint32_t start = getMilliSeconds();
+  TimeType start = getMilliSeconds();
+  TCPSource source{};
+
+  if (!setHostAddress(hostName, source.address)) return false;
+
+  TimeType elapsed = getMilliSeconds() - start;
+  if (elapsed >= timeout) return false;
+
+  source.address.port = hostPort;
+
+  return recvTCPDataHedged(&source, 1, request, content, timeout, limit, timeout - elapsed) == 0;
+}
+
+int recvTCPDataHedged(TCPSource *sources, const size_t numSources, const char *request, std::string &content,
+                      const uint32_t hedgeDelay, const size_t limit, const uint32_t timeout,
+                      TCPDataCallback callback, void *callbackData) {
+  struct Connection {
+    Socket socket;
+    TCPSource *source;
+    TimeType start;
+    bool active;
+    bool connected;
+    std::string content;
+  };
+
+  const TimeType start = getMilliSeconds();
+  const size_t requestLength = std::strlen(request);
+  std::vector<Connection> connections;
+  size_t nextSource = 0;
+  size_t numStarted = 0;
+  size_t numEmpty = 0;
+  TimeType lastStart = TimeType();
+  int winner = -1;
+
+  connections.reserve(numSources);
+
+  for (size_t i = 0; i < numSources; ++i) {
+    sources[i].started = false;
+    sources[i].failed = false;
+    sources[i].latency = 0;
+  }
 
   auto timeLeft = [&]() {
-    uint32_t diff = getMilliSeconds() - start;
-    if (diff >= timeout) return 0u;
+    TimeType diff = getMilliSeconds() - start;
+    if (diff >= timeout) return TimeType();
     return timeout - diff;
   };
 
-  if (!setHostAddress(hostName, address) || !timeLeft()) return false;
+  auto closeConnection = [](Connection &connection, const bool failed) {
+    deleteSocket(connection.socket);
+    connection.active = false;
+    if (failed) connection.source->failed = true;
+  };
 
-  address.port = hostPort;
-  Socket socket = newSocket(true);
+  auto startConnection = [&]() {
+    TCPSource &source = sources[nextSource++];
+    source.started = true;
 
-  if (enet_socket_set_option(unwrap(socket), ENET_SOCKOPT_NONBLOCK, 1) < 0) goto failRet;
-  if (enet_socket_connect(unwrap(socket), unwrap(address)) != 0) goto failRet;
+    // Does not count as a start, the next source is tried right away
+    if (source.hostName && !setHostAddress(source.hostName, source.address)) {
+      source.failed = true;
+      return;
+    }
 
-  {
-    auto connectSelect = [&]() {
-      ENetSocketSet socketSet;
+    connections.push_back({newSocket(true), &source, getMilliSeconds(), true, false, {}});
+    Connection &connection = connections.back();
 
-      ENET_SOCKETSET_EMPTY(socketSet);
-      ENET_SOCKETSET_ADD(socketSet, unwrap(socket));
+    ++numStarted;
 
-      if (enet_socketset_select(unwrap(socket), &socketSet, &socketSet, timeLeft()) <= 0) return false;
-      if (!ENET_SOCKETSET_CHECK(socketSet, unwrap(socket))) return false;
+    lastStart = connection.start;
 
-      return true;
-    };
+    if (enet_socket_set_option(unwrap(connection.socket), ENET_SOCKOPT_NONBLOCK, 1) < 0 ||
+        enet_socket_connect(unwrap(connection.socket), unwrap(source.address)) != 0)
+      closeConnection(connection, true);
+  };
 
-    if (!connectSelect() || !timeLeft()) goto failRet;
-  }
+  while (winner < 0 && timeLeft()) {
+    size_t numActive = 0;
+    bool receivedData = false;
 
-  ENetBuffer sendBuf;
-  sendBuf.data = const_cast<void *>(static_cast<const void *>(request));
-  sendBuf.dataLength = std::strlen(request);
+    for (const Connection &connection : connections) {
+      if (!connection.active) continue;
+      ++numActive;
+      if (!connection.content.empty()) receivedData = true;
+    }
 
-  if (enet_socket_send(unwrap(socket), unwrap(address), &sendBuf, 1) != static_cast<int>(sendBuf.dataLength)) goto failRet;
+    const bool canHedge = nextSource < numSources && !receivedData;
+    const TimeType sinceLastStart = getMilliSeconds() - lastStart;
 
-  ENetSocketSet socketSet;
-  content.clear();
+    if (canHedge && (!numActive || sinceLastStart >= hedgeDelay)) {
+      startConnection();
+      continue;
+    }
 
-  do {
-    ENET_SOCKETSET_EMPTY(socketSet);
-    ENET_SOCKETSET_ADD(socketSet, unwrap(socket));
+    if (!numActive) break;
 
-    if (enet_socketset_select(unwrap(socket), &socketSet, 0, timeLeft()) <= 0)  break;
-    if (!ENET_SOCKETSET_CHECK(socketSet, unwrap(socket))) break;
+    ENetSocketSet readSocketSet;
+    ENetSocketSet writeSocketSet;
+    ENetSocket highSocket = ENET_SOCKET_NULL;
 
-    unsigned char buf[4096];
-    ssize_t len = socketRecv(socket, nullptr, buf, sizeof(buf));
+    ENET_SOCKETSET_EMPTY(readSocketSet);
+    ENET_SOCKETSET_EMPTY(writeSocketSet);
 
-    if (len < 0) goto failRet;
-    else if (len == 0) break;
+    for (const Connection &connection : connections) {
+      if (!connection.active) continue;
+      ENetSocket socket = unwrap(connection.socket);
+      if (connection.connected) ENET_SOCKETSET_ADD(readSocketSet, socket);
+      else ENET_SOCKETSET_ADD(writeSocketSet, socket);
+      if (socket > highSocket || highSocket == ENET_SOCKET_NULL) highSocket = socket;
+    }
 
-    if (content.length() + len > limit) goto failRet;
+    TimeType wait = timeLeft();
+    if (canHedge) wait = std::min(wait, hedgeDelay - sinceLastStart);
 
-    content.append(reinterpret_cast<const char *>(buf), len);
-  } while (timeLeft());
+    if (enet_socketset_select(highSocket, &readSocketSet, &writeSocketSet, wait) < 0) break;
 
-  deleteSocket(socket);
-  return true;
+    for (size_t i = 0; i < connections.size(); ++i) {
+      Connection &connection = connections[i];
+      if (!connection.active) continue;
+
+      ENetSocket socket = unwrap(connection.socket);
+
+      if (!connection.connected) {
+        if (!ENET_SOCKETSET_CHECK(writeSocketSet, socket)) continue;
+
+        if (socketSend(connection.socket, &connection.source->address,
+                       reinterpret_cast<const unsigned char *>(request), requestLength) <= 0) {
+          closeConnection(connection, true);
+          continue;
+        }
+
+        connection.connected = true;
+        continue;
+      }
+
+      if (!ENET_SOCKETSET_CHECK(readSocketSet, socket)) continue;
+
+      unsigned char buf[16 * 1024];
+      ssize_t len = socketRecv(connection.socket, nullptr, buf, sizeof(buf));
+
+      if (len == 0 && !connection.content.empty()) {
+        connection.source->latency = getMilliSeconds() - connection.start;
+        closeConnection(connection, false);
+        winner = static_cast<int>(i);
+        break;
+      }
+
+      if (len <= 0 || connection.content.length() + len > limit) {
+        // An empty reply is treated as failure so the other sources still get a chance.
+        if (len == 0) ++numEmpty;
+        closeConnection(connection, true);
+        continue;
+      }
+
+      connection.content.append(reinterpret_cast<const char *>(buf), len);
+      if (callback) callback(connection.source - sources, connection.content, callbackData);
+    }
+  }
+
+  for (Connection &connection : connections) if (connection.active) closeConnection(connection, false);
 
-  failRet:;
+  if (winner < 0) return numEmpty && numEmpty == numStarted ? -2 : -1;
 
-  deleteSocket(socket);
-  return false;
+  content.swap(connections[winner].content);
+  return static_cast<int>(connections[winner].source - sources);
 }
 
 //
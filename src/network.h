@@ -78,6 +78,37 @@ inline uint32_t hostToNet(uint32_t val) { return val; }
 inline uint32_t netToHost(uint32_t val) { return val; }
 #endif
 
+// Strict dotted-quad parser that does not need a NUL-terminated string.
+// The result is stored in network byte order (like Address::host).
+
+inline bool parseIPv4Address(const char *str, const size_t length, uint32_t &host) {
+  uint32_t ip = 0;
+  uint32_t octet = 0;
+  size_t numDigits = 0;
+  size_t numOctets = 0;
+
+  for (size_t i = 0; i <= length; ++i) {
+    const char c = i < length ? str[i] : '.';
+
+    if (c >= '0' && c <= '9') {
+      octet = octet * 10 + (c - '0');
+      if (++numDigits > 3 || octet > 0xFF) return false;
+    } else if (c == '.') {
+      if (!numDigits || ++numOctets > 4) return false;
+      ip = ip << 8 | octet;
+      octet = 0;
+      numDigits = 0;
+    } else {
+      return false;
+    }
+  }
+
+  if (numOctets != 4) return false;
+
+  host = hostToNet(ip);
+  return true;
+}
+
 Socket newSocket(bool TCP = false);
 
 void deleteSocket(Socket socket);
@@ -101,6 +132,33 @@ int socketSelect(const SelectSocket *sockets, const size_t numSockets,
 bool recvTCPData(const char *hostName, const uint16_t hostPort, const char *request, std::string &content,
                  const size_t limit = std::numeric_limits<size_t>::max(), const uint32_t maxWait = -1u);
 
+struct TCPSource {
+  Address address;
+  // If set, looked up (blocking) once the source is started; the port is kept
+  const char *hostName;
+
+  // Set by recvTCPDataHedged()
+  bool started;
+  bool failed;
+  uint32_t latency; // Time until the reply was complete (ms)
+};
+
+// Invoked whenever data has been received from a source,
+// content holds everything that has been received so far.
+typedef void (*TCPDataCallback)(const size_t source, const std::string &content, void *callbackData);
+
+// Sends the same request to several sources. The next source is only
+// started if none of the running ones has sent any data within
+// hedgeDelay milliseconds (or if all of them failed). The first
+// complete reply wins, all other connections are closed.
+// Returns the index of the winning source, -2 if every started
+// source closed the connection without sending anything, or -1.
+
+int recvTCPDataHedged(TCPSource *sources, const size_t numSources, const char *request, std::string &content,
+                      const uint32_t hedgeDelay, const size_t limit = std::numeric_limits<size_t>::max(),
+                      const uint32_t maxWait = -1u, TCPDataCallback callback = nullptr,
+                      void *callbackData = nullptr);
+
 //
 // PacketBuf
 //
@@ -0,0 +1,245 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#include "elementprinter.h"
+#include "cube/tools.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace web {
+
+//
+// String Escaping
+//
+// Strings are escaped (and converted from the cube encoding to UTF-8)
+// in a single pass. Each input byte maps to a fixed, already escaped
+// byte sequence. Runs of bytes which are copied unchanged ("plain"
+// bytes) are copied as a whole; with SSE2 / AVX2 16 / 32 bytes are
+// checked at once.
+//
+
+namespace {
+
+enum class Encoding { CUBE, UTF8 };
+
+constexpr size_t MAX_ESCAPED_LENGTH = 6; // \u00XX
+
+struct EscapeTable {
+  struct Entry {
+    unsigned char length;
+    char str[MAX_ESCAPED_LENGTH + 1];
+  };
+
+  Entry entries[256];
+  bool plain[256];
+
+  EscapeTable(const Format format, const Encoding encoding) {
+    for (int c = 0; c < 256; ++c) {
+      Entry &entry = entries[c];
+      const int uni = encoding == Encoding::CUBE ? cubetools::cube2uni(c) : c;
+      const char *escaped = nullptr;
+
+      if (format == Format::XML) {
+        switch (uni) {
+        case '"': escaped = "&#34;"; break;
+        case '&': escaped = "&#38;"; break;
+        case '<': escaped = "&#60;"; break;
+        case '>': escaped = "&#62;"; break;
+        }
+      } else {
+        switch (uni) {
+        case '"': escaped = "\\\""; break;
+        case '\\': escaped = "\\\\"; break;
+        }
+      }
+
+      if (escaped) {
+        entry.length = std::strlen(escaped);
+        std::memcpy(entry.str, escaped, entry.length);
+      } else if (!uni) {
+        entry.length = 0;
+      } else if (uni < 0x20 && format == Format::JSON) {
+        entry.length = /*std::*/snprintf(entry.str, sizeof(entry.str), "\\u%04x", uni);
+      } else if (uni <= 0x7F || encoding == Encoding::UTF8) {
+        entry.length = 1;
+        entry.str[0] = uni;
+      } else { // <= 0x7FF
+        entry.length = 2;
+        entry.str[0] = 0xC0 | (uni >> 6);
+        entry.str[1] = 0x80 | (uni & 0x3F);
+      }
+
+      // Must match the SIMD checks in plainLength()
+      if (encoding == Encoding::CUBE) plain[c] = uni == c && c >= 0x20 && c < 0x7F && !escaped;
+      else plain[c] = uni && !escaped && (uni >= 0x20 || format == Format::XML);
+    }
+  }
+};
+
+const EscapeTable escapeTables[2][2] = {
+  {{Format::XML, Encoding::CUBE}, {Format::XML, Encoding::UTF8}},
+  {{Format::JSON, Encoding::CUBE}, {Format::JSON, Encoding::UTF8}},
+};
+
+template <Format format, Encoding encoding>
+const EscapeTable &getEscapeTable() {
+  return escapeTables[format == Format::JSON][encoding == Encoding::UTF8];
+}
+
+#if defined(__SSE2__) || defined(__AVX2__)
+inline unsigned int trailingZeros(const unsigned int mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Number of plain bytes at the start of [str, end)
+template <Format format, Encoding encoding>
+size_t plainLength(const unsigned char *str, const unsigned char *end) {
+  const unsigned char *const start = str;
+
+#ifdef __AVX2__
+  for (; end - str >= 32; str += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str));
+    __m256i special = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+
+    if (encoding == Encoding::CUBE) {
+      // Signed compare: bytes >= 0x80 are negative and caught here as well
+      special = _mm256_or_si256(special, _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+    } else if (format == Format::JSON) {
+      // Unsigned compare: v < 0x20 <=> min(v, 0x1F) == v
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v));
+    } else {
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    }
+
+    if (format == Format::XML) {
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    } else {
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    }
+
+    const unsigned int mask = _mm256_movemask_epi8(special);
+    if (mask) return str - start + trailingZeros(mask);
+  }
+#endif
+
+#ifdef __SSE2__
+  for (; end - str >= 16; str += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str));
+    __m128i special = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+
+    if (encoding == Encoding::CUBE) {
+      special = _mm_or_si128(special, _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+    } else if (format == Format::JSON) {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v));
+    } else {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    }
+
+    if (format == Format::XML) {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    } else {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    }
+
+    const unsigned int mask = _mm_movemask_epi8(special);
+    if (mask) return str - start + trailingZeros(mask);
+  }
+#endif
+
+  const bool *plain = getEscapeTable<format, encoding>().plain;
+  while (str < end && plain[*str]) ++str;
+
+  return str - start;
+}
+
+template <Format format, Encoding encoding>
+void escapeString(FString &fs, const unsigned char *str, const unsigned char *end) {
+  const EscapeTable &table = getEscapeTable<format, encoding>();
+
+  // The input is escaped in chunks into a stack buffer which fits the
+  // worst case, then appended to fs. Short strings take a single append.
+  // Growing fs to the worst case up front is slower, resize() zero-fills.
+  // Entries are always copied as a whole, hence the extra space.
+  constexpr size_t CHUNK_SIZE = 256;
+  char buf[CHUNK_SIZE * MAX_ESCAPED_LENGTH + sizeof(EscapeTable::Entry::str)];
+
+  while (str < end) {
+    const unsigned char *const chunkEnd = str + std::min<size_t>(CHUNK_SIZE, end - str);
+    char *out = buf;
+
+    while (str < chunkEnd) {
+      const size_t length = plainLength<format, encoding>(str, chunkEnd);
+      std::memcpy(out, str, length);
+      out += length;
+      str += length;
+
+      while (str < chunkEnd && !table.plain[*str]) {
+        // Color codes (\fX) are dropped
+        if (encoding == Encoding::CUBE && *str == '\f') {
+          str += std::min<size_t>(2, end - str);
+          continue;
+        }
+
+        const EscapeTable::Entry &entry = table.entries[*str++];
+        std::memcpy(out, entry.str, sizeof(entry.str));
+        out += entry.length;
+      }
+    }
+
+    fs.append(buf, out - buf);
+  }
+}
+
+template <Encoding encoding>
+void escapeString(FString &fs, const char *str, const size_t length, const Format format) {
+  const unsigned char *begin = reinterpret_cast<const unsigned char *>(str);
+
+  if (format == Format::XML) escapeString<Format::XML, encoding>(fs, begin, begin + length);
+  else escapeString<Format::JSON, encoding>(fs, begin, begin + length);
+}
+
+} // anonymous namespace
+
+void appendEscapedString(FString &fs, const char *str, const size_t length, const Format format) {
+  escapeString<Encoding::UTF8>(fs, str, length, format);
+}
+
+void appendEscapedCubeString(FString &fs, const char *str, const size_t length, const Format format) {
+  escapeString<Encoding::CUBE>(fs, str, length, format);
+}
+
+} // namespace web
@@ -0,0 +1,221 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#ifndef __ELEMENTPRINTER_H__
+#define __ELEMENTPRINTER_H__
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "tools.h"
+
+namespace web {
+
+//
+// Streaming XML / JSON Printer
+//
+// Writes directly into the given FString; nothing is buffered.
+//
+//   node():  XML: <name>...</name>
+//            JSON: "name":{...}, {...} inside of lists and for the root node
+//   list():  XML: nothing, the nodes are printed one after another
+//            JSON: "name":[...]
+//
+
+enum class Format { XML, JSON };
+
+// Escapes an UTF-8 string for the given format (elementprinter.cpp)
+void appendEscapedString(FString &fs, const char *str, const size_t length, const Format format);
+
+// Converts a string in the cube encoding to UTF-8 and escapes it
+// for the given format in a single pass (elementprinter.cpp)
+void appendEscapedCubeString(FString &fs, const char *str, const size_t length, const Format format);
+
+class ElementPrinter {
+private:
+  struct Level {
+    const char *name;
+    bool list;
+    bool first;
+  };
+
+  FString &fs;
+  const Format format;
+  Level levels[8];
+  size_t numLevels = 0;
+  size_t indentation = 0; // XML only
+
+  void indent() {
+    constexpr const char *str[] = {
+      "", " ", "  ", "   ", "    "
+    };
+    fs << str[std::min<size_t>(indentation, sizeofarray(str) - 1)];
+  }
+
+  // JSON: Separator + key of the next value
+  void key(const char *name) {
+    if (!numLevels) {
+      // Implicit root object
+      fs << '{';
+      levels[numLevels++] = {nullptr, false, true};
+    }
+
+    Level &level = levels[numLevels - 1];
+    if (!level.first) fs << ',';
+    level.first = false;
+    if (!level.list) fs << '"' << name << "\":";
+  }
+
+  void push(const char *name, const bool list) {
+    if (numLevels < sizeofarray(levels)) levels[numLevels++] = {name, list, true};
+  }
+
+public:
+  Format getFormat() const { return format; }
+
+  void node(const char *name) {
+    if (format == Format::XML) {
+      indent();
+      fs << '<' << name << ">\n";
+      ++indentation;
+    } else {
+      if (numLevels) key(name);
+      fs << '{';
+    }
+
+    push(name, false);
+  }
+
+  void list(const char *name) {
+    if (format == Format::JSON) {
+      key(name);
+      fs << '[';
+    }
+
+    push(name, true);
+  }
+
+  void end() {
+    if (!numLevels) return;
+    const Level &level = levels[--numLevels];
+
+    if (format == Format::XML) {
+      if (level.list || !level.name) return;
+      --indentation;
+      indent();
+      fs << "</" << level.name << ">\n";
+    } else {
+      fs << (level.list ? ']' : '}');
+    }
+  }
+
+  // Numbers
+  template <typename T> void printElement(const char *name, const T &val) {
+    if (format == Format::XML) {
+      indent();
+      fs << '<' << name << '>' << val << "</" << name << ">\n";
+    } else {
+      key(name);
+      fs << val;
+    }
+  }
+
+  // Two decimal places
+  void printElement(const char *name, const float val) {
+    char str[32];
+    /*std::*/snprintf(str, sizeof(str), "%.2f", val);
+
+    if (format == Format::XML) {
+      indent();
+      fs << '<' << name << '>' << str << "</" << name << ">\n";
+    } else {
+      key(name);
+      fs << str;
+    }
+  }
+
+  // Strings are escaped as needed
+  void printElement(const char *name, const char *val) {
+    if (format == Format::XML) {
+      indent();
+      fs << '<' << name << '>';
+      appendEscapedString(fs, val, std::strlen(val), format);
+      fs << "</" << name << ">\n";
+    } else {
+      key(name);
+      fs << '"';
+      appendEscapedString(fs, val, std::strlen(val), format);
+      fs << '"';
+    }
+  }
+
+  void printElement(const char *name, char *val) { printElement(name, static_cast<const char *>(val)); }
+  void printElement(const char *name, const std::string &val) { printElement(name, val.c_str()); }
+  void printElement(const char *name, const FString &val) { printElement(name, val.c_str()); }
+
+  // Strings in the cube encoding
+  void printCubeString(const char *name, const CString &val) {
+    if (format == Format::XML) {
+      indent();
+      fs << '<' << name << '>';
+      appendEscapedCubeString(fs, *val, val.length(), format);
+      fs << "</" << name << ">\n";
+    } else {
+      key(name);
+      fs << '"';
+      appendEscapedCubeString(fs, *val, val.length(), format);
+      fs << '"';
+    }
+  }
+
+  ElementPrinter(FString &fs, const Format format) : fs(fs), format(format) {
+    if (format == Format::XML) fs << "<?xml version=\"1.0\" ?>\n";
+  }
+
+  ~ElementPrinter() {
+    while (numLevels) end();
+  }
+};
+
+class NodePrinter {
+private:
+  ElementPrinter &elementPrinter;
+
+public:
+  NodePrinter(ElementPrinter &elementPrinter, const char *node) : elementPrinter(elementPrinter) {
+    elementPrinter.node(node);
+  }
+  ~NodePrinter() { elementPrinter.end(); }
+};
+
+class ListPrinter {
+private:
+  ElementPrinter &elementPrinter;
+
+public:
+  ListPrinter(ElementPrinter &elementPrinter, const char *list) : elementPrinter(elementPrinter) {
+    elementPrinter.list(list);
+  }
+  ~ListPrinter() { elementPrinter.end(); }
+};
+
+} // namespace web
+
+#endif // __ELEMENTPRINTER_H__
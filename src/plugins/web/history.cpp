@@ -0,0 +1,462 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+//
+// Player count history
+//
+// Every server gets one fixed size block: the last RAW_SAMPLES player
+// counts as they arrive (one per ping, see extinfo.serverPingInterval)
+// and rings of per minute, hour and day min/max/avg values. The rings
+// are indexed by time (interval number % ring size), so nothing ever
+// needs to be shifted; slots of intervals without samples are marked
+// empty. A block takes about 6 KB no matter how long a server is
+// tracked, 10000 servers take about 62 MB.
+//
+// The history is saved to .tmp/<game>.history every web.historySaveInterval
+// and on shutdown. Layout: HistoryHeader | ServerHistory[numServers]
+// Like the snapshot (extinfo-snapshot.cpp) all records are fixed size
+// and 8-byte aligned. Times are Unix times, so they survive restarts.
+//
+
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <type_traits>
+#include "history.h"
+#include "extinfo.h"
+#include "main.h"
+
+namespace web {
+namespace history {
+
+namespace {
+
+constexpr size_t RAW_SAMPLES = 64;
+
+struct Tier {
+  uint32_t interval; // Seconds
+  uint32_t size;     // Number of intervals
+  uint32_t offset;   // Into ServerHistory::rollups
+};
+
+// MINUTE, HOUR, DAY
+constexpr Tier TIERS[] = {
+  {60, 360, 0},      // 6 hours
+  {3600, 720, 360},  // 30 days
+  {86400, 366, 1080} // 1 year
+};
+
+constexpr size_t NUM_TIERS = sizeofarray(TIERS);
+constexpr size_t NUM_ROLLUPS = 1446;
+
+static_assert(NUM_TIERS == NUM_RESOLUTIONS - MINUTE, "");
+
+// Servers without samples for this long are forgotten
+constexpr uint32_t MAX_IDLE_TIME = 30 * 86400;
+
+constexpr uint16_t NO_DATA = 0xFFFF;
+
+constexpr char HISTORY_MAGIC[4] = {'C', 'S', 'B', 'H'};
+constexpr uint32_t HISTORY_VERSION = 1;
+constexpr uint32_t HISTORY_BYTE_ORDER = 0x01020304;
+
+struct HistoryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t game;
+  uint32_t recordSize;
+  uint32_t numServers;
+  int64_t timeStamp; // Unix time
+};
+
+struct Sample {
+  uint32_t time;
+  uint16_t numPlayers;
+  uint16_t reserved;
+};
+
+// Player counts are capped at 255, avg is in 1/256 players
+struct Rollup {
+  uint8_t min;
+  uint8_t max;
+  uint16_t avg; // NO_DATA if there were no samples
+};
+
+constexpr Rollup EMPTY_ROLLUP = {0, 0, NO_DATA};
+
+// The interval which is currently being collected
+struct Pending {
+  uint32_t bucket; // Unix time / interval
+  uint32_t sum;
+  uint32_t count;  // 0 if there were no samples yet
+  uint8_t min;
+  uint8_t max;
+  uint16_t reserved;
+};
+
+struct ServerHistory {
+  uint32_t host;
+  uint16_t port; // Without info port offset
+  uint16_t reserved;
+  uint32_t lastSample;
+  uint32_t numSamples;
+  Sample samples[RAW_SAMPLES]; // Ring, samples[numSamples % RAW_SAMPLES] is the oldest
+  Pending pending[NUM_TIERS];
+  Rollup rollups[NUM_ROLLUPS];
+
+  void init(const uint32_t host_, const uint16_t port_) {
+    host = host_;
+    port = port_;
+    std::fill(std::begin(rollups), std::end(rollups), EMPTY_ROLLUP);
+  }
+
+  void add(uint32_t time, const int numPlayers) {
+    // Keep the rings in order if the clock goes backwards
+    time = std::max(time, lastSample);
+
+    const uint8_t count = static_cast<uint8_t>(std::min(std::max(numPlayers, 0), 255));
+
+    samples[numSamples++ % RAW_SAMPLES] = {time, count, 0};
+    lastSample = time;
+
+    for (size_t i = 0; i < NUM_TIERS; ++i) {
+      const Tier &tier = TIERS[i];
+      Pending &p = pending[i];
+      const uint32_t bucket = time / tier.interval;
+
+      if (p.count && p.bucket != bucket) {
+        Rollup *ring = rollups + tier.offset;
+        const uint32_t gap = bucket - p.bucket;
+
+        if (gap < tier.size) ring[p.bucket % tier.size] = getRollup(p);
+        for (uint32_t j = 1; j < gap && j <= tier.size; ++j) ring[(p.bucket + j) % tier.size] = EMPTY_ROLLUP;
+
+        p.count = 0;
+      }
+
+      if (!p.count) p = {bucket, 0, 0, 255, 0, 0};
+
+      p.sum += count;
+      p.count++;
+      p.min = std::min(p.min, count);
+      p.max = std::max(p.max, count);
+    }
+  }
+
+  bool getRollup(const size_t tierIndex, const uint32_t bucket, Rollup &rollup) const {
+    const Tier &tier = TIERS[tierIndex];
+    const Pending &p = pending[tierIndex];
+
+    if (!p.count || bucket > p.bucket || p.bucket - bucket >= tier.size) return false;
+
+    if (bucket == p.bucket) rollup = getRollup(p);
+    else rollup = rollups[tier.offset + bucket % tier.size];
+
+    return rollup.avg != NO_DATA;
+  }
+
+  static Rollup getRollup(const Pending &p) {
+    const uint64_t avg = (static_cast<uint64_t>(p.sum) * 256 + p.count / 2) / p.count;
+    return {p.min, p.max, static_cast<uint16_t>(avg)};
+  }
+};
+
+static_assert(std::is_trivially_copyable<HistoryHeader>::value &&
+              std::is_trivially_copyable<ServerHistory>::value, "");
+
+static_assert(!(sizeof(HistoryHeader) % 8) && !(sizeof(ServerHistory) % 8),
+              "history records must be 8-byte aligned");
+
+static_assert(TIERS[NUM_TIERS - 1].offset + TIERS[NUM_TIERS - 1].size == NUM_ROLLUPS, "");
+
+struct GameHistory {
+  SharedMutex mutex;
+  std::unordered_map<uint64_t, std::unique_ptr<ServerHistory>> servers;
+};
+
+GameHistory games[extinfo::NUMGAMES];
+TimeType saveInterval;
+size_t maxServers;
+TimeType lastSave;
+
+const char *RESOLUTION_NAMES[] = {"raw", "minute", "hour", "day"};
+static_assert(sizeofarray(RESOLUTION_NAMES) == NUM_RESOLUTIONS, "");
+
+uint64_t getKey(const uint32_t host, const uint16_t port) {
+  return static_cast<uint64_t>(host) << 16 | port;
+}
+
+uint32_t getUnixTime() {
+  return static_cast<uint32_t>(time(nullptr));
+}
+
+// Requires locking
+ServerHistory *addServer(GameHistory &game, const uint32_t host, const uint16_t port) {
+  if (game.servers.size() >= maxServers) {
+    // Make room by forgetting the server which was seen the longest time ago
+    typedef decltype(game.servers)::value_type Entry;
+    auto oldest = std::min_element(game.servers.begin(), game.servers.end(), [](const Entry &a, const Entry &b) {
+      return a.second->lastSample < b.second->lastSample;
+    });
+    if (oldest == game.servers.end()) return nullptr;
+    game.servers.erase(oldest);
+  }
+
+  std::unique_ptr<ServerHistory> &server = game.servers[getKey(host, port)];
+  server.reset(new ServerHistory());
+  server->init(host, port);
+  return server.get();
+}
+
+void eventCallback(const extinfo::ExtInfoHost *host, const extinfo::Event event,
+                   const extinfo::EventData &eventData, void *) {
+  if (event != extinfo::SERVER_UPDATE) return;
+
+  const extinfo::Server *server = eventData.server;
+  if (!server->infoOK) return;
+
+  GameHistory &game = games[host->index];
+  const uint16_t port = server->address.port - host->info.infoPortOffset;
+
+  LockGuard(&game.mutex);
+
+  auto it = game.servers.find(getKey(server->address.host, port));
+  ServerHistory *serverHistory =
+      it != game.servers.end() ? it->second.get() : addServer(game, server->address.host, port);
+
+  if (serverHistory) serverHistory->add(getUnixTime(), server->numPlayers);
+}
+
+//
+// Persistence
+//
+
+const char *getFileName(const extinfo::ExtInfoHost &host, FString &file) {
+  file.clear();
+  file << TMP_DIR << PATH_DIV << host.info.game << ".history";
+  return file.c_str();
+}
+
+bool save(const extinfo::ExtInfoHost &host) {
+  GameHistory &game = games[host.index];
+  const uint32_t now = getUnixTime();
+  std::string data;
+
+  {
+    LockGuard(&game.mutex);
+
+    for (auto it = game.servers.begin(); it != game.servers.end();) {
+      if (now - it->second->lastSample > MAX_IDLE_TIME) it = game.servers.erase(it);
+      else ++it;
+    }
+
+    data.resize(sizeof(HistoryHeader) + game.servers.size() * sizeof(ServerHistory));
+
+    ServerHistory *record = reinterpret_cast<ServerHistory *>(&data[sizeof(HistoryHeader)]);
+    for (const auto &server : game.servers) *record++ = *server.second;
+
+    HistoryHeader header{};
+    std::memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.byteOrder = HISTORY_BYTE_ORDER;
+    header.game = host.info.identifier;
+    header.recordSize = sizeof(ServerHistory);
+    header.numServers = game.servers.size();
+    header.timeStamp = now;
+
+    std::memcpy(&data[0], &header, sizeof(header));
+  }
+
+  FString file;
+
+  if (!writeFileAtomically(getFileName(host, file), data)) {
+    warn << host.info.game << ": cannot write history '" << file << "'" << warn.endl();
+    return false;
+  }
+
+  return true;
+}
+
+bool load(const extinfo::ExtInfoHost &host) {
+  FString file;
+  MappedFile history;
+
+  if (!history.open(getFileName(host, file))) return false;
+
+  auto invalid = [&](const char *reason) {
+    warn << host.info.game << ": ignoring history '" << file << "': " << reason << warn.endl();
+    return false;
+  };
+
+  if (history.size() < sizeof(HistoryHeader)) return invalid("truncated");
+
+  HistoryHeader header;
+  std::memcpy(&header, history.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic))) return invalid("bad magic");
+  if (header.version != HISTORY_VERSION) return invalid("version mismatch");
+  if (header.byteOrder != HISTORY_BYTE_ORDER || header.recordSize != sizeof(ServerHistory))
+    return invalid("incompatible record layout");
+  if (header.game != static_cast<uint32_t>(host.info.identifier)) return invalid("game mismatch");
+  if ((history.size() - sizeof(HistoryHeader)) / sizeof(ServerHistory) < header.numServers) return invalid("truncated");
+
+  const ServerHistory *records = reinterpret_cast<const ServerHistory *>(history.data() + sizeof(HistoryHeader));
+  const uint32_t now = getUnixTime();
+  GameHistory &game = games[host.index];
+  size_t numServers = 0;
+
+  LockGuard(&game.mutex);
+
+  for (uint32_t i = 0; i < header.numServers && game.servers.size() < maxServers; ++i) {
+    const ServerHistory &record = records[i];
+    if (now - record.lastSample > MAX_IDLE_TIME) continue;
+
+    std::unique_ptr<ServerHistory> &server = game.servers[getKey(record.host, record.port)];
+    if (server) continue;
+
+    server.reset(new ServerHistory(record));
+    ++numServers;
+  }
+
+  *logFile << host.info.game << ": restored the player count history of " << numServers << " servers"
+           << logFile->endl();
+
+  return true;
+}
+
+const Tier &getTier(const Resolution resolution) {
+  return TIERS[resolution - MINUTE];
+}
+
+} // anonymous namespace
+
+bool parseResolution(const char *str, Resolution &resolution) {
+  for (size_t i = 0; i < NUM_RESOLUTIONS; ++i) {
+    if (std::strcmp(str, RESOLUTION_NAMES[i])) continue;
+    resolution = static_cast<Resolution>(i);
+    return true;
+  }
+  return false;
+}
+
+const char *getResolutionName(const Resolution resolution) {
+  return RESOLUTION_NAMES[resolution];
+}
+
+uint32_t getInterval(const Resolution resolution) {
+  return resolution == RAW ? 0 : getTier(resolution).interval;
+}
+
+uint32_t getRetention(const Resolution resolution) {
+  return resolution == RAW ? 0 : getTier(resolution).interval * getTier(resolution).size;
+}
+
+bool get(const extinfo::ExtInfoHost *host, const network::Address &address, const Resolution resolution,
+         const uint32_t from, const uint32_t to, std::vector<Point> &points) {
+  GameHistory &game = games[host->index];
+
+  points.clear();
+
+  SharedLockGuard(&game.mutex);
+
+  auto it = game.servers.find(getKey(address.host, address.port));
+  if (it == game.servers.end()) return false;
+
+  const ServerHistory &server = *it->second;
+
+  if (from > to) return true;
+
+  if (resolution == RAW) {
+    const uint32_t numSamples = std::min<uint32_t>(server.numSamples, RAW_SAMPLES);
+
+    for (uint32_t i = server.numSamples - numSamples; i != server.numSamples; ++i) {
+      const Sample &sample = server.samples[i % RAW_SAMPLES];
+      if (sample.time < from || sample.time > to) continue;
+      points.push_back({sample.time, sample.numPlayers, sample.numPlayers, static_cast<float>(sample.numPlayers)});
+    }
+
+    return true;
+  }
+
+  const size_t tierIndex = resolution - MINUTE;
+  const Tier &tier = TIERS[tierIndex];
+  const uint32_t last = std::min(to / tier.interval, server.pending[tierIndex].bucket);
+
+  // Nothing before the oldest interval the ring can hold
+  const uint32_t first = std::max(from / tier.interval, last >= tier.size ? last - tier.size + 1 : 0);
+
+  for (uint32_t bucket = first; bucket <= last; ++bucket) {
+    Rollup rollup;
+    if (!server.getRollup(tierIndex, bucket, rollup)) continue;
+    points.push_back({bucket * tier.interval, rollup.min, rollup.max, rollup.avg / 256.0f});
+  }
+
+  return true;
+}
+
+void init(const TimeType saveInterval_, const size_t maxServers_) {
+  saveInterval = saveInterval_;
+  maxServers = maxServers_;
+  lastSave = getMilliSeconds();
+
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
+
+    SetLockName(&games[host.index].mutex, "web: history");
+
+    // There is no point in keeping generated data
+    if (saveInterval && !host.simulated) load(host);
+
+    LockGuard(&host.mutex);
+    host.addEventCallback({eventCallback, nullptr});
+  }
+}
+
+void process() {
+  const TimeType now = getMilliSeconds();
+
+  if (!saveInterval || now - lastSave < saveInterval) return;
+  lastSave = now;
+
+  for (const extinfo::ExtInfoHost &host : extinfo::hosts)
+    if (host.enabled && !host.simulated) save(host);
+}
+
+void deinit() {
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
+
+    {
+      LockGuard(&host.mutex);
+      host.deleteEventCallback({eventCallback, nullptr});
+    }
+
+    if (saveInterval && !host.simulated) save(host);
+
+    LockGuard(&games[host.index].mutex);
+    games[host.index].servers.clear();
+  }
+}
+
+} // namespace history
+} // namespace web
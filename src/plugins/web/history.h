@@ -0,0 +1,69 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <cstdint>
+#include <vector>
+#include "tools.h"
+#include "network.h"
+
+namespace extinfo {
+struct ExtInfoHost;
+}
+
+//
+// Player count history of all servers, see history.cpp
+//
+
+namespace web {
+namespace history {
+
+enum Resolution { RAW, MINUTE, HOUR, DAY, NUM_RESOLUTIONS };
+
+struct Point {
+  uint32_t time; // Unix time, start of the interval
+  int min;
+  int max;
+  float avg;
+};
+
+bool parseResolution(const char *str, Resolution &resolution);
+const char *getResolutionName(const Resolution resolution);
+
+// Seconds per point and how far back a resolution reaches. Both are 0
+// for RAW, the raw samples are the last 64 pings.
+uint32_t getInterval(const Resolution resolution);
+uint32_t getRetention(const Resolution resolution);
+
+// Points of [from, to], oldest first. The port is the game port.
+// Returns false if there is no history of this server.
+bool get(const extinfo::ExtInfoHost *host, const network::Address &address, const Resolution resolution,
+         const uint32_t from, const uint32_t to, std::vector<Point> &points);
+
+void init(const TimeType saveInterval, const size_t maxServers);
+void process();
+void deinit();
+
+} // namespace history
+} // namespace web
+
+#endif // __HISTORY_H__
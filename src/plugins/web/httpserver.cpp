@@ -25,21 +25,31 @@
 #include <cstdint>
 #include <cassert>
 #include <mutex>
+#include <algorithm>
 #include <string>
 #include <vector>
-#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
 #include <sys/stat.h>
+#include <dirent.h>
 #include "httpserver.h"
 #include "network.h"
 #include "tools.h"
 #include "main.h"
 #include "plugin.h"
+#include "metrics.h"
 #include <microhttpd.h>
 
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
 #ifdef _WIN32
 #include "compat/win32/compat.h"
 #endif
@@ -53,11 +63,335 @@ std::vector<MHD_Daemon *> daemons;
 FString wwwRoot;
 const char *wwwRootIndexFile;
 unsigned mhdFlags;
+bool threadPerConnection;
+bool suspendResumeSupported;
 int threadPoolSize;
 bool compress;
 int compressionLevel;
-std::mutex callbackMutex;
-std::map<const std::string, Callback *> callbacks;
+
+// Routes are looked up without locking: add/deleteCallback() publish a
+// new immutable table instead of changing the current one. Readers may
+// still use old tables and deleted callbacks, so both are only freed by
+// deinit(), once the daemons are stopped. There are just a few routes
+// and they rarely change.
+
+struct Route {
+  std::string path;
+  Callback *callback;
+};
+
+typedef std::vector<Route> RouteTable; // Sorted by path
+
+std::atomic<const RouteTable *> routes;
+std::mutex callbackMutex; // Serializes route changes
+std::vector<std::unique_ptr<const RouteTable>> routeTables;
+std::vector<std::unique_ptr<Callback>> allCallbacks;
+
+// Waiting in deleteCallback()
+std::mutex uninstallMutex;
+std::condition_variable uninstallCondition;
+} // anonymous namespace
+
+//
+// Static File Cache
+//
+// All files below wwwRoot are loaded into an immutable table, which is
+// replaced as a whole when something changes (inotify, Linux only).
+// Serving a file from the table does not touch the file system.
+//
+
+namespace {
+
+constexpr size_t MAX_STATIC_FILE_SIZE = 32 * 1024 * 1024;
+
+struct StaticFile {
+  std::shared_ptr<const SharedBody> body; // Text files are already compressed
+  time_t lastModified;
+  std::string etag;
+};
+
+typedef std::unordered_map<std::string, StaticFile> StaticFileTable; // Key: Path relative to wwwRoot
+
+bool enableStaticFileCache;
+std::shared_ptr<const StaticFileTable> staticFiles; // Use std::atomic_load() / std::atomic_store()
+std::thread *staticFileWatcher;
+std::atomic<bool> stopStaticFileWatcher;
+int inotifyFd = -1;
+
+const std::string *getCompressedSharedBody(const SharedBody &body);
+
+void loadStaticFiles(StaticFileTable &table, const std::string &root, const std::string &dir,
+                     std::vector<std::string> &dirs) {
+  std::string path = root;
+  if (!dir.empty()) path += PATH_DIV + dir;
+
+  DIR *d = opendir(path.c_str());
+  if (!d) return;
+
+  dirs.push_back(path);
+
+  const std::string rootDir = root + PATH_DIV;
+
+  while (dirent *entry = readdir(d)) {
+    if (*entry->d_name == '.') continue;
+
+    const std::string name = dir.empty() ? entry->d_name : dir + "/" + entry->d_name;
+    const std::string file = root + PATH_DIV + name;
+    char resolvedFile[PATH_MAX];
+    struct stat fileAttr;
+
+    if (lstat(file.c_str(), &fileAttr)) continue;
+
+    if (S_ISDIR(fileAttr.st_mode)) {
+      loadStaticFiles(table, root, name, dirs);
+      continue;
+    }
+
+    // Symlinks must point to a file inside of wwwRoot, symlinked
+    // directories are not followed (they may loop or leave wwwRoot)
+    if (S_ISLNK(fileAttr.st_mode) &&
+        (!realpath(file.c_str(), resolvedFile) || std::strncmp(rootDir.c_str(), resolvedFile, rootDir.length()) ||
+         stat(resolvedFile, &fileAttr)))
+      continue;
+
+    if (!S_ISREG(fileAttr.st_mode) || static_cast<size_t>(fileAttr.st_size) > MAX_STATIC_FILE_SIZE) continue;
+
+    std::shared_ptr<SharedBody> body = std::make_shared<SharedBody>();
+    if (!readFile(file, body->content)) continue;
+    body->mimeType = getMimeType(name.c_str());
+
+    // Weak, the gzip and identity encodings share it
+    char etag[40];
+    /*std::*/snprintf(etag, sizeof(etag), "W/\"%08x-%llx\"", crc32b(body->content.data(), body->content.length()),
+                      static_cast<unsigned long long>(body->content.length()));
+
+    if (compress && !body->content.empty() && !isPictureMimeType(body->mimeType)) getCompressedSharedBody(*body);
+
+    table[name] = {std::move(body), fileAttr.st_mtime, etag};
+  }
+
+  closedir(d);
+}
+
+void reloadStaticFiles() {
+  char resolvedRoot[PATH_MAX];
+
+  std::shared_ptr<StaticFileTable> table = std::make_shared<StaticFileTable>();
+  std::vector<std::string> dirs;
+
+  if (realpath(wwwRoot.c_str(), resolvedRoot)) loadStaticFiles(*table, resolvedRoot, "", dirs);
+
+#ifdef __linux__
+  // New directories need a watch of their own
+  if (inotifyFd != -1) {
+    for (const std::string &dir : dirs) {
+      inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                                IN_MOVED_TO | IN_DELETE_SELF | IN_ATTRIB);
+    }
+  }
+#endif
+
+  dbg << "http: loaded " << table->size() << " static files from '" << wwwRoot << "'" << dbg.endl();
+
+  std::atomic_store(&staticFiles, std::shared_ptr<const StaticFileTable>(std::move(table)));
+}
+
+#ifdef __linux__
+void watchStaticFiles() {
+  char buf[4096];
+
+  auto drain = [&]() {
+    while (read(inotifyFd, buf, sizeof(buf)) > 0);
+  };
+
+  while (!stopStaticFileWatcher) {
+    pollfd pfd = {inotifyFd, POLLIN, 0};
+    if (poll(&pfd, 1, 250) <= 0) continue;
+
+    // Files are often written in several steps; let them settle
+    drain();
+    usleep(100 * 1000);
+    drain();
+
+    reloadStaticFiles();
+  }
+}
+#endif
+
+void initStaticFileCache() {
+#ifdef __linux__
+  inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (inotifyFd == -1) {
+    warn << "http: inotify_init1() failed, static files are not reloaded on changes" << warn.endl();
+  }
+#endif
+
+  reloadStaticFiles();
+
+#ifdef __linux__
+  if (inotifyFd != -1) {
+    stopStaticFileWatcher = false;
+    staticFileWatcher = new std::thread(watchStaticFiles);
+  }
+#endif
+}
+
+void deinitStaticFileCache() {
+  if (staticFileWatcher) {
+    stopStaticFileWatcher = true;
+    staticFileWatcher->join();
+    delete staticFileWatcher;
+    staticFileWatcher = nullptr;
+  }
+
+  if (inotifyFd != -1) {
+    close(inotifyFd);
+    inotifyFd = -1;
+  }
+
+  std::atomic_store(&staticFiles, std::shared_ptr<const StaticFileTable>());
+}
+
+} // anonymous namespace
+
+//
+// Rate Limiting
+//
+// Every client IP address has a token bucket which refills at
+// httpd.rateLimit tokens per second, up to httpd.rateLimitBurst tokens.
+// Requests cost the tokens of their callback (see addCallback()), static
+// files cost DEFAULT_REQUEST_COST. Requests without enough tokens are
+// answered with 429 before anything else is done.
+// Buckets are spread over independently locked shards.
+//
+
+namespace {
+
+constexpr size_t NUM_RATE_LIMIT_SHARDS = 64;
+constexpr size_t MAX_BUCKETS_PER_SHARD = 4096;
+
+struct TokenBucket {
+  uint64_t milliTokens;
+  TimeType lastRefill;
+};
+
+struct alignas(64) RateLimitShard {
+  std::mutex mutex;
+  std::unordered_map<uint32_t, TokenBucket> buckets; // Key: IPv4 address
+};
+
+bool enableRateLimit;
+uint64_t rateLimit;      // Tokens per second == milli tokens per millisecond
+uint64_t rateLimitBurst; // In milli tokens
+RateLimitShard rateLimitShards[NUM_RATE_LIMIT_SHARDS];
+
+// Requires locking
+void refillTokenBucket(TokenBucket &bucket, const TimeType now) {
+  if (now <= bucket.lastRefill) return;
+  bucket.milliTokens = std::min(rateLimitBurst, bucket.milliTokens + (now - bucket.lastRefill) * rateLimit);
+  bucket.lastRefill = now;
+}
+
+// Returns 0 if the request may proceed, the number of seconds
+// until enough tokens are available otherwise
+unsigned int takeTokens(const network::Address &address, const unsigned int cost) {
+  const uint64_t milliTokens = std::min<uint64_t>(cost * 1000ull, rateLimitBurst);
+  const TimeType now = getMilliSeconds();
+  const uint32_t host = address.host;
+
+  RateLimitShard &shard = rateLimitShards[((host * 2654435761u) >> 16) % NUM_RATE_LIMIT_SHARDS];
+  LockGuard(&shard.mutex);
+
+  if (shard.buckets.size() >= MAX_BUCKETS_PER_SHARD && !shard.buckets.count(host)) {
+    // Full buckets do not carry any state
+    for (auto it = shard.buckets.begin(); it != shard.buckets.end();) {
+      refillTokenBucket(it->second, now);
+      if (it->second.milliTokens == rateLimitBurst) it = shard.buckets.erase(it);
+      else ++it;
+    }
+
+    if (shard.buckets.size() >= MAX_BUCKETS_PER_SHARD) shard.buckets.clear();
+  }
+
+  auto inserted = shard.buckets.insert({host, {rateLimitBurst, now}});
+  TokenBucket &bucket = inserted.first->second;
+
+  refillTokenBucket(bucket, now);
+
+  if (bucket.milliTokens < milliTokens) {
+    const uint64_t missing = milliTokens - bucket.milliTokens;
+    return static_cast<unsigned int>((missing + rateLimit * 1000 - 1) / (rateLimit * 1000));
+  }
+
+  bucket.milliTokens -= milliTokens;
+  return 0;
+}
+
+} // anonymous namespace
+
+//
+// Metrics
+//
+// Requests by route and status code, request latencies and response
+// sizes, rendered by /metrics (see metrics.h). Requests without a
+// callback (static files, unknown paths) are counted as route "other".
+//
+
+namespace {
+constexpr unsigned int METRICS_STATUS_CODES[] = {200, 304, 400, 404, 414, 429, 500, 503}; // Others count as "other"
+} // anonymous namespace
+
+struct RouteMetrics {
+  std::string route;
+  std::vector<metrics::Counter> requests; // Indexed like METRICS_STATUS_CODES, "other" last
+  metrics::Histogram duration;
+  metrics::Counter responseBytes;
+
+  void record(const unsigned int code, const TimeType microSeconds, const size_t bytes) const {
+    const size_t i = std::find(std::begin(METRICS_STATUS_CODES), std::end(METRICS_STATUS_CODES), code) -
+                     std::begin(METRICS_STATUS_CODES);
+    requests[i].add();
+    duration.observe(microSeconds);
+    responseBytes.add(bytes);
+  }
+
+  explicit RouteMetrics(const std::string &route)
+      : route(route), duration("csb_http_request_duration_seconds", "Time until the response was queued.",
+                               routeLabel(route).c_str()),
+        responseBytes("csb_http_response_bytes_total", "Response body bytes as sent, after compression.",
+                      routeLabel(route).c_str()) {
+    char code[32];
+
+    for (size_t i = 0; i <= sizeofarray(METRICS_STATUS_CODES); ++i) {
+      if (i < sizeofarray(METRICS_STATUS_CODES)) /*std::*/snprintf(code, sizeof(code), ",code=\"%u\"",
+                                                                  METRICS_STATUS_CODES[i]);
+      else /*std::*/snprintf(code, sizeof(code), ",code=\"other\"");
+
+      requests.emplace_back("csb_http_requests_total", "HTTP requests by route and status code.",
+                            (routeLabel(route) + code).c_str());
+    }
+  }
+
+private:
+  static std::string routeLabel(const std::string &route) { return "route=\"" + route + "\""; }
+};
+
+namespace {
+// Kept until deinit(), like allCallbacks
+std::vector<std::unique_ptr<RouteMetrics>> allRouteMetrics; // Requires callbackMutex
+std::unique_ptr<RouteMetrics> otherRouteMetrics;
+
+metrics::Histogram gzipDuration("csb_http_gzip_duration_seconds", "Time spent compressing response bodies.");
+
+// Requires callbackMutex
+const RouteMetrics *getRouteMetrics(const char *route) {
+  for (const std::unique_ptr<RouteMetrics> &routeMetrics : allRouteMetrics)
+    if (routeMetrics->route == route) return routeMetrics.get();
+
+  allRouteMetrics.emplace_back(new RouteMetrics(route));
+  return allRouteMetrics.back().get();
+}
 } // anonymous namespace
 
 //
@@ -65,11 +399,22 @@ std::map<const std::string, Callback *> callbacks;
 //
 
 void CallbackLocker::acquire() {
-  if (isValid()) ++callback->inUse;
+  if (!isValid()) return;
+
+  ++callback->inUse;
+
+  // deleteCallback() is waiting for the callback to become unused
+  if (callback->uninstallRequest) {
+    release();
+    callback = nullptr;
+  }
 }
 
 void CallbackLocker::release() {
-  if (isValid()) --callback->inUse;
+  if (isValid() && --callback->inUse == 0 && callback->uninstallRequest) {
+    LockGuard(&uninstallMutex);
+    uninstallCondition.notify_all();
+  }
 }
 
 void CallbackLocker::operator=(CallbackLocker &&callbackLocker) {
@@ -79,19 +424,14 @@ void CallbackLocker::operator=(CallbackLocker &&callbackLocker) {
 }
 
 CallbackLocker::CallbackLocker(Callback *callback) : callback(callback) {
-  LockGuard(&callbackMutex);
   acquire();
 }
 
-CallbackLocker::CallbackLocker(const char *uri) {
-  LockGuard(&callbackMutex);
-  callback = getCallback(uri, false);
+CallbackLocker::CallbackLocker(const char *uri) : callback(getCallback(uri)) {
   acquire();
 }
 
 CallbackLocker::~CallbackLocker() {
-  if (!isValid()) return;
-  LockGuard(&callbackMutex);
   release();
 }
 
@@ -99,39 +439,215 @@ CallbackLocker::~CallbackLocker() {
 // Request Callback
 //
 
-bool addCallback(const char *request, Callback::Fun callbackFun) {
+namespace {
+// Requires callbackMutex
+void publishRoutes(std::unique_ptr<RouteTable> table) {
+  std::sort(table->begin(), table->end(), [](const Route &a, const Route &b) { return a.path < b.path; });
+  routes.store(table.get());
+  routeTables.push_back(std::move(table));
+}
+} // anonymous namespace
+
+bool addCallback(const char *request, Callback::Fun callbackFun, const unsigned int cost) {
   LockGuard(&callbackMutex);
-  if (callbacks.find(request) != callbacks.end()) return false;
-  callbacks.insert({request, new Callback{callbackFun}});
+
+  if (getCallback(request)) return false;
+
+  allCallbacks.emplace_back(new Callback{callbackFun, cost, getRouteMetrics(request)});
+
+  const RouteTable *current = routes.load();
+  std::unique_ptr<RouteTable> table(current ? new RouteTable(*current) : new RouteTable);
+  table->push_back({request, allCallbacks.back().get()});
+  publishRoutes(std::move(table));
+
   return true;
 }
 
 void deleteCallback(const char *request) {
+  Callback *callback;
+
+  {
+    LockGuard(&callbackMutex);
+
+    callback = getCallback(request);
+    if (!callback) return;
+
+    std::unique_ptr<RouteTable> table(new RouteTable);
+
+    for (const Route &route : *routes.load())
+      if (route.callback != callback) table->push_back(route);
+
+    publishRoutes(std::move(table));
+  }
+
+  // Requests which already have the callback finish normally
+  callback->uninstallRequest = true;
+
+  std::unique_lock<std::mutex> lock(uninstallMutex);
+  uninstallCondition.wait(lock, [callback]() { return !callback->inUse; });
+}
+
+Callback *getCallback(const char *request) {
+  const RouteTable *table = routes.load(std::memory_order_acquire);
+  if (!table) return nullptr;
+
+  auto it = std::lower_bound(table->begin(), table->end(), request, [](const Route &route, const char *path) {
+    return std::strcmp(route.path.c_str(), path) < 0;
+  });
+
+  if (it == table->end() || std::strcmp(it->path.c_str(), request)) return nullptr;
+  return it->callback;
+}
+
+//
+// Server-Sent Events
+//
+
+void EventStream::wakeUp() {
+  condition.notify_all();
+  for (MHD_Connection *connection : suspended) MHD_resume_connection(connection);
+  suspended.clear();
+}
+
+void EventStream::push(const char *event, const CString &data) {
+  LockGuard(&mutex);
+
+  if (closed || !numClients) return;
+
+  pending += "event: ";
+  pending += event;
+  pending += '\n';
+
+  const char *line = *data;
+  const char *end = line + data.length();
+
   do {
-    {
-      LockGuard(&callbackMutex);
-      decltype(callbacks)::iterator it = callbacks.find(request);
-      if (it == callbacks.end()) return;
-      Callback *callback = it->second;
-      if (!callback->inUse) {
-        delete callback;
-        callbacks.erase(it);
-        break;
+    const char *lineEnd = std::find(line, end, '\n');
+    pending += "data: ";
+    pending.append(line, lineEnd);
+    pending += '\n';
+    line = lineEnd + 1;
+  } while (line < end);
+
+  pending += '\n';
+}
+
+void EventStream::flush() {
+  LockGuard(&mutex);
+
+  if (pending.empty()) return;
+
+  if (buffer.length() + pending.length() > MAX_EVENT_STREAM_BUFFER) {
+    // Clients which are still reading the dropped part are disconnected
+    const size_t length = std::min(buffer.length(), buffer.length() / 2 + pending.length());
+    buffer.erase(0, length);
+    bufferStart += length;
+  }
+
+  buffer += pending;
+  pending.clear();
+
+  wakeUp();
+}
+
+void EventStream::keepAlive() {
+  {
+    LockGuard(&mutex);
+    if (!numClients) return;
+    pending += ":\n\n";
+  }
+
+  flush();
+}
+
+void EventStream::close() {
+  LockGuard(&mutex);
+  closed = true;
+  wakeUp();
+}
+
+size_t EventStream::getNumClients() const {
+  LockGuard(&mutex);
+  return numClients;
+}
+
+struct EventStreamReader {
+  std::shared_ptr<EventStream> stream;
+  MHD_Connection *connection;
+  uint64_t pos;
+
+  ssize_t read(char *buf, const size_t max) {
+    std::unique_lock<std::mutex> lock(stream->mutex);
+
+    while (true) {
+      if (stream->closed) return MHD_CONTENT_READER_END_OF_STREAM;
+      if (pos < stream->bufferStart) return MHD_CONTENT_READER_END_WITH_ERROR; // Fell behind
+
+      const size_t available = stream->bufferStart + stream->buffer.length() - pos;
+
+      if (available) {
+        const size_t length = std::min(max, available);
+        std::memcpy(buf, stream->buffer.data() + (pos - stream->bufferStart), length);
+        pos += length;
+        return length;
+      }
+
+      if (!threadPerConnection) {
+        // Resumed by the next flush()
+        stream->suspended.push_back(connection);
+        MHD_suspend_connection(connection);
+        return 0;
       }
-      callback->uninstallRequest = true;
+
+      stream->condition.wait(lock);
     }
-    usleep(1000);
-  } while (true);
+  }
+
+  EventStreamReader(const std::shared_ptr<EventStream> &stream, MHD_Connection *connection)
+      : stream(stream), connection(connection) {
+    LockGuard(&stream->mutex);
+    ++stream->numClients;
+    pos = stream->bufferStart + stream->buffer.length();
+  }
+
+  ~EventStreamReader() {
+    LockGuard(&stream->mutex);
+    --stream->numClients;
+    std::vector<MHD_Connection *> &suspended = stream->suspended;
+    suspended.erase(std::remove(suspended.begin(), suspended.end(), connection), suspended.end());
+  }
+};
+
+//
+// Deferred Responses
+//
+
+bool DeferredResponse::suspend(MHD_Connection *connection) {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (completed) return false;
+
+  if (!suspendResumeSupported) {
+    condition.wait(lock, [this]() { return completed; });
+    return false;
+  }
+
+  // complete() waits for the mutex, so it cannot resume before
+  this->connection = connection;
+  MHD_suspend_connection(connection);
+  return true;
 }
 
-Callback *getCallback(const char *request, bool lock) {
-  LockGuard(lock ? &callbackMutex : nullptr);
-  decltype(callbacks)::iterator it = callbacks.find(request);
-  if (it != callbacks.end()) {
-    Callback *callback = it->second;
-    if (!callback->uninstallRequest) return callback;
+void DeferredResponse::complete() {
+  LockGuard(&mutex);
+
+  completed = true;
+  condition.notify_all();
+
+  if (connection) {
+    MHD_resume_connection(connection);
+    connection = nullptr;
   }
-  return nullptr;
 }
 
 //
@@ -140,6 +656,45 @@ Callback *getCallback(const char *request, bool lock) {
 
 namespace {
 
+bool isNotModifiedSince(const Request &request, const time_t lastModified) {
+  const char *ifModifiedSince = getHeaderParamater(request, MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+  struct tm tm;
+
+  if (!ifModifiedSince || !strptime(ifModifiedSince, "%a, %d %b %Y %H:%M:%S", &tm)) return false;
+
+  const char *timeZone = std::strrchr(ifModifiedSince, ' ');
+
+  return timeZone && (!strncasecmp(timeZone + 1, "GMT", 3) || !strncasecmp(timeZone + 1, "UTC", 3)) &&
+         mkgmtime(&tm) == lastModified;
+}
+
+bool readCachedFileIntoResponseStream(const StaticFileTable &table, Request &request, Response &response) {
+  if (*request.parsedURI != '/') return false;
+  const char *file = request.parsedURI + 1;
+  if (!*file) file = wwwRootIndexFile;
+
+  StaticFileTable::const_iterator it = table.find(file);
+  if (it == table.end()) return false;
+
+  const StaticFile &staticFile = it->second;
+
+  response.etag = staticFile.etag;
+
+  // If-None-Match takes precedence over If-Modified-Since
+  const bool notModified = getHeaderParamater(request, MHD_HTTP_HEADER_IF_NONE_MATCH)
+                               ? etagMatches(request, staticFile.etag)
+                               : isNotModifiedSince(request, staticFile.lastModified);
+
+  if (notModified) {
+    response.code = MHD_HTTP_NOT_MODIFIED;
+    return true;
+  }
+
+  response.lastModified = staticFile.lastModified;
+  response.sharedBody = staticFile.body;
+  return true;
+}
+
 bool readRequestFileIntoResponseStream(Request &request, Response &response) {
   if (*request.parsedURI != '/') return false;
   const char *file = request.parsedURI + 1;
@@ -183,18 +738,11 @@ bool readRequestFileIntoResponseStream(Request &request, Response &response) {
   if (stat(strFile.c_str(), &fileAttr) || !S_ISREG(fileAttr.st_mode)) return false;
 
   response.lastModified = fileAttr.st_mtime;
-  const char *ifModifiedSince = getHeaderParamater(request, MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
-  struct tm tm;
 
-  if (ifModifiedSince && strptime(ifModifiedSince, "%a, %d %b %Y %H:%M:%S", &tm)) {
-    const char *timeZone = std::strrchr(ifModifiedSince, ' ');
-
-    if (timeZone && (!strncasecmp(timeZone + 1, "GMT", 3) || !strncasecmp(timeZone + 1, "UTC", 3)) &&
-                     mkgmtime(&tm) == response.lastModified) {
-      response.code = MHD_HTTP_NOT_MODIFIED;
-      response.lastModified = 0;
-      return true;
-    }
+  if (isNotModifiedSince(request, response.lastModified)) {
+    response.code = MHD_HTTP_NOT_MODIFIED;
+    response.lastModified = 0;
+    return true;
   }
 
   if (!readFile(strFile, response.content)) return false;
@@ -226,6 +774,77 @@ void *requestLogger(void *, const char *uri, struct MHD_Connection *connection)
   return request;
 }
 
+#if MHD_VERSION >= 0x00097302
+
+// MHD sends straight from the body and releases it when done
+
+void releaseSharedBody(void *cls) {
+  delete static_cast<std::shared_ptr<const SharedBody> *>(cls);
+}
+
+MHD_Response *createSharedBodyResponse(std::shared_ptr<const SharedBody> body, const std::string &data) {
+  std::shared_ptr<const SharedBody> *ref = new std::shared_ptr<const SharedBody>(std::move(body));
+  MHD_Response *resp =
+      MHD_create_response_from_buffer_with_free_callback_cls(data.length(), data.data(), releaseSharedBody, ref);
+  if (!resp) delete ref;
+  return resp;
+}
+
+#else
+
+struct SharedBodyReader {
+  std::shared_ptr<const SharedBody> body;
+  const std::string *data;
+};
+
+ssize_t readSharedBody(void *cls, uint64_t pos, char *buf, size_t max) {
+  const std::string &data = *static_cast<SharedBodyReader *>(cls)->data;
+  if (pos >= data.length()) return MHD_CONTENT_READER_END_OF_STREAM;
+  const size_t length = std::min<size_t>(max, data.length() - pos);
+  std::memcpy(buf, data.data() + pos, length);
+  return length;
+}
+
+void freeSharedBody(void *cls) {
+  delete static_cast<SharedBodyReader *>(cls);
+}
+
+MHD_Response *createSharedBodyResponse(std::shared_ptr<const SharedBody> body, const std::string &data) {
+  SharedBodyReader *reader = new SharedBodyReader{std::move(body), &data};
+  MHD_Response *resp =
+      MHD_create_response_from_callback(data.length(), 32 * 1024, readSharedBody, reader, freeSharedBody);
+  if (!resp) delete reader;
+  return resp;
+}
+
+#endif
+
+ssize_t readEventStream(void *cls, uint64_t, char *buf, size_t max) {
+  return static_cast<EventStreamReader *>(cls)->read(buf, max);
+}
+
+void freeEventStreamReader(void *cls) {
+  delete static_cast<EventStreamReader *>(cls);
+}
+
+const std::string *getCompressedSharedBody(const SharedBody &body) {
+  std::call_once(body.compressOnce, [&]() {
+    const TimeType start = getMicroSeconds();
+    size_t length = compressBufSize(body.content.length());
+    body.compressedContent.resize(length);
+    if (::compress(&body.compressedContent[0], length, body.content.data(), body.content.length(),
+                   compressionLevel, true)) {
+      body.compressedContent.resize(length);
+      body.compressedContent.shrink_to_fit();
+    } else {
+      body.compressedContent.clear();
+    }
+    gzipDuration.observe(getMicroSeconds() - start);
+  });
+
+  return body.compressedContent.empty() ? nullptr : &body.compressedContent;
+}
+
 void requestCompleted(void *, struct MHD_Connection *, void **reqCls, enum MHD_RequestTerminationCode) {
   Request *request = getRequest(reqCls);
   if (!request) return;
@@ -243,33 +862,70 @@ int request(void *, MHD_Connection *connection, const char *uri, const char *met
   Request &request = *requestPtr;
   request.parsedURI = uri;
 
-  // Must assign a value here to work around a bug in libstdc++
-  // https://gcc.gnu.org/ml/gcc/2013-02/msg00227.html
-
-  thread_local FString content = " ";
-  content.clear();
+  // Responses are rendered into a body of their own, which is then
+  // handed over to MHD without copying it.
+  std::shared_ptr<SharedBody> body = std::make_shared<SharedBody>();
 
-  Response response{content};
+  Response response{body->content};
   CallbackLocker callback;
+  std::shared_ptr<const StaticFileTable> staticFileTable;
 
-  if (request.uri.length() <= MAX_URI_LENGTH) {
-    bool ok;
-
-    callback = CallbackLocker(uri);
+  char retryAfter[16];
+  unsigned int waitTime = 0;
+  const RouteMetrics *routeMetrics = otherRouteMetrics.get();
 
-    if (callback.isValid()) ok = callback->fun({request, response});
-    else ok = readRequestFileIntoResponseStream(request, response);
+  if (request.deferred) {
+    // Resumed by DeferredResponse::complete()
+    response.sharedBody = request.deferred->body;
+    request.deferred.reset();
+    if (const Callback *resumedCallback = getCallback(uri)) routeMetrics = resumedCallback->metrics;
+  } else {
+    if (request.uri.length() <= MAX_URI_LENGTH) {
+      callback = CallbackLocker(uri);
+      if (callback.isValid()) routeMetrics = callback->metrics;
+      const unsigned int cost = callback.isValid() ? callback->cost : DEFAULT_REQUEST_COST;
+      if (enableRateLimit) waitTime = takeTokens(request.address, cost);
+    }
 
-    if (!ok) {
-      response.code = MHD_HTTP_BAD_REQUEST;
-      if (response.content.empty()) response.content << "Bad Request";
+    if (waitTime) {
+      /*std::*/snprintf(retryAfter, sizeof(retryAfter), "%u", waitTime);
+      response.code = 429; // Too Many Requests
+      response.headers.push_back({"Retry-After", retryAfter});
+      response.content << "Too Many Requests";
+    } else if (request.uri.length() <= MAX_URI_LENGTH) {
+      bool ok;
+
+      if (callback.isValid()) ok = callback->fun({request, response});
+      else if ((staticFileTable = std::atomic_load(&staticFiles)))
+        ok = readCachedFileIntoResponseStream(*staticFileTable, request, response);
+      else ok = readRequestFileIntoResponseStream(request, response);
+
+      if (!ok) {
+        response.code = MHD_HTTP_BAD_REQUEST;
+        if (response.content.empty()) response.content << "Bad Request";
+      }
+    } else {
+      response.code = MHD_HTTP_REQUEST_URI_TOO_LONG;
+      response.content << "Request-URI Too Long";
     }
-  } else {
-    response.code = MHD_HTTP_REQUEST_URI_TOO_LONG;
-    response.content << "Request-URI Too Long";
   }
 
-  if (!response.content.empty() && !response.mimeType) response.mimeType = "text/html; charset=utf-8";
+  if (response.deferred) {
+    // MHD calls request() again once the response is complete
+    request.deferred = response.deferred;
+    if (response.deferred->suspend(connection)) return MHD_YES;
+    request.deferred.reset();
+    response.sharedBody = response.deferred->body;
+  }
+
+  if (response.sharedBody) {
+    response.code = response.sharedBody->code;
+    response.mimeType = response.sharedBody->mimeType;
+  }
+
+  const FString &responseContent = response.sharedBody ? response.sharedBody->content : response.content;
+
+  if (!responseContent.empty() && !response.mimeType) response.mimeType = "text/html; charset=utf-8";
 
   //
   // Internet Explorer and friends are sending 'Accept-Encoding: deflate, gzip'
@@ -277,43 +933,37 @@ int request(void *, MHD_Connection *connection, const char *uri, const char *met
   // content decoding errors. http://stackoverflow.com/a/5186177
   //
 
-  bool compressResponse = compress && !response.content.empty() && encodingSupported(request, "gzip");
-  if (compressResponse && response.mimeType && isPictureMimeType(response.mimeType)) compressResponse = false;
+  // Caches must not hand gzipped bodies to clients which cannot decode them
+  const bool compressible = compress && !response.eventStream &&
+                            !(response.mimeType && isPictureMimeType(response.mimeType));
 
-  MHD_Response *resp;
-
-  if (compressResponse) {
-    size_t length = compressBufSize(response.content.length());
-    void *buf;
+  bool compressResponse = compressible && !responseContent.empty() && encodingSupported(request, "gzip");
 
-#ifdef _MSC_VER
-    const auto &malloc = mingw_malloc;
-    const auto &free = mingw_free;
-#endif
+  MHD_Response *resp;
+  size_t responseBytes = 0;
 
-    buf = malloc(length);
-    if (!buf) return MHD_NO;
+  if (response.eventStream) {
+    EventStreamReader *reader = new EventStreamReader(response.eventStream, connection);
+    resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4 * 1024, readEventStream, reader,
+                                             freeEventStreamReader);
 
-    if (!::compress(buf, length, response.content.data(), response.content.length(), compressionLevel, true)) {
-      free(buf);
-      compressResponse = false;
-      goto noCompression;
+    if (!resp) {
+      delete reader;
+      return MHD_NO;
     }
-
-    resp = MHD_create_response_from_buffer(length, buf, MHD_RESPMEM_MUST_FREE);
   } else {
-    noCompression:;
+    if (!response.sharedBody) response.sharedBody = std::move(body);
 
-    MHD_ResponseMemoryMode memoryModel;
+    // Shared bodies are rendered and compressed only once.
+    const std::string *data = compressResponse ? getCompressedSharedBody(*response.sharedBody) : nullptr;
 
-#ifdef TLS_SUPPORTED
-    memoryModel = MHD_RESPMEM_PERSISTENT;
-#else
-    memoryModel = MHD_RESPMEM_MUST_COPY;
-#endif
+    if (!data) {
+      data = &response.sharedBody->content;
+      compressResponse = false;
+    }
 
-    void *data = const_cast<void *>(reinterpret_cast<const void *>(response.content.data()));
-    resp = MHD_create_response_from_buffer(response.content.length(), data, memoryModel);
+    responseBytes = data->length();
+    resp = createSharedBodyResponse(response.sharedBody, *data);
   }
 
   if (!resp) return MHD_NO;
@@ -332,6 +982,7 @@ int request(void *, MHD_Connection *connection, const char *uri, const char *met
       ADD_RESPONSE_HEADER(MHD_HTTP_HEADER_LAST_MODIFIED, buf);
   }
 
+  if (!response.etag.empty()) ADD_RESPONSE_HEADER(MHD_HTTP_HEADER_ETAG, response.etag.c_str());
   if (response.mimeType) ADD_RESPONSE_HEADER(MHD_HTTP_HEADER_CONTENT_TYPE, response.mimeType);
   if (compressResponse) ADD_RESPONSE_HEADER(MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
 
@@ -343,13 +994,30 @@ int request(void *, MHD_Connection *connection, const char *uri, const char *met
   }
 #endif
 
-  for (const Header &header : response.headers) ADD_RESPONSE_HEADER(header.name, header.value);
+  bool varySent = false;
+
+  for (const Header &header : response.headers) {
+    if (compressible && !strcasecmp(header.name, MHD_HTTP_HEADER_VARY)) {
+      thread_local std::string vary;
+      vary = header.value;
+      vary += ", Accept-Encoding";
+      ADD_RESPONSE_HEADER(header.name, vary.c_str());
+      varySent = true;
+      continue;
+    }
+
+    ADD_RESPONSE_HEADER(header.name, header.value);
+  }
+
+  if (compressible && !varySent) ADD_RESPONSE_HEADER(MHD_HTTP_HEADER_VARY, "Accept-Encoding");
 
 #undef ADD_RESPONSE_HEADER
 
   retVal = MHD_queue_response(connection, response.code, resp);
   MHD_destroy_response(resp);
 
+  routeMetrics->record(response.code, getMicroSeconds() - request.start, responseBytes);
+
   // Log the HTTP-Request
 
   thread_local FString logEntry;
@@ -369,7 +1037,7 @@ int request(void *, MHD_Connection *connection, const char *uri, const char *met
   logEntry << " [" << response.code << "]";
   if (compressResponse) logEntry << " [gzip]";
 
-  *logFile << logEntry << logFile->endl();
+  logFile->writeLine(logEntry);
 
   return retVal;
 }
@@ -404,6 +1072,36 @@ const char *getUserAgent(const Request &request, const char *fallback) {
   return getHeaderParamater(request, MHD_HTTP_HEADER_USER_AGENT, fallback);
 }
 
+// Weak comparison as required for If-None-Match (RFC 7232, 3.2)
+bool etagMatches(const Request &request, const std::string &etag) {
+  const char *ifNoneMatch = getHeaderParamater(request, MHD_HTTP_HEADER_IF_NONE_MATCH);
+  if (!ifNoneMatch || etag.empty()) return false;
+
+  const size_t tagOffset = etag.compare(0, 2, "W/") ? 0 : 2;
+  const char *tag = etag.data() + tagOffset;
+  const size_t tagLength = etag.length() - tagOffset;
+
+  const char *p = ifNoneMatch;
+
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (*p == '*') return true;
+    if (!std::strncmp(p, "W/", 2)) p += 2;
+
+    const char *end = p;
+    while (*end && *end != ',') end++;
+
+    size_t length = end - p;
+    while (length && (p[length - 1] == ' ' || p[length - 1] == '\t')) length--;
+
+    if (length == tagLength && !std::memcmp(p, tag, length)) return true;
+
+    p = end;
+  }
+
+  return false;
+}
+
 bool encodingSupported(const Request &request, const char *encoding) {
   const char *param = getHeaderParamater(request, "Accept-Encoding");
   const ptrdiff_t encodingStrLen = std::strlen(encoding);
@@ -518,8 +1216,8 @@ bool isPictureMimeType(const char *mimeType) {
           !std::strcmp(mimeType, "image/png") || !std::strcmp(mimeType, "image/x-icon"));
 }
 
-int getThreadPoolSize() {
-  return threadPoolSize;
+bool eventStreamsSupported() {
+  return threadPerConnection || suspendResumeSupported;
 }
 
 bool init() {
@@ -533,8 +1231,18 @@ bool init() {
   if (wwwRoot.empty()) wwwRoot << pluginDataDir << PATH_DIV << "www";
 
   wwwRootIndexFile = plugincfg->getString("httpd.wwwRootIndexFile", "index.html");
+  otherRouteMetrics.reset(new RouteMetrics("other"));
+
+  SetLockName(&callbackMutex, "httpd: callbacks");
+  for (RateLimitShard &shard : rateLimitShards) SetLockName(&shard.mutex, "httpd: rate limit shard");
   compress = plugincfg->getBool("httpd.enableCompression", true);
   compressionLevel = plugincfg->getInt("httpd.compressionLevel", 1, 9, 5);
+  enableStaticFileCache = plugincfg->getBool("httpd.enableStaticFileCache", true);
+  enableRateLimit = plugincfg->getBool("httpd.enableRateLimit", true);
+  rateLimit = plugincfg->getInt("httpd.rateLimit", 1, 100000, 20);
+  rateLimitBurst = plugincfg->getInt("httpd.rateLimitBurst", 1, 1000000, 100) * 1000ull;
+
+  if (enableStaticFileCache) initStaticFileCache();
 
   mhdFlags = 0;
 
@@ -548,7 +1256,18 @@ bool init() {
   if (plugincfg->getBool("httpd.usePoll", false)) mhdFlags |= MHD_USE_POLL_INTERNALLY;
   else mhdFlags |= MHD_USE_SELECT_INTERNALLY;
 
-  if (plugincfg->getBool("httpd.useThreadPerConnection", true)) mhdFlags |= MHD_USE_THREAD_PER_CONNECTION;
+  threadPerConnection = plugincfg->getBool("httpd.useThreadPerConnection", true);
+  suspendResumeSupported = false;
+
+  if (threadPerConnection) {
+    mhdFlags |= MHD_USE_THREAD_PER_CONNECTION;
+  } else if (mhdVersion >= Version(0, 9, 34)) {
+    // Needed by event streams to wait for new messages
+    mhdFlags |= static_cast<MHD_FLAG>(8192 | 1024) /* MHD_USE_SUSPEND_RESUME */;
+    suspendResumeSupported = true;
+  } else {
+    warn << "MHD_USE_SUSPEND_RESUME not supported, event streams are disabled" << warn.endl();
+  }
 
   threadPoolSize = plugincfg->getInt("httpd.threadPoolSize", 0, 1000, 2);
 
@@ -636,6 +1355,17 @@ bool init() {
 void deinit() {
   for (MHD_Daemon *daemon : daemons) MHD_stop_daemon(daemon);
   daemons.clear();
+
+  deinitStaticFileCache();
+
+  // No request is running anymore
+  routes.store(nullptr);
+  routeTables.clear();
+  allCallbacks.clear();
+  allRouteMetrics.clear();
+  otherRouteMetrics.reset();
+
+  for (RateLimitShard &shard : rateLimitShards) shard.buckets.clear();
 }
 
 } // namespace httpserver
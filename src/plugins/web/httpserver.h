@@ -26,6 +26,10 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <cstdint>
 #include "main.h"
 #include "network.h"
@@ -41,13 +45,17 @@ namespace httpserver {
 
 constexpr size_t MAX_URI_LENGTH = 512;
 
+class DeferredResponse;
+struct RouteMetrics;
+
 struct Request {
-  //TimeType start = getNanoSeconds();
+  TimeType start = getMicroSeconds();
   MHD_Connection *connection;
   network::Address address;
   char IPAddress[64];
   std::string uri;
   const char *parsedURI;
+  std::shared_ptr<DeferredResponse> deferred; // Set while suspended
 };
 
 struct Header {
@@ -55,13 +63,88 @@ struct Header {
   const char *value;
 };
 
+// Immutable, reference-counted response body which can be shared
+// between requests (see Response::sharedBody). MHD sends directly from
+// it and holds a reference until the transfer is done. The gzip version
+// is created on first use.
+
+struct SharedBody {
+  FString content;
+  unsigned int code = 200;
+  const char *mimeType = nullptr;
+
+  mutable std::once_flag compressOnce;
+  mutable std::string compressedContent;
+};
+
+// Server-Sent Events stream. Messages are written once into a shared
+// buffer and all clients of the stream read from there. Clients which
+// fall behind by more than MAX_EVENT_STREAM_BUFFER bytes are dropped
+// and have to reconnect.
+
+constexpr size_t MAX_EVENT_STREAM_BUFFER = 1024 * 1024;
+
+class EventStream {
+private:
+  friend struct EventStreamReader;
+
+  mutable std::mutex mutex;
+  std::condition_variable condition;
+  std::string pending;       // Not yet visible to clients
+  std::string buffer;
+  uint64_t bufferStart = 0;  // Stream position of buffer[0]
+  std::vector<MHD_Connection *> suspended;
+  size_t numClients = 0;
+  bool closed = false;
+
+  void wakeUp(); // Requires locking
+
+public:
+  // Multi-line data is split into multiple data: lines
+  void push(const char *event, const CString &data);
+
+  // Sends the pushed messages to the clients
+  void flush();
+
+  void keepAlive();
+  void close();
+
+  size_t getNumClients() const;
+};
+
+// Response which is completed later, e.g. from an event callback
+// (see Response::deferred). The connection is suspended until then,
+// so no worker thread has to wait for it. Only thread per connection
+// mode (or a libmicrohttpd without suspend/resume) blocks the thread.
+// body must not be changed after complete().
+
+class DeferredResponse {
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  MHD_Connection *connection = nullptr;
+  bool completed = false;
+
+public:
+  const std::shared_ptr<SharedBody> body = std::make_shared<SharedBody>();
+
+  // Returns false if the response is complete and can be sent
+  bool suspend(MHD_Connection *connection);
+
+  void complete();
+};
+
 struct Response {
   FString &content;
+  std::shared_ptr<const SharedBody> sharedBody; // Sent instead of content if set
+  std::shared_ptr<EventStream> eventStream;     // Turns the response into an event stream
+  std::shared_ptr<DeferredResponse> deferred;   // Sent once complete() is called
   std::vector<Header> headers;
   unsigned int code = 200;
   const char *serverDesc = getApplicationName();
   const char *mimeType = nullptr;
   time_t lastModified = 0;
+  std::string etag; // Quoted (and possibly weak) entity tag, sent as ETag header if set
   bool fileRequest = false;
   const char *wwwRoot = nullptr;
   const char *indexFile = nullptr;
@@ -76,8 +159,10 @@ struct CallbackArgs {
 struct Callback {
   typedef bool (*Fun)(const CallbackArgs &args);
   Fun fun;
-  uint32_t inUse;
-  bool uninstallRequest;
+  unsigned int cost; // Rate limit tokens per request
+  const RouteMetrics *metrics;
+  std::atomic<uint32_t> inUse{0};
+  std::atomic<bool> uninstallRequest{false};
 };
 
 class CallbackLocker {
@@ -104,9 +189,11 @@ public:
 // Request Callback
 //
 
-bool addCallback(const char *request, Callback::Fun callbackFun);
+constexpr unsigned int DEFAULT_REQUEST_COST = 1;
+
+bool addCallback(const char *request, Callback::Fun callbackFun, const unsigned int cost = DEFAULT_REQUEST_COST);
 void deleteCallback(const char *request);
-Callback *getCallback(const char *request, bool lock = true);
+Callback *getCallback(const char *request);
 
 //
 // Misc
@@ -118,6 +205,7 @@ int getURLParamaterInt(const Request &request, const char *param, const int fall
 
 const char *getUserAgent(const Request &request, const char *fallback);
 bool encodingSupported(const Request &request, const char *encoding);
+bool etagMatches(const Request &request, const std::string &etag); // If-None-Match
 
 bool containsHTMLEntities(const char *str);
 const char *htmlEncode(const char *str, char *buf, const size_t size);
@@ -131,7 +219,7 @@ const char *getMimeType(const char *file);
 bool isHTMLMimeType(const char *mimeType);
 bool isPictureMimeType(const char *mimeType);
 
-int getThreadPoolSize();
+bool eventStreamsSupported();
 
 bool init();
 void deinit();
@@ -28,6 +28,10 @@ PLUGIN_INIT() {
   return true;
 }
 
+PLUGIN_PROCESS() {
+  web::process();
+}
+
 PLUGIN_UNLOAD() {
   web::deinit();
   httpserver::deinit();
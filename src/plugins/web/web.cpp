@@ -19,12 +19,18 @@
  ************************************************************************/
 
 #include <cstring>
+#include <cstdlib>
 #include <limits>
+#include <algorithm>
 #include <mutex>
-#include <condition_variable>
 #include <memory>
+#include <unordered_map>
 #include "httpserver.h"
+#include "elementprinter.h"
+#include "history.h"
 #include "extinfo.h"
+#include "extinfo-sort.h"
+#include "metrics.h"
 #include "tools.h"
 #include "cube/tools.h"
 #include "plugin.h"
@@ -42,77 +48,218 @@ TimeType updateInterval;
 bool allowMasterUpdate;
 TimeType masterUpdateLimit;
 const char *defaultGame;
+bool enableResponseCache;
+TimeType responseCacheInterval;
+bool enableEvents;
+TimeType eventInterval;
+bool enableMetrics;
+bool enableHistory;
+std::string cacheControl;
+uint64_t configGeneration;
 } // anonymous namespace
 
 //
 // Misc Tools
 //
 
-template <typename STR, typename BUF, size_t N>
-const char *convertToUTF8AndEscape(const STR &str, BUF (&buf)[N]) {
-  char tmp[N];
-  convertCubeToUTF8(str, tmp);
-  return httpserver::htmlEncode(tmp, buf);
+// ?format=json or an Accept header asking for JSON
+Format getResponseFormat(const httpserver::Request &request) {
+  const char *format = httpserver::getURLParamater(request, "format");
+  if (format) return std::strcmp(format, "json") ? Format::XML : Format::JSON;
+  const char *accept = httpserver::getHeaderParamater(request, "Accept");
+  return accept && std::strstr(accept, "application/json") ? Format::JSON : Format::XML;
 }
 
-const char *getIndentation(const size_t indent) {
-  constexpr const char *str[] = {
-    "", " ", "  ", "   ", "    "
-  };
-  return str[indent];
-}
+// ?sort=, ?limit= and ?offset= of /servers, /players and /findplayer
+struct Selection {
+  static constexpr size_t NO_LIMIT = std::numeric_limits<size_t>::max();
 
-class XMLElementPrinter {
-private:
-  FString &fs;
-  size_t numElement = 0;
-  const char *elements[5];
-  size_t indentation;
+  const char *sort;
+  size_t offset;
+  size_t limit;
 
-public:
-  void element(const char *_element, const bool newLine = false, size_t _indentation = 0) {
-    elements[numElement] = _element;
-    if (numElement) ++indentation;
-    else indentation = _indentation;
-    fs << getIndentation(indentation) << '<' << elements[numElement] << '>';
-    if (newLine) fs << "\n";
-    ++numElement;
-  }
-  void elementEnd(const bool indent = false) {
-    if (indent) fs << getIndentation(indentation);
-    fs << "</" << elements[numElement - 1] << ">\n";
-    if (numElement > 1 && indentation) --indentation;
-    --numElement;
-  }
-  template <typename T> void printElement(const char *_element, T &&_val) {
-    element(_element);
-    fs << _val;
-    elementEnd();
-  }
-  template <typename T> XMLElementPrinter &operator<<(const T &v) {
-    fs << v;
-    return *this;
-  }
-  XMLElementPrinter(httpserver::Response &response) : fs(response.content) {
-    fs << "<?xml version=\"1.0\" ?>\n";
-    response.mimeType = "text/xml; charset=utf-8";
-  }
-  ~XMLElementPrinter() {
-    while (numElement) elementEnd(true);
+  // Number of leading items the response needs
+  size_t end() const { return limit > NO_LIMIT - offset ? NO_LIMIT : offset + limit; }
+
+  explicit Selection(const httpserver::Request &request)
+      : sort(httpserver::getURLParamater(request, "sort")),
+        offset(std::max(httpserver::getURLParamaterInt(request, "offset"), 0)),
+        limit(httpserver::getURLParamater(request, "limit")
+                  ? std::max(httpserver::getURLParamaterInt(request, "limit"), 0)
+                  : NO_LIMIT) {}
+};
+
+// Sorts the items if requested and drops the ones outside of the selection
+template <typename T, typename Sorter>
+void selectItems(std::vector<extinfo::SortItem<T>> &items, const Selection &selection, const Sorter sorter,
+                 void (*setSortKey)(extinfo::SortItem<T> &, const Sorter, const TimeType), const TimeType now) {
+  if (selection.sort) {
+    for (extinfo::SortItem<T> &item : items) setSortKey(item, sorter, now);
+    extinfo::sortItems(items, extinfo::isDescending(sorter), selection.end());
   }
+
+  items.resize(std::min(items.size(), selection.end()));
+  items.erase(items.begin(), items.begin() + std::min(items.size(), selection.offset));
+}
+
+//
+// Field Projection
+//
+// ?fields=name,frags,mapname,... limits the output of serverInfo() and
+// playerInfo() to the given fields. Names apply to servers and players
+// alike; "server." and "player." restrict a name to one of them.
+// Unselected fields are skipped entirely, including string conversions.
+//
+
+enum ServerField : uint32_t {
+  SF_PROTOCOL = 1 << 0,
+  SF_RELEASE = 1 << 1,
+  SF_DESCRIPTION = 1 << 2,
+  SF_CLIENTS = 1 << 3,
+  SF_MAXPLAYERS = 1 << 4,
+  SF_GAMEMODEINT = 1 << 5,
+  SF_GAMEMODE = 1 << 6,
+  SF_MASTERMODEINT = 1 << 7,
+  SF_MASTERMODE = 1 << 8,
+  SF_MAPNAME = 1 << 9,
+  SF_HOST = 1 << 10,
+  SF_HOSTLONG = 1 << 11,
+  SF_PORT = 1 << 12,
+  SF_PING = 1 << 13,
+  SF_GAMESPEED = 1 << 14,
+  SF_GAMEPAUSED = 1 << 15,
+  SF_TIMELEFTINT = 1 << 16,
+  SF_TIMELEFT = 1 << 17,
+  SF_COUNTRY = 1 << 18,
+  SF_COUNTRYCODE = 1 << 19,
+  SF_EXTENDED = 1 << 20,
+  SF_LASTUPDATE = 1 << 21,
+};
+
+enum PlayerField : uint32_t {
+  PF_NAME = 1 << 0,
+  PF_TEAM = 1 << 1,
+  PF_FRAGS = 1 << 2,
+  PF_FLAGS = 1 << 3,
+  PF_DEATHS = 1 << 4,
+  PF_TEAMKILLS = 1 << 5,
+  PF_ACCURACY = 1 << 6,
+  PF_HEALTH = 1 << 7,
+  PF_ARMOUR = 1 << 8,
+  PF_GUNSELECT = 1 << 9,
+  PF_PRIV = 1 << 10,
+  PF_STATE = 1 << 11,
+  PF_PING = 1 << 12,
+  PF_CLIENTNUM = 1 << 13,
+  PF_COUNTRY = 1 << 14,
+  PF_COUNTRYCODE = 1 << 15,
+  PF_EXTENDED = 1 << 16,
+  PF_ONLINETIME = 1 << 17,
+  PF_LASTUPDATE = 1 << 18,
+  PF_SESSIONID = 1 << 19,
+  PF_UID = 1 << 20,
 };
 
-class XMLNodePrinter {
-private:
-  XMLElementPrinter &elementPrinter;
+struct Fields {
+  static constexpr uint32_t ALL = ~0u;
 
-public:
-  XMLNodePrinter(XMLElementPrinter &elementPrinter, const char *node) : elementPrinter(elementPrinter) {
-     elementPrinter.element(node, true);
+  uint32_t server;
+  uint32_t player;
+
+  bool has(const ServerField field) const { return server & field; }
+  bool has(const PlayerField field) const { return player & field; }
+
+  explicit Fields(const httpserver::Request &request);
+  Fields() : server(ALL), player(ALL) {}
+};
+
+Fields::Fields(const httpserver::Request &request) : Fields() {
+  const char *str = httpserver::getURLParamater(request, "fields");
+  if (!str) return;
+
+  constexpr struct {
+    const char *name;
+    uint32_t server;
+    uint32_t player;
+  } fieldNames[] = {
+    {"protocol", SF_PROTOCOL, 0},
+    {"release", SF_RELEASE, 0},
+    {"description", SF_DESCRIPTION, 0},
+    {"clients", SF_CLIENTS, 0},
+    {"maxplayers", SF_MAXPLAYERS, 0},
+    {"gamemodeint", SF_GAMEMODEINT, 0},
+    {"gamemode", SF_GAMEMODE, 0},
+    {"mastermodeint", SF_MASTERMODEINT, 0},
+    {"mastermode", SF_MASTERMODE, 0},
+    {"mapname", SF_MAPNAME, 0},
+    {"host", SF_HOST, 0},
+    {"hostlong", SF_HOSTLONG, 0},
+    {"port", SF_PORT, 0},
+    {"gamespeed", SF_GAMESPEED, 0},
+    {"gamepaused", SF_GAMEPAUSED, 0},
+    {"timeleftint", SF_TIMELEFTINT, 0},
+    {"timeleft", SF_TIMELEFT, 0},
+    {"name", 0, PF_NAME},
+    {"team", 0, PF_TEAM},
+    {"frags", 0, PF_FRAGS},
+    {"flags", 0, PF_FLAGS},
+    {"deaths", 0, PF_DEATHS},
+    {"teamkills", 0, PF_TEAMKILLS},
+    {"accuracy", 0, PF_ACCURACY},
+    {"health", 0, PF_HEALTH},
+    {"armour", 0, PF_ARMOUR},
+    {"gunselect", 0, PF_GUNSELECT},
+    {"priv", 0, PF_PRIV},
+    {"state", 0, PF_STATE},
+    {"clientnum", 0, PF_CLIENTNUM},
+    {"onlinetime", 0, PF_ONLINETIME},
+    {"sessionid", 0, PF_SESSIONID},
+    {"uid", 0, PF_UID},
+    {"ping", SF_PING, PF_PING},
+    {"country", SF_COUNTRY, PF_COUNTRY},
+    {"countrycode", SF_COUNTRYCODE, PF_COUNTRYCODE},
+    {"extended", SF_EXTENDED, PF_EXTENDED},
+    {"lastupdate", SF_LASTUPDATE, PF_LASTUPDATE},
+  };
+
+  server = 0;
+  player = 0;
+
+  while (*str) {
+    const char *end = std::strchr(str, ',');
+    if (!end) end = str + std::strlen(str);
+
+    uint32_t serverMask = ALL;
+    uint32_t playerMask = ALL;
+
+    if (!std::strncmp(str, "server.", 7)) {
+      str += 7;
+      playerMask = 0;
+    } else if (!std::strncmp(str, "player.", 7)) {
+      str += 7;
+      serverMask = 0;
+    }
+
+    const size_t length = end - str;
+
+    for (const auto &field : fieldNames) {
+      if (std::strncmp(field.name, str, length) || field.name[length]) continue;
+      server |= field.server & serverMask;
+      player |= field.player & playerMask;
+      break;
+    }
+
+    str = *end ? end + 1 : end;
   }
-  ~XMLNodePrinter() {
-    elementPrinter.elementEnd(true);
+}
+
+class ResponsePrinter : public ElementPrinter {
+public:
+  ResponsePrinter(httpserver::Response &response, const Format format) : ElementPrinter(response.content, format) {
+    response.mimeType = format == Format::JSON ? "application/json; charset=utf-8" : "text/xml; charset=utf-8";
   }
+  ResponsePrinter(const httpserver::CallbackArgs &args)
+      : ResponsePrinter(args.response, getResponseFormat(args.request)) {}
 };
 
 extinfo::ExtInfoHost *getExtInfoHost(const httpserver::Request &request, 
@@ -121,107 +268,231 @@ extinfo::ExtInfoHost *getExtInfoHost(const httpserver::Request &request,
   extinfo::ExtInfoHost *host = extinfo::getExtInfoHost(
       httpserver::getURLParamater(request, "game", defaultGame));
   if (!host) {
-    XMLElementPrinter elementPrinter(response);
+    ResponsePrinter elementPrinter(response, getResponseFormat(request));
     elementPrinter.printElement("error", "invalid game");
   } else if (extInfoRequired && !host->info.extInfoSupported) {
     FString error;
     error << host->info.game << " does not support extinfo";
-    XMLElementPrinter elementPrinter(response);
+    ResponsePrinter elementPrinter(response, getResponseFormat(request));
     elementPrinter.printElement("error", error);
     return nullptr;
   }
   return host;
 }
 
+//
+// Response Cache
+//
+// Rendered responses are shared between all clients as long as the
+// data generation of the game did not change. Servers answer pings
+// all the time, so an entry is also reused while it is younger than
+// web.responseCacheInterval.
+//
+
+constexpr size_t MAX_RESPONSE_CACHE_ENTRIES = 1024;
+
+struct ResponseCacheEntry {
+  std::mutex mutex;
+  std::shared_ptr<const httpserver::SharedBody> body;
+  uint64_t generation;
+  TimeType renderTime;
+};
+
+std::mutex responseCacheMutex;
+std::unordered_map<std::string, std::shared_ptr<ResponseCacheEntry>> responseCache;
+
+std::shared_ptr<ResponseCacheEntry> getResponseCacheEntry(const std::string &key) {
+  LockGuard(&responseCacheMutex);
+
+  // Entries in use stay alive until their requests are done.
+  if (responseCache.size() >= MAX_RESPONSE_CACHE_ENTRIES && !responseCache.count(key)) responseCache.clear();
+
+  std::shared_ptr<ResponseCacheEntry> &entry = responseCache[key];
+  if (!entry) entry = std::make_shared<ResponseCacheEntry>();
+
+  return entry;
+}
+
+typedef bool (*RenderFun)(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host);
+
+// Request URI (endpoint + parameters) and output format
+std::string getResponseKey(const httpserver::Request &request) {
+  // The format can also be selected by the Accept header
+  std::string key = request.uri;
+  if (getResponseFormat(request) == Format::JSON) key += "\njson";
+  return key;
+}
+
+// Weak, the gzip and identity encodings share it
+std::string getETag(const uint64_t generation, const std::string &key) {
+  char etag[48];
+  /*std::*/snprintf(etag, sizeof(etag), "W/\"%llx-%08x\"", static_cast<unsigned long long>(generation),
+                    crc32b(key.data(), key.length()));
+  return etag;
+}
+
+// Sets the validators of a response rendered from the given data
+// generation. Returns true (and turns the response into a 304) if the
+// client already has this version.
+
+bool notModified(const httpserver::CallbackArgs &args, const uint64_t generation, const std::string &key) {
+  httpserver::Response &response = args.response;
+
+  response.etag = getETag(generation, key);
+
+  if (!httpserver::etagMatches(args.request, response.etag)) return false;
+
+  response.code = 304; // Not Modified
+  return true;
+}
+
+// Clients are polling every web.updateInterval
+void addCacheHeaders(httpserver::Response &response) {
+  response.headers.push_back({"Cache-Control", cacheControl.c_str()});
+  response.headers.push_back({"Vary", "Accept"});
+}
+
+// Responses are keyed by getResponseKey().
+// Failed renders are not cached.
+
+bool cachedResponse(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host, RenderFun render) {
+  uint64_t generation;
+
+  {
+    SharedLockGuard(&host->mutex);
+    generation = host->generation;
+  }
+
+  const std::string key = getResponseKey(args.request);
+
+  addCacheHeaders(args.response);
+  if (notModified(args, generation, key)) return true;
+
+  if (!enableResponseCache) {
+    if (render(args, host)) return true;
+    args.response.etag.clear();
+    return false;
+  }
+
+  std::shared_ptr<ResponseCacheEntry> entry = getResponseCacheEntry(key);
+  LockGuard(&entry->mutex);
+
+  const TimeType now = getMilliSeconds();
+
+  if (!entry->body || (entry->generation != generation && now - entry->renderTime >= responseCacheInterval)) {
+    std::shared_ptr<httpserver::SharedBody> body = std::make_shared<httpserver::SharedBody>();
+    httpserver::Response response{body->content};
+
+    if (!render({args.request, response}, host)) {
+      args.response.content = body->content;
+      args.response.etag.clear();
+      return false;
+    }
+
+    body->code = response.code;
+    body->mimeType = response.mimeType;
+
+    entry->body = std::move(body);
+    entry->generation = generation;
+    entry->renderTime = now;
+  }
+
+  // The cached body may be from an older generation
+  if (entry->generation != generation && notModified(args, entry->generation, key)) return true;
+
+  args.response.sharedBody = entry->body;
+  return true;
+}
+
 //
 // HTTP Callbacks
 //
 
-void serverInfo(const extinfo::Server *server, const TimeType now,
-                XMLElementPrinter &elementPrinter,
+void serverInfo(const extinfo::Server *server, const TimeType now, const Fields &fields,
+                ElementPrinter &elementPrinter,
                 const char *node = "server") {
-  ShortString buf1;
-  ShortString buf2;
-  ShortString timeLeft;
-
-  /*std::*/snprintf(timeLeft, sizeof(timeLeft), "%02d:%02d", server->secondsLeft / 60, server->secondsLeft % 60);
+  ShortString buf;
 
-  XMLNodePrinter nodePrinter(elementPrinter, node);
+  NodePrinter nodePrinter(elementPrinter, node);
 
   // TODO: protocolNum + Str
   // TODO: clients -> numclients
   // TODO: count down + raw, in JS?
 
-  elementPrinter.printElement("protocol", server->protocolVersion);
-  elementPrinter.printElement("release", convertToUTF8AndEscape(server->getGameReleaseName(buf1, sizeof(buf1)), buf2));
-  elementPrinter.printElement("description", convertToUTF8AndEscape(server->getDescription(), buf1));
-
-  elementPrinter.printElement("clients", server->numPlayers);
-  elementPrinter.printElement("maxplayers", server->maxPlayers);
-  elementPrinter.printElement("gamemodeint", server->gameMode);
-  elementPrinter.printElement("gamemode", convertToUTF8AndEscape(server->getGameModeName(), buf1));
-  elementPrinter.printElement("mastermodeint", server->masterMode);
-  elementPrinter.printElement("mastermode", server->getMasterModeName());
-  elementPrinter.printElement("mapname", convertToUTF8AndEscape(server->getMapName(), buf1));
-  elementPrinter.printElement("host", convertToUTF8AndEscape(server->serverHost, buf1));
-  elementPrinter.printElement("hostlong", network::hostToNet(server->address.host));
-  elementPrinter.printElement("port", server->address.port - server->host->info.infoPortOffset);
-  elementPrinter.printElement("ping", static_cast<int>(server->ping));
-  elementPrinter.printElement("gamespeed", server->gameSpeed);
-  elementPrinter.printElement("gamepaused", server->gamePaused ? 1 : 0);
-  elementPrinter.printElement("timeleftint", server->secondsLeft);
-  elementPrinter.printElement("timeleft", timeLeft);
-  elementPrinter.printElement("country", convertToUTF8AndEscape(server->getCountry(), buf1));
-  elementPrinter.printElement("countrycode", convertToUTF8AndEscape(server->getCountry(true), buf1));
+  if (fields.has(SF_PROTOCOL)) elementPrinter.printElement("protocol", server->protocolVersion);
+  if (fields.has(SF_RELEASE)) elementPrinter.printCubeString("release", server->getGameReleaseName(buf, sizeof(buf)));
+  if (fields.has(SF_DESCRIPTION)) elementPrinter.printElement("description", server->getDescriptionUTF8());
+
+  if (fields.has(SF_CLIENTS)) elementPrinter.printElement("clients", server->numPlayers);
+  if (fields.has(SF_MAXPLAYERS)) elementPrinter.printElement("maxplayers", server->maxPlayers);
+  if (fields.has(SF_GAMEMODEINT)) elementPrinter.printElement("gamemodeint", server->gameMode);
+  if (fields.has(SF_GAMEMODE)) elementPrinter.printCubeString("gamemode", server->getGameModeName());
+  if (fields.has(SF_MASTERMODEINT)) elementPrinter.printElement("mastermodeint", server->masterMode);
+  if (fields.has(SF_MASTERMODE)) elementPrinter.printElement("mastermode", server->getMasterModeName());
+  if (fields.has(SF_MAPNAME)) elementPrinter.printElement("mapname", server->getMapNameUTF8());
+  if (fields.has(SF_HOST)) elementPrinter.printCubeString("host", server->serverHost);
+  if (fields.has(SF_HOSTLONG)) elementPrinter.printElement("hostlong", network::hostToNet(server->address.host));
+  if (fields.has(SF_PORT))
+    elementPrinter.printElement("port", server->address.port - server->host->info.infoPortOffset);
+  if (fields.has(SF_PING)) elementPrinter.printElement("ping", static_cast<int>(server->ping));
+  if (fields.has(SF_GAMESPEED)) elementPrinter.printElement("gamespeed", server->gameSpeed);
+  if (fields.has(SF_GAMEPAUSED)) elementPrinter.printElement("gamepaused", server->gamePaused ? 1 : 0);
+  if (fields.has(SF_TIMELEFTINT)) elementPrinter.printElement("timeleftint", server->secondsLeft);
+
+  if (fields.has(SF_TIMELEFT)) {
+    /*std::*/snprintf(buf, sizeof(buf), "%02d:%02d", server->secondsLeft / 60, server->secondsLeft % 60);
+    elementPrinter.printElement("timeleft", buf);
+  }
+
+  if (fields.has(SF_COUNTRY)) elementPrinter.printCubeString("country", server->getCountry());
+  if (fields.has(SF_COUNTRYCODE)) elementPrinter.printCubeString("countrycode", server->getCountry(true));
 
   const extinfo::Server::Extended &extended = server->extended;
 
-  if (extended.infoOK) {
-    XMLNodePrinter nodePrinter(elementPrinter, "extended");
+  if (fields.has(SF_EXTENDED) && extended.infoOK) {
+    NodePrinter nodePrinter(elementPrinter, "extended");
     elementPrinter.printElement("uptime", server->getUptime());
 
     if (extended.serverMod.isSet()) {
-      elementPrinter.printElement("servermod", convertToUTF8AndEscape(server->getServerModName(), buf1));
+      elementPrinter.printCubeString("servermod", server->getServerModName());
       elementPrinter.printElement("servermodid", *extended.serverMod);
     }
 
     elementPrinter.printElement("lastupdate", (now - server->uptime.lastPong));
   }
 
-  elementPrinter.printElement("lastupdate", (now - server->info.lastPong));
+  if (fields.has(SF_LASTUPDATE)) elementPrinter.printElement("lastupdate", (now - server->info.lastPong));
 }
 
-void playerInfo(const extinfo::Player &player, const TimeType now,
-                XMLElementPrinter &elementPrinter) {
-  ShortString buf;
-
-  XMLNodePrinter nodePrinter(elementPrinter, "player");
+void playerInfo(const extinfo::Player &player, const TimeType now, const Fields &fields,
+                ElementPrinter &elementPrinter) {
+  NodePrinter nodePrinter(elementPrinter, "player");
 
-  elementPrinter.printElement("name", convertToUTF8AndEscape(player.getName(), buf));
-  elementPrinter.printElement("team", convertToUTF8AndEscape(player.getTeam(), buf));
+  if (fields.has(PF_NAME)) elementPrinter.printElement("name", player.getNameUTF8());
+  if (fields.has(PF_TEAM)) elementPrinter.printElement("team", player.getTeamUTF8());
 
   // TODO: gun name, priv name, state name   [str]
 
-  elementPrinter.printElement("frags", player.frags);
-  elementPrinter.printElement("flags", player.flags);
-  elementPrinter.printElement("deaths", player.deaths);
-  elementPrinter.printElement("teamkills", player.teamkills);
-  elementPrinter.printElement("accuracy", player.accuracy);
-  elementPrinter.printElement("health", player.health);
-  elementPrinter.printElement("armour", player.armour);
-  elementPrinter.printElement("gunselect", player.gun);
-  elementPrinter.printElement("priv", player.priv);
-  elementPrinter.printElement("state", player.state);
-  elementPrinter.printElement("ping", player.ping);
-  elementPrinter.printElement("clientnum", player.cn);
-
-  elementPrinter.printElement("country", convertToUTF8AndEscape(player.info.getCountry(), buf));
-  elementPrinter.printElement("countrycode", convertToUTF8AndEscape(player.info.getCountry(true), buf));
+  if (fields.has(PF_FRAGS)) elementPrinter.printElement("frags", player.frags);
+  if (fields.has(PF_FLAGS)) elementPrinter.printElement("flags", player.flags);
+  if (fields.has(PF_DEATHS)) elementPrinter.printElement("deaths", player.deaths);
+  if (fields.has(PF_TEAMKILLS)) elementPrinter.printElement("teamkills", player.teamkills);
+  if (fields.has(PF_ACCURACY)) elementPrinter.printElement("accuracy", player.accuracy);
+  if (fields.has(PF_HEALTH)) elementPrinter.printElement("health", player.health);
+  if (fields.has(PF_ARMOUR)) elementPrinter.printElement("armour", player.armour);
+  if (fields.has(PF_GUNSELECT)) elementPrinter.printElement("gunselect", player.gun);
+  if (fields.has(PF_PRIV)) elementPrinter.printElement("priv", player.priv);
+  if (fields.has(PF_STATE)) elementPrinter.printElement("state", player.state);
+  if (fields.has(PF_PING)) elementPrinter.printElement("ping", player.ping);
+  if (fields.has(PF_CLIENTNUM)) elementPrinter.printElement("clientnum", player.cn);
+
+  if (fields.has(PF_COUNTRY)) elementPrinter.printCubeString("country", player.info.getCountry());
+  if (fields.has(PF_COUNTRYCODE)) elementPrinter.printCubeString("countrycode", player.info.getCountry(true));
 
   const extinfo::Player::Extended &extended = player.extended;
 
-  if (extended.infoOK) {
-    XMLNodePrinter nodePrinter(elementPrinter, "extended");
+  if (fields.has(PF_EXTENDED) && extended.infoOK) {
+    NodePrinter nodePrinter(elementPrinter, "extended");
 
     if (extended.suicides.isSet()) elementPrinter.printElement("suicides", *extended.suicides);
     if (extended.shotdamage.isSet()) elementPrinter.printElement("shotdamage", *extended.shotdamage);
@@ -235,84 +506,292 @@ void playerInfo(const extinfo::Player &player, const TimeType now,
     if (extended.defended.isSet()) elementPrinter.printElement("defended", *extended.defended);
   }
 
-  const TimeType onlineTime = player.info.getOnlineTime(now);
+  if (fields.has(PF_ONLINETIME)) {
+    const TimeType onlineTime = player.info.getOnlineTime(now);
 
-  if (onlineTime == extinfo::UNKNOWN_ONLINE_TIME) elementPrinter.printElement("onlinetime", -1);
-  else elementPrinter.printElement("onlinetime", onlineTime);
+    if (onlineTime == extinfo::UNKNOWN_ONLINE_TIME) elementPrinter.printElement("onlinetime", -1);
+    else elementPrinter.printElement("onlinetime", onlineTime);
+  }
 
-  elementPrinter.printElement("lastupdate", (now - player.info.lastUpdate));
-  elementPrinter.printElement("sessionid", player.info.sessionID % 100000);
+  if (fields.has(PF_LASTUPDATE)) elementPrinter.printElement("lastupdate", (now - player.info.lastUpdate));
+  if (fields.has(PF_SESSIONID)) elementPrinter.printElement("sessionid", player.info.sessionID % 100000);
+  if (fields.has(PF_UID)) elementPrinter.printElement("uid", player.info.sessionID);
 }
 
-void listPlayers(const extinfo::Server *server, const TimeType now, XMLElementPrinter &elementPrinter) {
-  XMLNodePrinter nodePrinter(elementPrinter, "server");
-  serverInfo(server, now, elementPrinter, "info");
-  for (const extinfo::Player &player : server->players) playerInfo(player, now, elementPrinter);
+typedef std::vector<extinfo::SortItem<extinfo::Player>> PlayerItems;
+
+void addPlayerItem(PlayerItems &players, const extinfo::Server *server, const extinfo::Player &player) {
+  players.push_back({&player, server, players.size(), 0, {}});
 }
 
-bool listPlayers(const httpserver::CallbackArgs &args) {
-  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response, true);
-  if (!host) return false;
+// The generation lets clients continue with delta updates (since=)
+
+void listPlayers(const extinfo::Server *server, const PlayerItems &players, const TimeType now,
+                 const Fields &fields, const uint64_t generation, ElementPrinter &elementPrinter) {
+  NodePrinter nodePrinter(elementPrinter, "server");
+  elementPrinter.printElement("generation", generation);
+  serverInfo(server, now, fields, elementPrinter, "info");
+  ListPrinter listPrinter(elementPrinter, "players");
+  for (const extinfo::SortItem<extinfo::Player> &player : players)
+    playerInfo(*player.obj, now, fields, elementPrinter);
+}
+
+// Players of several servers; consecutive players of the same server
+// are grouped, so servers show up more than once in sorted lists.
+
+void listPlayers(const PlayerItems &players, const TimeType now, const Fields &fields,
+                 ElementPrinter &elementPrinter) {
+  const extinfo::Server *lastServer = nullptr;
 
-  XMLElementPrinter elementPrinter(args.response);
+  for (const extinfo::SortItem<extinfo::Player> &player : players) {
+    if (player.server != lastServer) {
+      if (lastServer) {
+        elementPrinter.end(); // players
+        elementPrinter.end(); // server
+      }
+
+      elementPrinter.node("server");
+      serverInfo(player.server, now, fields, elementPrinter, "info");
+      elementPrinter.list("players");
+      lastServer = player.server;
+    }
+
+    playerInfo(*player.obj, now, fields, elementPrinter);
+  }
+
+  if (lastServer) {
+    elementPrinter.end(); // players
+    elementPrinter.end(); // server
+  }
+}
+
+//
+// Delta Updates
+//
+// Requests with a since=<generation> parameter only get what changed
+// after that generation, including tombstones (<removed>) of deleted
+// servers and players. <full> tells the client to drop its state first;
+// this happens if the tombstones do not reach back far enough.
+// Delta responses are cheap and never cached.
+//
+
+bool getSince(const httpserver::Request &request, uint64_t &since) {
+  const char *sinceStr = httpserver::getURLParamater(request, "since");
+  if (!sinceStr) return false;
+  since = std::strtoull(sinceStr, nullptr, 10);
+  return true;
+}
+
+template <typename F> void forEachTombstone(const extinfo::ExtInfoHost *host, const uint64_t since, F f) {
+  auto tombstone = std::upper_bound(host->tombstones.begin(), host->tombstones.end(), since,
+                                    [](const uint64_t generation, const extinfo::Tombstone &tombstone) {
+                                      return generation < tombstone.generation;
+                                    });
+
+  for (; tombstone != host->tombstones.end(); ++tombstone) f(*tombstone);
+}
+
+void removedServer(const extinfo::ExtInfoHost *host, const network::Address &address,
+                   ElementPrinter &elementPrinter) {
+  NodePrinter nodePrinter(elementPrinter, "removed");
+  elementPrinter.printElement("hostlong", network::hostToNet(address.host));
+  elementPrinter.printElement("port", address.port - host->info.infoPortOffset);
+}
+
+// ?server= (IPv4 address or hostlong) and ?port=, without info port offset
+bool getServerAddress(const httpserver::Request &request, network::Address &address) {
+  const char *serverHostStr = httpserver::getURLParamater(request, "server");
+  const char *serverPortStr = httpserver::getURLParamater(request, "port");
+
+  if (!serverHostStr || !serverPortStr) return false;
+
+  uint32_t serverHost;
+  uint16_t serverPort;
+
+  if (!network::isIPv4Address(serverHostStr, &serverHost)) serverHost = std::strtoul(serverHostStr, nullptr, 10);
+
+  serverPort = std::strtoul(serverPortStr, nullptr, 10);
+  address = {network::netToHost(serverHost), static_cast<uint16_t>(serverPort)};
+  return true;
+}
+
+const extinfo::Server *findServer(const httpserver::Request &request, const extinfo::ExtInfoHost *host) {
+  network::Address serverAddress;
+  if (!getServerAddress(request, serverAddress)) return nullptr;
+  return host->findServer(serverAddress, false);
+}
+
+bool playerDelta(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host, const uint64_t since) {
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "server");
 
   SharedLockGuard(&host->mutex);
 
   const TimeType now = getMilliSeconds();
-  const char *serverHostStr = httpserver::getURLParamater(args.request, "server");
-  const char *serverPortStr = httpserver::getURLParamater(args.request, "port");
+  const Fields fields(args.request);
+  const extinfo::Server *server = findServer(args.request, host);
+
+  if (!server || !server->infoOK) {
+    elementPrinter.printElement("invalid", 1);
+    return true;
+  }
+
+  const bool full = !host->isDeltaPossible(since);
+
+  elementPrinter.printElement("generation", host->generation);
+  if (full) elementPrinter.printElement("full", 1);
+
+  if (full || server->generation > since) serverInfo(server, now, fields, elementPrinter, "info");
+  if (!full && server->playerGeneration <= since) return true;
+
+  if (!full) {
+    ListPrinter listPrinter(elementPrinter, "removed");
+
+    forEachTombstone(host, since, [&](const extinfo::Tombstone &tombstone) {
+      if (!tombstone.sessionID || !network::addressEqual(tombstone.address, server->address)) return;
+      NodePrinter nodePrinter(elementPrinter, "removed");
+      elementPrinter.printElement("uid", tombstone.sessionID);
+    });
+  }
+
+  ListPrinter listPrinter(elementPrinter, "players");
+
+  for (const extinfo::Player &player : server->players) {
+    if (!full && player.info.generation <= since) continue;
+    playerInfo(player, now, fields, elementPrinter);
+  }
+
+  return true;
+}
+
+// Requires locking
+void serverDelta(httpserver::Response &response, const Format format, const extinfo::ExtInfoHost *host,
+                 const uint64_t since, const Fields &fields = Fields()) {
+  ResponsePrinter elementPrinter(response, format);
+  NodePrinter nodePrinter(elementPrinter, "servers");
+
+  const TimeType now = getMilliSeconds();
+  const bool full = !host->isDeltaPossible(since);
+
+  elementPrinter.printElement("generation", host->generation);
 
-  if (serverHostStr && serverPortStr) {
-    uint32_t serverHost;
-    uint16_t serverPort;
+  if (full) {
+    elementPrinter.printElement("full", 1);
+  } else {
+    elementPrinter.printElement("since", since);
 
-    if (!network::isIPv4Address(serverHostStr, &serverHost)) serverHost = std::strtoul(serverHostStr, nullptr, 10);
+    ListPrinter listPrinter(elementPrinter, "removed");
 
-    serverPort = std::strtoul(serverPortStr, nullptr, 10);
-    network::Address serverAddress{network::netToHost(serverHost), static_cast<uint16_t>(serverPort)};
-    const extinfo::Server *server = host->findServer(serverAddress, false);
+    forEachTombstone(host, since, [&](const extinfo::Tombstone &tombstone) {
+      if (!tombstone.sessionID) removedServer(host, tombstone.address, elementPrinter);
+    });
+
+    for (const extinfo::Server *server : host->servers)
+      if (server->generation > since && !server->infoOK) removedServer(host, server->address, elementPrinter);
+  }
+
+  ListPrinter listPrinter(elementPrinter, "servers");
+
+  for (const extinfo::Server *server : host->servers) {
+    if (!full && server->generation <= since) continue;
+    if (server->infoOK) serverInfo(server, now, fields, elementPrinter);
+  }
+}
+
+bool renderPlayers(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host) {
+  ResponsePrinter elementPrinter(args);
+
+  SharedLockGuard(&host->mutex);
+
+  const TimeType now = getMilliSeconds();
+  const Selection selection(args.request);
+  const Fields fields(args.request);
+  const extinfo::PlayerSorter sorter = extinfo::getPlayerSorter(selection.sort);
+  PlayerItems players;
+
+  if (httpserver::getURLParamater(args.request, "server") && httpserver::getURLParamater(args.request, "port")) {
+    const extinfo::Server *server = findServer(args.request, host);
 
     if (server && server->infoOK) {
-      listPlayers(server, now, elementPrinter);
+      for (const extinfo::Player &player : server->players) addPlayerItem(players, server, player);
+      selectItems(players, selection, sorter, extinfo::setPlayerSortKey, now);
+      listPlayers(server, players, now, fields, host->generation, elementPrinter);
     } else {
-      XMLNodePrinter nodePrinter(elementPrinter, "server");
+      NodePrinter nodePrinter(elementPrinter, "server");
       elementPrinter.printElement("invalid", 1);
     }
   } else {
-    XMLNodePrinter nodePrinter(elementPrinter, "players");
+    NodePrinter nodePrinter(elementPrinter, "players");
+    ListPrinter listPrinter(elementPrinter, "servers");
 
     for (const extinfo::Server *server : host->servers) {
-      if (!server->infoOK || server->players.empty()) continue;
-      listPlayers(server, now, elementPrinter);
+      if (!server->infoOK) continue;
+      for (const extinfo::Player &player : server->players) addPlayerItem(players, server, player);
     }
+
+    selectItems(players, selection, sorter, extinfo::setPlayerSortKey, now);
+    listPlayers(players, now, fields, elementPrinter);
   }
 
   return true;
 }
 
-bool listServers(const httpserver::CallbackArgs &args) {
-  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
+bool listPlayers(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response, true);
   if (!host) return false;
 
+  // Deltas are only supported for single servers
+  uint64_t since;
+  if (getSince(args.request, since) && httpserver::getURLParamater(args.request, "server"))
+    return playerDelta(args, host, since);
+
+  return cachedResponse(args, host, renderPlayers);
+}
+
+bool renderServers(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host) {
   SharedLockGuard(&host->mutex);
 
   const TimeType now = getMilliSeconds();
 
-  XMLElementPrinter elementPrinter(args.response);
-  XMLNodePrinter nodePrinter(elementPrinter, "servers");
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "servers");
 
-  for (const extinfo::Server *server : host->servers) {
-    if (!server->infoOK) continue;
-    serverInfo(server, now, elementPrinter);
-  }
+  // Lets clients continue with delta updates (since=)
+  elementPrinter.printElement("generation", host->generation);
+
+  ListPrinter listPrinter(elementPrinter, "servers");
+
+  std::vector<extinfo::SortItem<extinfo::Server>> servers;
+
+  for (const extinfo::Server *server : host->servers)
+    if (server->infoOK) servers.push_back({server, server, servers.size(), 0, {}});
+
+  const Selection selection(args.request);
+  selectItems(servers, selection, extinfo::getServerSorter(selection.sort), extinfo::setServerSortKey, now);
+
+  const Fields fields(args.request);
+
+  for (const extinfo::SortItem<extinfo::Server> &server : servers)
+    serverInfo(server.obj, now, fields, elementPrinter);
 
   return true;
 }
 
-bool findPlayer(const httpserver::CallbackArgs &args) {
-  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response, true);
+bool listServers(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
   if (!host) return false;
 
+  uint64_t since;
+  if (getSince(args.request, since)) {
+    SharedLockGuard(&host->mutex);
+    serverDelta(args.response, getResponseFormat(args.request), host, since, Fields(args.request));
+    return true;
+  }
+
+  return cachedResponse(args, host, renderServers);
+}
+
+bool renderFoundPlayers(const httpserver::CallbackArgs &args, extinfo::ExtInfoHost *host) {
   ShortString name;
 
   constexpr int intMin = std::numeric_limits<int>::min();
@@ -326,163 +805,426 @@ bool findPlayer(const httpserver::CallbackArgs &args) {
     {httpserver::getURLParamater(args.request, "accuracy"), true, intMin}
   };
 
-  struct CallbackInfo {
-    const TimeType now;
-    const extinfo::Server *lastServer;
-    XMLElementPrinter elementPrinter;
-  } callbackInfo{getMilliSeconds(), nullptr, args.response};
-
   auto callback = [](const extinfo::Server *server, const extinfo::Player &player, void *callbackData) {
-    CallbackInfo &callbackInfo = *static_cast<CallbackInfo *>(callbackData);
-
-    if (callbackInfo.lastServer != server) {
-      if (callbackInfo.lastServer) callbackInfo.elementPrinter.elementEnd();
-      callbackInfo.elementPrinter.element("server", true);
-      serverInfo(server, callbackInfo.now, callbackInfo.elementPrinter, "info");
-      callbackInfo.lastServer = server;
-    }
-
-    playerInfo(player, callbackInfo.now, callbackInfo.elementPrinter);
+    addPlayerItem(*static_cast<PlayerItems *>(callbackData), server, player);
   };
 
-  XMLNodePrinter nodePrinter(callbackInfo.elementPrinter, "players");
+  const TimeType now = getMilliSeconds();
+  const Selection selection(args.request);
+  PlayerItems players;
+
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "players");
+  ListPrinter listPrinter(elementPrinter, "servers");
 
   SharedLockGuard(&host->mutex);
-  host->findPlayer(findPlayer, callback, &callbackInfo);
+  host->findPlayer(findPlayer, callback, &players);
+
+  selectItems(players, selection, extinfo::getPlayerSorter(selection.sort), extinfo::setPlayerSortKey, now);
+  listPlayers(players, now, Fields(args.request), elementPrinter);
 
   return true;
 }
 
-bool updateFromMaster(const httpserver::CallbackArgs &args) {
-  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
+bool findPlayer(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response, true);
   if (!host) return false;
+  return cachedResponse(args, host, renderFoundPlayers);
+}
 
-  XMLElementPrinter elementPrinter(args.response);
-  XMLNodePrinter nodePrinter(elementPrinter, "masterupdate");
+//
+// Master Updates
+//
+// /updatefrommaster triggers a master update and answers with its
+// result. The connection is suspended in the meantime (see
+// httpserver::DeferredResponse), so no worker thread is blocked.
+// Requests still waiting after MASTER_UPDATE_WAIT_TIME are answered
+// with <inprogress> by process().
+//
 
-  if (!allowMasterUpdate) {
-    elementPrinter.printElement("disabled", 1);
-    return true;
-  }
+constexpr int MASTER_UPDATE_ID = 0x70FEFEFE;
+constexpr TimeType MASTER_UPDATE_WAIT_TIME = 500;
 
-  constexpr int masterUpdateID = 0x70FEFEFE;
+struct PendingMasterUpdate {
+  std::shared_ptr<httpserver::DeferredResponse> response;
+  Format format;
+  TimeType deadline;
+};
 
-  struct CallbackInfo {
-    XMLElementPrinter &elementPrinter;
-    bool timeout;
-    std::mutex *infoMutex;
-    std::mutex *conditionMutex;
-    std::condition_variable *condition;
+std::mutex masterUpdateMutex;
+std::vector<PendingMasterUpdate> pendingMasterUpdates[extinfo::NUMGAMES];
 
-    void initLocking() {
-      infoMutex = new std::mutex;
-      conditionMutex = new std::mutex;
-      condition = new std::condition_variable;
-    }
+// status == nullptr: still in progress
+void completeMasterUpdate(const PendingMasterUpdate &pending, const extinfo::MasterUpdateStatus *status,
+                          const TimeType elapsedTime) {
+  httpserver::SharedBody &body = *pending.response->body;
 
-    void deinitLocking() {
-      delete infoMutex;
-      delete conditionMutex;
-      delete condition;
+  {
+    httpserver::Response response{body.content};
+    ResponsePrinter elementPrinter(response, pending.format);
+    NodePrinter nodePrinter(elementPrinter, "masterupdate");
+
+    if (status) {
+      elementPrinter.printElement<int>("success", status->success > 0);
+      elementPrinter.printElement("numservers", status->numServers);
+      elementPrinter.printElement("elapsedtime", elapsedTime);
+    } else {
+      elementPrinter.printElement("inprogress", 1);
     }
 
-    ~CallbackInfo() { deinitLocking(); }
-  };
+    body.mimeType = response.mimeType;
+  }
 
-  auto eventCallback = [](const struct extinfo::ExtInfoHost *host, const extinfo::Event event,
-                          const extinfo::EventData &eventData, void *callbackData) {
-    if (event != extinfo::MASTER_UPDATE) return;
+  pending.response->complete();
+}
 
-    const extinfo::MasterUpdateStatus *status = static_cast<const extinfo::MasterUpdateStatus *>(eventData.data[0]);
+void masterUpdateCallback(const extinfo::ExtInfoHost *host, const extinfo::Event event,
+                          const extinfo::EventData &eventData, void *) {
+  if (event != extinfo::MASTER_UPDATE) return;
 
-    CallbackInfo *callbackInfo = static_cast<CallbackInfo *>(callbackData);
-    callbackInfo->infoMutex->lock();
+  const extinfo::MasterUpdateStatus *status = static_cast<const extinfo::MasterUpdateStatus *>(eventData.data[0]);
+  if (status->id != MASTER_UPDATE_ID) return;
 
-    if (callbackInfo->timeout || status->id != masterUpdateID) {
-      callbackInfo->infoMutex->unlock();
-      return;
-    }
+  const TimeType elapsedTime = getMilliSeconds() - host->lastMasterUpdate;
 
-    XMLElementPrinter &elementPrinter = callbackInfo->elementPrinter;
+  LockGuard(&masterUpdateMutex);
 
-    elementPrinter.printElement<int>("success", status->success > 0);
-    elementPrinter.printElement("numservers", status->numServers);
+  std::vector<PendingMasterUpdate> &pending = pendingMasterUpdates[host->index];
+  for (const PendingMasterUpdate &update : pending) completeMasterUpdate(update, status, elapsedTime);
+  pending.clear();
+}
 
-    callbackInfo->elementPrinter.printElement("elapsedtime", getMilliSeconds() - host->lastMasterUpdate);
+// all: Also the ones which did not time out yet
+void processMasterUpdates(const bool all = false) {
+  const TimeType now = getMilliSeconds();
 
-    callbackInfo->condition->notify_one();
-    callbackInfo->infoMutex->unlock();
-  };
+  LockGuard(&masterUpdateMutex);
 
-  std::unique_ptr<CallbackInfo> callbackInfo(new CallbackInfo({elementPrinter}));
+  for (std::vector<PendingMasterUpdate> &pending : pendingMasterUpdates) {
+    auto timedOut = std::partition(pending.begin(), pending.end(), [&](const PendingMasterUpdate &update) {
+      return !all && update.deadline > now;
+    });
 
-  // Ensure addEventCallback() and deleteEventCallback()
-  // are always called with the same pointers
-  extinfo::EventCallback::Fun eventCallbackAddr = eventCallback;
-  void *callbackInfoAddr = callbackInfo.get();
+    for (auto update = timedOut; update != pending.end(); ++update) completeMasterUpdate(*update, nullptr, 0);
+    pending.erase(timedOut, pending.end());
+  }
+}
 
-  auto printInProgress = [&]() {
-    elementPrinter.printElement("inprogress", 1);
-  };
+bool updateFromMaster(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
+  if (!host) return false;
 
-  {
+  const Format format = getResponseFormat(args.request);
+  TimeType waitTime = 0;
+
+  if (allowMasterUpdate) {
     LockGuard(&host->mutex);
 
-    const TimeType timeDiff = getMilliSeconds() - host->lastMasterUpdate;
+    const TimeType now = getMilliSeconds();
+    const TimeType timeDiff = now - host->lastMasterUpdate;
 
-    if (timeDiff < masterUpdateLimit) {
-      elementPrinter.printElement("wait", masterUpdateLimit - timeDiff);
+    if (timeDiff >= masterUpdateLimit) {
+      if (!host->masterUpdateThread) {
+        // Queue to avoid creating the update thread from this plugin
+        host->updateFromMaster(MASTER_UPDATE_ID, true);
+      }
+
+      args.response.deferred = std::make_shared<httpserver::DeferredResponse>();
+
+      LockGuard(&masterUpdateMutex);
+      pendingMasterUpdates[host->index].push_back({args.response.deferred, format, now + MASTER_UPDATE_WAIT_TIME});
       return true;
     }
 
-    if (!host->masterUpdateThread) {
-      // Queue to avoid creating the update thread from this plugin
-      host->updateFromMaster(masterUpdateID, true);
-    }
+    waitTime = masterUpdateLimit - timeDiff;
+  }
+
+  ResponsePrinter elementPrinter(args.response, format);
+  NodePrinter nodePrinter(elementPrinter, "masterupdate");
+
+  if (!allowMasterUpdate) elementPrinter.printElement("disabled", 1);
+  else elementPrinter.printElement("wait", waitTime);
+
+  return true;
+}
+
+//
+// Server-Sent Events
+//
+// /events?game=<game> pushes the changes of a game to the browser:
+//
+//   servers: Server list delta (see Delta Updates), rendered
+//            once every web.eventInterval for all clients.
+//            XML, or JSON with ?format=json or an Accept header
+//            asking for JSON (see getResponseFormat()).
+//   connect, disconnect, rename (always JSON):
+//            {"server":"<hostlong>:<port>","cn":0,"name":"...","oldname":"..."}
+//   masterupdate (always JSON):
+//            {"success":1,"numservers":123}
+//
+// Every format has a stream of its own, deltas are only
+// rendered for formats which have clients.
+//
+
+constexpr TimeType EVENT_KEEP_ALIVE_INTERVAL = oneSecond * 15;
+constexpr Format EVENT_FORMATS[] = {Format::XML, Format::JSON};
 
-    const int threadPoolSize = httpserver::getThreadPoolSize();
-    int threadsInUse = 1;
+struct GameEvents {
+  std::shared_ptr<httpserver::EventStream> streams[sizeofarray(EVENT_FORMATS)]; // Indexed by Format
+  uint64_t generation; // Last generation sent to the clients
+
+  httpserver::EventStream &getStream(const Format format) { return *streams[static_cast<size_t>(format)]; }
+};
+
+GameEvents gameEvents[extinfo::NUMGAMES];
+TimeType lastEventFlush;
+TimeType lastKeepAlive;
+
+void printPlayerEvent(FString &fs, const extinfo::Server *server, const extinfo::Player *player,
+                      const extinfo::Player *oldPlayer = nullptr) {
+  ElementPrinter elementPrinter(fs, Format::JSON);
+  ShortString key;
+
+  /*std::*/snprintf(key, sizeof(key), "%u:%d", network::hostToNet(server->address.host),
+                    server->address.port - server->host->info.infoPortOffset);
+
+  elementPrinter.printElement("server", key);
+  elementPrinter.printElement("cn", player->cn);
+  elementPrinter.printCubeString("name", player->getName());
+  if (oldPlayer) elementPrinter.printCubeString("oldname", oldPlayer->getName());
+}
+
+void eventCallback(const extinfo::ExtInfoHost *host, const extinfo::Event event,
+                   const extinfo::EventData &eventData, void *) {
+  GameEvents &events = gameEvents[host->index];
+  const char *eventName;
+
+  // Avoid the formatting work if nobody is listening
+  if (std::none_of(std::begin(events.streams), std::end(events.streams),
+                   [](const std::shared_ptr<httpserver::EventStream> &stream) { return stream->getNumClients(); }))
+    return;
+
+  thread_local FString data;
+  data.clear();
+
+  switch (event) {
+  case extinfo::PLAYER_CONNECT:
+    eventName = "connect";
+    printPlayerEvent(data, eventData.server, eventData.player[0]);
+    break;
+  case extinfo::PLAYER_DISCONNECT:
+    eventName = "disconnect";
+    printPlayerEvent(data, eventData.server, eventData.player[0]);
+    break;
+  case extinfo::PLAYER_RENAME:
+    // player[0] is the old player, player[1] carries the new name
+    eventName = "rename";
+    printPlayerEvent(data, eventData.server, eventData.player[1], eventData.player[0]);
+    break;
+  case extinfo::MASTER_UPDATE: {
+    const extinfo::MasterUpdateStatus *status = static_cast<const extinfo::MasterUpdateStatus *>(eventData.data[0]);
+    eventName = "masterupdate";
+    ElementPrinter elementPrinter(data, Format::JSON);
+    elementPrinter.printElement("success", status->success > 0 ? 1 : 0);
+    elementPrinter.printElement("numservers", status->numServers);
+    break;
+  }
+  default:
+    // Server updates are sent as deltas by processEvents()
+    return;
+  }
+
+  for (const std::shared_ptr<httpserver::EventStream> &stream : events.streams)
+    if (stream->getNumClients()) stream->push(eventName, data);
+}
+
+void processEvents() {
+  const TimeType now = getMilliSeconds();
+
+  if (now - lastEventFlush < eventInterval) return;
+  lastEventFlush = now;
+
+  const bool keepAlive = now - lastKeepAlive >= EVENT_KEEP_ALIVE_INTERVAL;
+  if (keepAlive) lastKeepAlive = now;
+
+  thread_local FString content;
+
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
 
-    for (extinfo::ExtInfoHost &extinfoHost : extinfo::hosts) {
-      if (!extinfoHost.enabled || &extinfoHost == host) continue;
-      SharedLockGuard(&extinfoHost.mutex);
-      if (extinfoHost.masterUpdateThread && extinfoHost.masterUpdateStatus.id == masterUpdateID) ++threadsInUse;
+    GameEvents &events = gameEvents[host.index];
+
+    {
+      SharedLockGuard(&host.mutex);
+
+      for (const Format format : EVENT_FORMATS) {
+        httpserver::EventStream &stream = events.getStream(format);
+        if (events.generation == host.generation || !stream.getNumClients()) continue;
+
+        content.clear();
+        httpserver::Response response{content};
+        serverDelta(response, format, &host, events.generation);
+        stream.push("servers", content);
+      }
+
+      events.generation = host.generation;
     }
 
-    if (threadPoolSize - threadsInUse < 1) {
-      printInProgress();
-      return true;
+    for (const std::shared_ptr<httpserver::EventStream> &stream : events.streams) {
+      if (keepAlive) stream->keepAlive();
+      else stream->flush();
     }
+  }
+}
 
-    callbackInfo->initLocking();
-    host->addEventCallback({eventCallbackAddr, callbackInfoAddr});
+bool listEvents(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
+  if (!host) return false;
+
+  if (!enableEvents || !httpserver::eventStreamsSupported()) {
+    ResponsePrinter elementPrinter(args);
+    elementPrinter.printElement("error", "events are disabled");
+    return false;
   }
 
-  {
-    std::unique_lock<std::mutex> lock(*callbackInfo->conditionMutex);
+  args.response.eventStream = gameEvents[host->index].streams[static_cast<size_t>(getResponseFormat(args.request))];
+  args.response.mimeType = "text/event-stream";
+  args.response.headers.push_back({"Cache-Control", "no-cache"});
+  return true;
+}
 
-    bool timeout = callbackInfo->condition->wait_for(lock, std::chrono::milliseconds(500)) == std::cv_status::timeout;
+//
+// History
+//
+// /history?server=&port= returns the player counts of a server over time,
+// see history.cpp. ?from= and ?to= (Unix time) select the range, by default
+// the last hour. ?resolution= is one of raw, minute, hour and day; without
+// it, the finest resolution which still reaches back to ?from is used.
+//
 
-    // Must be always locked to avoid data races
-    LockGuard(callbackInfo->infoMutex);
+bool showHistory(const httpserver::CallbackArgs &args) {
+  extinfo::ExtInfoHost *host = getExtInfoHost(args.request, args.response);
+  if (!host) return false;
 
-    if (timeout) {
-      callbackInfo->timeout = true;
-      printInProgress();
-    }
+  const char *resolutionStr = httpserver::getURLParamater(args.request, "resolution");
+  const char *fromStr = httpserver::getURLParamater(args.request, "from");
+  const char *toStr = httpserver::getURLParamater(args.request, "to");
+
+  network::Address address;
+  history::Resolution resolution = history::MINUTE;
+
+  if (!getServerAddress(args.request, address) ||
+      (resolutionStr && !history::parseResolution(resolutionStr, resolution))) {
+    ResponsePrinter elementPrinter(args);
+    elementPrinter.printElement("error", "invalid server, port or resolution");
+    return false;
   }
 
-  {
-    LockGuard(&host->mutex);
-    host->deleteEventCallback({eventCallbackAddr, callbackInfoAddr});
+  const uint32_t now = static_cast<uint32_t>(time(nullptr));
+  const uint32_t to = toStr ? std::strtoul(toStr, nullptr, 10) : now;
+  const uint32_t from = fromStr ? std::strtoul(fromStr, nullptr, 10) : to - std::min<uint32_t>(to, 3600);
+
+  if (!resolutionStr)
+    while (resolution < history::DAY && from < now && now - from > history::getRetention(resolution))
+      resolution = static_cast<history::Resolution>(resolution + 1);
+
+  thread_local std::vector<history::Point> points;
+  const bool found = history::get(host, address, resolution, from, to, points);
+
+  addCacheHeaders(args.response);
+
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "history");
+
+  if (!found) {
+    elementPrinter.printElement("invalid", 1);
+    return true;
+  }
+
+  elementPrinter.printElement("resolution", history::getResolutionName(resolution));
+  elementPrinter.printElement("interval", history::getInterval(resolution));
+
+  ListPrinter listPrinter(elementPrinter, "points");
+
+  for (const history::Point &point : points) {
+    NodePrinter nodePrinter(elementPrinter, "point");
+    elementPrinter.printElement("time", point.time);
+    elementPrinter.printElement("min", point.min);
+    elementPrinter.printElement("max", point.max);
+    elementPrinter.printElement("avg", point.avg);
+  }
+
+  return true;
+}
+
+// Prometheus text exposition format
+bool showMetrics(const httpserver::CallbackArgs &args) {
+  metrics::render(args.response.content);
+  args.response.mimeType = "text/plain; version=0.0.4; charset=utf-8";
+  args.response.headers.push_back({"Cache-Control", "no-cache"});
+  return true;
+}
+
+#ifdef LOCK_STATS
+// Most waited for locks first, see LOCK_STATS in tools.h. Times are in nanoseconds.
+bool showLockStats(const httpserver::CallbackArgs &args) {
+  constexpr size_t MAX_HOLDERS = 10;
+
+  std::vector<lockstats::Lock> locks;
+  lockstats::collect(locks, MAX_HOLDERS);
+
+  args.response.headers.push_back({"Cache-Control", "no-cache"});
+
+  ResponsePrinter elementPrinter(args);
+  ListPrinter listPrinter(elementPrinter, "locks");
+
+  // Bucket i holds times from 2^i (0 for i = 0) to 2^(i+1) - 1
+  auto printHistogram = [&](const char *name, const uint64_t (&histogram)[lockstats::NUM_BUCKETS]) {
+    ListPrinter listPrinter(elementPrinter, name);
+
+    for (size_t i = 0; i < lockstats::NUM_BUCKETS; ++i) {
+      if (!histogram[i]) continue;
+      NodePrinter nodePrinter(elementPrinter, "bucket");
+      elementPrinter.printElement("min", i ? uint64_t(1) << i : 0);
+      elementPrinter.printElement("count", histogram[i]);
+    }
+  };
+
+  for (const lockstats::Lock &lock : locks) {
+    NodePrinter nodePrinter(elementPrinter, "lock");
+    char buf[64];
+
+    if (lock.name.empty()) /*std::*/snprintf(buf, sizeof(buf), "%p", lock.lock);
+    elementPrinter.printElement("name", lock.name.empty() ? buf : lock.name.c_str());
+    elementPrinter.printElement("acquisitions", lock.acquisitions);
+    elementPrinter.printElement("shared", lock.sharedAcquisitions);
+    elementPrinter.printElement("contended", lock.contended);
+    elementPrinter.printElement("totalwait", lock.totalWait);
+    elementPrinter.printElement("maxwait", lock.maxWait);
+    elementPrinter.printElement("totalhold", lock.totalHold);
+    elementPrinter.printElement("maxhold", lock.maxHold);
+    printHistogram("wait", lock.waitHistogram);
+    printHistogram("hold", lock.holdHistogram);
+
+    ListPrinter listPrinter(elementPrinter, "holders");
+
+    for (const lockstats::Holder &holder : lock.holders) {
+      NodePrinter nodePrinter(elementPrinter, "holder");
+      /*std::*/snprintf(buf, sizeof(buf), "%s:%d", holder.file ? holder.file : "?", holder.line);
+      elementPrinter.printElement("site", buf);
+      elementPrinter.printElement("acquisitions", holder.acquisitions);
+      elementPrinter.printElement("totalhold", holder.totalHold);
+      elementPrinter.printElement("maxhold", holder.maxHold);
+    }
   }
 
   return true;
 }
+#endif
 
 bool showInfo(const httpserver::CallbackArgs &args) {
-  XMLElementPrinter elementPrinter(args.response);
-  XMLNodePrinter nodePrinter(elementPrinter, "info");
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "info");
 
   const char *compilerInfo[2];
   getCompilerInfo(compilerInfo);
@@ -491,24 +1233,54 @@ bool showInfo(const httpserver::CallbackArgs &args) {
   elementPrinter.printElement("os", getOSName());
 
   {
-    XMLNodePrinter nodePrinter(elementPrinter, "compiler");
+    NodePrinter nodePrinter(elementPrinter, "compiler");
     elementPrinter.printElement("name", compilerInfo[0]);
     elementPrinter.printElement("version", compilerInfo[1]);
   }
 
+  ListPrinter listPrinter(elementPrinter, "games");
+
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
+
+    NodePrinter nodePrinter(elementPrinter, "game");
+    elementPrinter.printElement("name", host.info.game);
+
+    SharedLockGuard(&host.mutex);
+    ListPrinter listPrinter(elementPrinter, "masters");
+
+    for (const extinfo::MasterServer &master : host.masters) {
+      NodePrinter nodePrinter(elementPrinter, "master");
+      elementPrinter.printElement("host", master.host);
+      elementPrinter.printElement("port", master.port);
+      elementPrinter.printElement("requests", master.numRequests);
+      elementPrinter.printElement("successes", master.numSuccesses);
+      elementPrinter.printElement("failures", master.numFailures);
+      elementPrinter.printElement("latency", master.latency);
+      elementPrinter.printElement("healthy", master.isHealthy() ? 1 : 0);
+    }
+  }
+
   return true;
 }
 
 bool showConfiguration(const httpserver::CallbackArgs &args) {
-  XMLElementPrinter elementPrinter(args.response);
-  elementPrinter.element("config", true);
+  // The configuration does not change while running
+  addCacheHeaders(args.response);
+  if (notModified(args, configGeneration, getResponseKey(args.request))) return true;
+
+  ResponsePrinter elementPrinter(args);
+  NodePrinter nodePrinter(elementPrinter, "config");
 
   elementPrinter.printElement("updateinterval", updateInterval);
+  if (enableEvents && httpserver::eventStreamsSupported()) elementPrinter.printElement("events", 1);
+
+  ListPrinter listPrinter(elementPrinter, "games");
 
   for (const extinfo::ExtInfoHost &host : extinfo::hosts) {
     if (!host.enabled) continue;
 
-    XMLNodePrinter nodePrinter(elementPrinter, "game");
+    NodePrinter nodePrinter(elementPrinter, "game");
 
     elementPrinter.printElement("name", host.info.game);
     elementPrinter.printElement("desc", host.info.desc);
@@ -528,21 +1300,73 @@ bool init() {
   allowMasterUpdate = plugincfg->getBool("web.allowMasterUpdate", true);
   masterUpdateLimit = plugincfg->getInt("web.masterUpdateLimit", oneMinute * 5, oneHour * 12, oneMinute * 15);
   defaultGame = plugincfg->getString("web.defaultGame", "sauerbraten");
+  enableResponseCache = plugincfg->getBool("web.enableResponseCache", true);
+  responseCacheInterval = plugincfg->getInt("web.responseCacheInterval", 0, oneMinute, oneSecond);
+  enableEvents = plugincfg->getBool("web.enableEvents", true);
+  eventInterval = plugincfg->getInt("web.eventInterval", 100, oneMinute, oneSecond);
+  enableMetrics = plugincfg->getBool("web.enableMetrics", true);
+  enableHistory = plugincfg->getBool("web.enableHistory", true);
+
+  cacheControl = "max-age=";
+  cacheControl += std::to_string(updateInterval / oneSecond);
+  configGeneration = time(nullptr);
 
   if (!extinfo::getExtInfoHost(defaultGame)) {
     err << "web plugin: invalid default game (check your configuration)!" << err.endl();
     return false;
   }
 
-  httpserver::addCallback("/servers", listServers);
-  httpserver::addCallback("/players", listPlayers);
-  httpserver::addCallback("/findplayer", findPlayer);
-  httpserver::addCallback("/updatefrommaster", updateFromMaster);
-  httpserver::addCallback("/info", showInfo);
-  httpserver::addCallback("/config", showConfiguration);
+  // Rate limit costs: Cached responses are cheap, searches
+  // scan all players and master updates are really expensive.
+  httpserver::addCallback("/servers", listServers, 1);
+  httpserver::addCallback("/players", listPlayers, 2);
+  httpserver::addCallback("/findplayer", findPlayer, 10);
+  httpserver::addCallback("/updatefrommaster", updateFromMaster, 20);
+  httpserver::addCallback("/info", showInfo, 1);
+  httpserver::addCallback("/config", showConfiguration, 1);
+  if (enableMetrics) httpserver::addCallback("/metrics", showMetrics, 1);
+  if (enableHistory) httpserver::addCallback("/history", showHistory, 1);
+#ifdef LOCK_STATS
+  httpserver::addCallback("/lockstats", showLockStats, 1);
+#endif
+
+  SetLockName(&responseCacheMutex, "web: response cache");
+  SetLockName(&masterUpdateMutex, "web: master updates");
+
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
+    LockGuard(&host.mutex);
+    host.addEventCallback({masterUpdateCallback, nullptr});
+  }
+
+  if (enableEvents) {
+    for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+      if (!host.enabled) continue;
+      LockGuard(&host.mutex);
+      GameEvents &events = gameEvents[host.index];
+      for (std::shared_ptr<httpserver::EventStream> &stream : events.streams)
+        stream = std::make_shared<httpserver::EventStream>();
+      events.generation = host.generation;
+      host.addEventCallback({eventCallback, nullptr});
+    }
+
+    httpserver::addCallback("/events", listEvents);
+  }
+
+  if (enableHistory) {
+    history::init(plugincfg->getInt("web.historySaveInterval", 0, oneDay, oneMinute * 10),
+                  plugincfg->getInt("web.historyMaxServers", 1, 100000, 2048));
+  }
+
   return true;
 }
 
+void process() {
+  processMasterUpdates();
+  if (enableEvents) processEvents();
+  if (enableHistory) history::process();
+}
+
 void deinit() {
   httpserver::deleteCallback("/servers");
   httpserver::deleteCallback("/players");
@@ -550,6 +1374,45 @@ void deinit() {
   httpserver::deleteCallback("/updatefrommaster");
   httpserver::deleteCallback("/info");
   httpserver::deleteCallback("/config");
+  if (enableMetrics) httpserver::deleteCallback("/metrics");
+  if (enableHistory) {
+    httpserver::deleteCallback("/history");
+    history::deinit();
+  }
+#ifdef LOCK_STATS
+  httpserver::deleteCallback("/lockstats");
+#endif
+
+  for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+    if (!host.enabled) continue;
+    LockGuard(&host.mutex);
+    host.deleteEventCallback({masterUpdateCallback, nullptr});
+  }
+
+  // Suspended clients must be resumed before the http daemon stops
+  processMasterUpdates(true);
+
+  if (enableEvents) {
+    httpserver::deleteCallback("/events");
+
+    for (extinfo::ExtInfoHost &host : extinfo::hosts) {
+      if (!host.enabled) continue;
+
+      {
+        LockGuard(&host.mutex);
+        host.deleteEventCallback({eventCallback, nullptr});
+      }
+
+      // Suspended clients must be resumed before the http daemon stops
+      for (std::shared_ptr<httpserver::EventStream> &stream : gameEvents[host.index].streams) {
+        stream->close();
+        stream.reset();
+      }
+    }
+  }
+
+  LockGuard(&responseCacheMutex);
+  responseCache.clear();
 }
 
 } // namespace web
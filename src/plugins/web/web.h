@@ -22,5 +22,6 @@
 
 namespace web {
 bool init();
+void process();
 void deinit();
 } // namespace web
@@ -0,0 +1,211 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "resolver.h"
+#include "network.h"
+#include "main.h"
+#include "tools.h"
+
+namespace resolver {
+
+namespace {
+
+struct CacheEntry {
+  uint32_t host;
+  bool ok;
+  TimeType expires;
+};
+
+TimeType cacheTTL;
+TimeType negativeCacheTTL;
+
+std::mutex mutex;
+std::condition_variable condition;
+bool shutdownRequest;
+std::vector<std::thread *> threads;
+
+// All of these are protected by the mutex above
+std::unordered_map<std::string, CacheEntry> cache;
+std::unordered_map<std::string, std::vector<Request>> inFlight;
+std::deque<std::string> queue;
+std::vector<std::string> resolved;
+TimeType lastCachePurge;
+
+void worker() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    condition.wait(lock, []() { return shutdownRequest || !queue.empty(); });
+    if (shutdownRequest) break;
+
+    std::string hostName = std::move(queue.front());
+    queue.pop_front();
+
+    lock.unlock();
+
+    network::Address address{};
+    const bool ok = network::setHostAddress(hostName.c_str(), address);
+    const TimeType now = getMilliSeconds();
+
+    lock.lock();
+
+    cache[hostName] = {address.host, ok, now + (ok ? cacheTTL : negativeCacheTTL)};
+    resolved.push_back(std::move(hostName));
+  }
+}
+
+void purgeCache(const TimeType now) {
+  for (decltype(cache)::iterator it = cache.begin(); it != cache.end();) {
+    if (now >= it->second.expires && !inFlight.count(it->first)) it = cache.erase(it);
+    else ++it;
+  }
+}
+
+} // anonymous namespace
+
+//
+// Resolving
+//
+
+Status resolve(const char *hostName, network::Address &address, Callback callback,
+               void *callbackData, const int callbackFlags) {
+  const size_t hostNameLength = std::strlen(hostName);
+
+  if (network::parseIPv4Address(hostName, hostNameLength, address.host)) return RESOLVED;
+
+  LockGuard(&mutex);
+
+  decltype(cache)::const_iterator entry = cache.find(hostName);
+
+  if (entry != cache.end() && getMilliSeconds() < entry->second.expires) {
+    if (!entry->second.ok) return FAILED;
+    address.host = entry->second.host;
+    return RESOLVED;
+  }
+
+  if (!callback) return PENDING; // Not cached
+
+  std::vector<Request> &requests = inFlight[hostName];
+
+  // Only the first request for a host name enqueues work,
+  // everyone else just waits for the same answer.
+  if (requests.empty()) {
+    queue.emplace_back(hostName, hostNameLength);
+    condition.notify_one();
+  }
+
+  requests.push_back({{hostName, hostNameLength}, address, callback, callbackData, callbackFlags});
+
+  return PENDING;
+}
+
+void cancel(const void *callbackData) {
+  LockGuard(&mutex);
+
+  for (auto &requests : inFlight) {
+    for (size_t i = requests.second.size(); i-- > 0;)
+      if (requests.second[i].callbackData == callbackData)
+        requests.second.erase(requests.second.begin() + i);
+  }
+}
+
+//
+// Misc
+//
+
+void process() {
+  thread_local std::vector<std::pair<Request, bool>> done;
+  done.clear();
+
+  {
+    LockGuard(&mutex);
+
+    for (const std::string &hostName : resolved) {
+      decltype(inFlight)::iterator requests = inFlight.find(hostName);
+      if (requests == inFlight.end()) continue;
+
+      const CacheEntry &entry = cache[hostName];
+
+      for (Request &request : requests->second) {
+        request.address.host = entry.host;
+        done.emplace_back(std::move(request), entry.ok);
+      }
+
+      inFlight.erase(requests);
+    }
+
+    resolved.clear();
+
+    const TimeType now = getMilliSeconds();
+
+    if (now - lastCachePurge >= oneMinute) {
+      purgeCache(now);
+      lastCachePurge = now;
+    }
+  }
+
+  // Invoke the callbacks without holding the lock,
+  // they are very likely to take other locks.
+  for (const auto &request : done) request.first.callback(request.first, request.second);
+}
+
+bool init() {
+  const int numThreads = cfg->getInt("resolver.threads", 1, 64, 4);
+
+  cacheTTL = cfg->getInt("resolver.cacheTTL", oneSecond * 10, oneDay, oneMinute * 10);
+  negativeCacheTTL = cfg->getInt("resolver.negativeCacheTTL", oneSecond, oneDay, oneMinute);
+
+  shutdownRequest = false;
+  lastCachePurge = getMilliSeconds();
+
+  for (int i = 0; i < numThreads; ++i) threads.push_back(new std::thread(worker));
+
+  return true;
+}
+
+void deinit() {
+  {
+    LockGuard(&mutex);
+    shutdownRequest = true;
+  }
+
+  condition.notify_all();
+
+  for (std::thread *thread : threads) {
+    thread->join();
+    delete thread;
+  }
+
+  threads.clear();
+  cache.clear();
+  inFlight.clear();
+  queue.clear();
+  resolved.clear();
+}
+
+} // namespace resolver
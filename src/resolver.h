@@ -0,0 +1,78 @@
+/************************************************************************
+ *  Cube Server Browser                                                 *
+ *  Copyright (C) 2015 by Thomas Poechtrager                            *
+ *  t.poechtrager@gmail.com                                             *
+ *                                                                      *
+ *  This program is free software: you can redistribute it and/or       *
+ *  modify it under the terms of the GNU Affero General Public License  *
+ *  as published by the Free Software Foundation, either version 3      *
+ *  of the License, or (at your option) any later version.              *
+ *                                                                      *
+ *  This program is distributed in the hope that it will be useful,     *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *  GNU Affero General Public License for more details.                 *
+ *                                                                      *
+ *  You should have received a copy of the GNU Affero General Public    *
+ *  License along with this program.                                    *
+ *  If not, see <http://www.gnu.org/licenses/>.                         *
+ ************************************************************************/
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <string>
+#include "network.h"
+
+namespace resolver {
+
+//
+// Structs & Constants
+//
+
+struct Request;
+
+typedef void (*Callback)(const Request &request, const bool ok);
+
+struct Request {
+  std::string hostName;
+  network::Address address; // The port is passed through untouched
+  Callback callback;
+  void *callbackData;
+  int callbackFlags;
+};
+
+enum Status {
+  RESOLVED,
+  PENDING,
+  FAILED
+};
+
+//
+// Resolving
+//
+
+// Never blocks. IP literals and cached host names are resolved in place,
+// everything else is handed over to the worker threads and PENDING is
+// returned. The callback is then invoked from process() (main thread).
+// Without a callback only the cache is consulted, PENDING then means
+// the host name is not cached.
+
+Status resolve(const char *hostName, network::Address &address, Callback callback = nullptr,
+               void *callbackData = nullptr, const int callbackFlags = 0);
+
+// Drops all outstanding callbacks using callbackData
+void cancel(const void *callbackData);
+
+//
+// Misc
+//
+
+void process();
+
+bool init();
+void deinit();
+
+} // namespace resolver
+
+#endif //__RESOLVER_H__
@@ -22,7 +22,13 @@
 #include <cctype>
 #include <cstring>
 #include <ctime>
+#include <cerrno>
 #include <fstream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
 #include <sys/stat.h>
 #include <zlib.h>
 
@@ -32,8 +38,12 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #endif
 
 #if defined(__APPLE__) && !defined(USE_GETTIMEOFDAY)
@@ -246,6 +256,16 @@ bool writeFile(const CString &file, const std::string &content) {
   return stream.good();
 }
 
+bool writeFileAtomically(const CString &file, const std::string &content) {
+  FString tmpFile;
+  tmpFile << file << ".tmp";
+  if (!writeFile(tmpFile, content)) return false;
+#ifdef _WIN32
+  std::remove(*file);
+#endif
+  return !std::rename(tmpFile.c_str(), *file);
+}
+
 const char *convertCubeToUTF8(const CString &str, char *buf, const size_t size) {
   size_t len = cubetools::encodeutf8(reinterpret_cast<unsigned char *>(buf), size,
                                      reinterpret_cast<const unsigned char *>(*str), str.length());
@@ -276,6 +296,47 @@ bool fileExists(const CString &fileName, struct stat *st) {
   return !stat(*fileName, st);
 }
 
+bool MappedFile::open(const CString &file) {
+  close();
+
+#ifndef _WIN32
+  int fd = ::open(*file, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (p == MAP_FAILED) return false;
+
+  mapping = static_cast<const char *>(p);
+  mappingSize = st.st_size;
+#else
+  if (!readFile(file, buf) || buf.empty()) return false;
+
+  mapping = buf.data();
+  mappingSize = buf.length();
+#endif
+
+  return true;
+}
+
+void MappedFile::close() {
+#ifndef _WIN32
+  if (mapping) munmap(const_cast<char *>(mapping), mappingSize);
+#else
+  buf.clear();
+#endif
+  mapping = nullptr;
+  mappingSize = 0;
+}
+
 //
 // Terminal text colors
 //
@@ -297,29 +358,322 @@ bool isTerminal() {
 }
 
 //
-// Log helper
+// Asynchronous log
 //
 
-void LogFile::printTimeStamp() {
-  ShortString buf;
-  struct tm tm;
-  std::time_t now = std::time(nullptr);
-  if (!localtime_r(&now, &tm)) return;
-  if (std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S | ", &tm)) os << buf;
+namespace asynclog {
+
+namespace {
+
+constexpr TimeType WRITE_INTERVAL = 100;    // Milliseconds
+constexpr size_t RING_SIZE = 64 * 1024;     // Per thread, power of two
+constexpr size_t MAX_LINE_LENGTH = 8 * 1024; // Longer lines are cut
+
+struct Record {
+  uint32_t length; // Including the newline
+  int32_t fd;
+  int64_t time;    // -1: no time stamp
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// writerMutex). head and tail are byte counters and wrap around.
+
+class Ring {
+private:
+  char data[RING_SIZE];
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+
+  void copyIn(size_t pos, const void *src, size_t length) {
+    pos &= RING_SIZE - 1;
+    const size_t first = std::min(length, RING_SIZE - pos);
+    std::memcpy(data + pos, src, first);
+    std::memcpy(data, static_cast<const char *>(src) + first, length - first);
+  }
+
+  void copyOut(size_t pos, void *dst, size_t length) const {
+    pos &= RING_SIZE - 1;
+    const size_t first = std::min(length, RING_SIZE - pos);
+    std::memcpy(dst, data + pos, first);
+    std::memcpy(static_cast<char *>(dst) + first, data, length - first);
+  }
+
+public:
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> abandoned{false}; // Owning thread has exited
+
+  // Returns the used size
+  size_t push(const Record &record, const char *line) {
+    const size_t size = sizeof(record) + record.length;
+    const size_t h = head.load(std::memory_order_relaxed);
+    const size_t used = h - tail.load(std::memory_order_acquire);
+
+    if (RING_SIZE - used < size) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return used;
+    }
+
+    copyIn(h, &record, sizeof(record));
+    copyIn(h + sizeof(record), line, record.length - 1);
+    copyIn(h + size - 1, "\n", 1);
+    head.store(h + size, std::memory_order_release);
+
+    return used + size;
+  }
+
+  template <typename F> void pop(F f) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    const size_t h = head.load(std::memory_order_acquire);
+
+    while (t != h) {
+      Record record;
+      copyOut(t, &record, sizeof(record));
+
+      char *line = f(record);
+      copyOut(t + sizeof(record), line, record.length);
+
+      t += sizeof(record) + record.length;
+    }
+
+    tail.store(t, std::memory_order_release);
+  }
+};
+
+struct Batch {
+  int fd;
+  std::string data;
+};
+
+std::mutex ringsMutex;
+std::vector<Ring *> rings;
+
+std::mutex writerMutex; // Consumer lock, also serializes synchronous writes
+std::condition_variable writerCondition;
+std::thread *writerThread;
+std::atomic<bool> running{false};
+bool stopRequest;
+
+// Only accessed with writerMutex held
+std::vector<Batch> batches;
+time_t lastTime = -1;
+char timeStamp[32];
+size_t timeStampLength;
+uint64_t droppedReported;
+uint64_t droppedAbandoned; // Of deleted rings, requires ringsMutex
+
+#ifdef TLS_SUPPORTED
+struct RingOwner {
+  Ring *ring;
+
+  RingOwner() : ring(new Ring) {
+    LockGuard(&ringsMutex);
+    rings.push_back(ring);
+  }
+
+  ~RingOwner() { ring->abandoned.store(true, std::memory_order_release); }
+};
+
+Ring *getRing(std::mutex *&producerMutex) {
+  thread_local RingOwner owner;
+  producerMutex = nullptr;
+  return owner.ring;
+}
+#else
+// One ring shared by all threads
+std::mutex sharedRingMutex;
+
+Ring *getRing(std::mutex *&producerMutex) {
+  static Ring *ring = []() {
+    LockGuard(&ringsMutex);
+    rings.push_back(new Ring);
+    return rings.back();
+  }();
+
+  producerMutex = &sharedRingMutex;
+  return ring;
+}
+#endif
+
+void writeAll(const int fd, const char *data, size_t length) {
+  while (length > 0) {
+    const ssize_t written = ::write(fd, data, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return;
+    data += written;
+    length -= written;
+  }
+}
+
+std::string &getBatch(const int fd) {
+  for (Batch &batch : batches)
+    if (batch.fd == fd) return batch.data;
+
+  batches.push_back({fd, {}});
+  return batches.back().data;
+}
+
+void appendTimeStamp(std::string &data, const time_t time) {
+  if (time != lastTime) {
+    struct tm tm;
+    lastTime = time;
+    timeStampLength = 0;
+    if (localtime_r(&time, &tm))
+      timeStampLength = std::strftime(timeStamp, sizeof(timeStamp), "%Y-%m-%d %H:%M:%S | ", &tm);
+  }
+
+  data.append(timeStamp, timeStampLength);
+}
+
+// Requires writerMutex
+void drain() {
+  {
+    LockGuard(&ringsMutex);
+
+    for (auto it = rings.begin(); it != rings.end();) {
+      Ring *ring = *it;
+      // The owner is gone for good once this is seen
+      const bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+
+      ring->pop([](const Record &record) {
+        std::string &data = getBatch(record.fd);
+        if (record.time != -1) appendTimeStamp(data, record.time);
+        const size_t offset = data.length();
+        data.resize(offset + record.length);
+        return &data[offset];
+      });
+
+      if (abandoned) {
+        droppedAbandoned += ring->dropped.load(std::memory_order_relaxed);
+        delete ring;
+        it = rings.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  const uint64_t dropped = getNumDropped();
+
+  if (dropped != droppedReported) {
+    std::string &data = getBatch(STDERR_FD);
+    data += "warning: log: ";
+    data += std::to_string(dropped - droppedReported);
+    data += " lines dropped\n";
+    droppedReported = dropped;
+  }
+
+  for (Batch &batch : batches) {
+    if (batch.data.empty()) continue;
+    writeAll(batch.fd, batch.data.data(), batch.data.length());
+    batch.data.clear();
+  }
+}
+
+void writer() {
+  std::unique_lock<std::mutex> lock(writerMutex);
+
+  while (!stopRequest) {
+    drain();
+    writerCondition.wait_for(lock, std::chrono::milliseconds(WRITE_INTERVAL));
+  }
+
+  drain();
 }
 
-LogFile::LogFile(const char *file)
-    : LogFileStream(file), MessageLocked(log.is_open() ? log : std::cerr) {
-  if (!log.is_open()) {
-    err << "cannot open log file '" << file << "', using stderr instead" << err.endl();
+} // anonymous namespace
+
+void writeLine(const int fd, const bool timeStamp, const char *line, size_t length) {
+  length = std::min(length, MAX_LINE_LENGTH);
+  const int64_t time = timeStamp ? static_cast<int64_t>(std::time(nullptr)) : -1;
+  const Record record{static_cast<uint32_t>(length + 1), fd, time};
+
+  if (!running.load(std::memory_order_acquire)) {
+    LockGuard(&writerMutex);
+    drain(); // Keep the order
+    std::string &data = getBatch(fd);
+    if (timeStamp) appendTimeStamp(data, record.time);
+    data.append(line, length);
+    data += '\n';
+    writeAll(fd, data.data(), data.length());
+    data.clear();
+    return;
   }
+
+  std::mutex *producerMutex;
+  Ring *ring = getRing(producerMutex);
+  size_t used;
+
+  {
+    LockGuard(producerMutex);
+    used = ring->push(record, line);
+  }
+
+  // Do not wait for the next interval if the ring is filling up
+  if (used > RING_SIZE / 2) writerCondition.notify_one();
 }
 
-MessageLocked warn("warning");
-MessageLocked err("error");
+void flush() {
+  LockGuard(&writerMutex);
+  drain();
+}
+
+uint64_t getNumDropped() {
+  LockGuard(&ringsMutex);
+  uint64_t dropped = droppedAbandoned;
+  for (const Ring *ring : rings) dropped += ring->dropped.load(std::memory_order_relaxed);
+  return dropped;
+}
+
+bool start() {
+  if (running) return true;
+  stopRequest = false;
+  writerThread = new std::thread(writer);
+  running.store(true, std::memory_order_release);
+  return true;
+}
+
+void stop() {
+  if (!running) return;
+
+  running.store(false, std::memory_order_release);
+
+  {
+    LockGuard(&writerMutex);
+    stopRequest = true;
+  }
+
+  writerCondition.notify_one();
+  writerThread->join();
+  delete writerThread;
+  writerThread = nullptr;
+}
+
+} // namespace asynclog
+
+//
+// Log helper
+//
+
+namespace {
+int openLogFile(const char *file) {
+  const int fd = ::open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0) err << "cannot open log file '" << file << "', using stderr instead" << err.endl();
+  return fd < 0 ? asynclog::STDERR_FD : fd;
+}
+} // anonymous namespace
+
+LogFile::LogFile(const char *file) : MessageLocked(openLogFile(file), true) {}
+
+LogFile::~LogFile() {
+  asynclog::flush();
+  if (fd != asynclog::STDERR_FD) ::close(fd);
+}
+
+MessageLockedSync warn("warning");
+MessageLockedSync err("error");
 MessageDebug dbg("debug", FG_LIGHT_MAGENTA);
 MessageLocked info("info", FG_LIGHT_MAGENTA);
-MessageLocked warninfo("   info", FG_LIGHT_MAGENTA);
+MessageLockedSync warninfo("   info", FG_LIGHT_MAGENTA);
 
 //
 // Time
@@ -649,6 +1003,222 @@ SharedMutex::~SharedMutex() {
   }
 }
 
+//
+// Lock Statistics
+//
+
+#ifdef LOCK_STATS
+namespace lockstats {
+
+namespace {
+
+struct SiteKey {
+  const void *lock;
+  const char *file;
+  int line;
+  bool shared;
+
+  bool operator==(const SiteKey &in) const {
+    return lock == in.lock && file == in.file && line == in.line && shared == in.shared;
+  }
+};
+
+struct SiteKeyHash {
+  size_t operator()(const SiteKey &key) const {
+    return std::hash<const void *>()(key.lock) * 31 + std::hash<const void *>()(key.file) * 7 + key.line * 2 +
+           key.shared;
+  }
+};
+
+struct SiteStats {
+  uint64_t acquisitions;
+  uint64_t contended;
+  uint64_t totalWait;
+  uint64_t maxWait;
+  uint64_t totalHold;
+  uint64_t maxHold;
+  uint64_t waitHistogram[NUM_BUCKETS];
+  uint64_t holdHistogram[NUM_BUCKETS];
+};
+
+typedef std::unordered_map<SiteKey, SiteStats, SiteKeyHash> SiteMap;
+
+struct ThreadStats {
+  std::mutex mutex; // Only contended by collect()
+  SiteMap sites;
+};
+
+// The mutexes in here are not locked through LockGuard, which would record them
+struct State {
+  std::mutex mutex;
+  std::vector<ThreadStats *> threads;
+  SiteMap retired; // Of threads which have exited
+  std::unordered_map<const void *, std::string> names;
+};
+
+// Never freed, lock guards may still run while static objects are destroyed
+State &getState() {
+  static State *state = new State;
+  return *state;
+}
+
+size_t getBucket(uint64_t nanoSeconds) {
+  size_t bucket = 0;
+  while ((nanoSeconds >>= 1) && bucket < NUM_BUCKETS - 1) ++bucket;
+  return bucket;
+}
+
+void merge(SiteStats &dst, const SiteStats &src) {
+  dst.acquisitions += src.acquisitions;
+  dst.contended += src.contended;
+  dst.totalWait += src.totalWait;
+  dst.maxWait = std::max(dst.maxWait, src.maxWait);
+  dst.totalHold += src.totalHold;
+  dst.maxHold = std::max(dst.maxHold, src.maxHold);
+
+  for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+    dst.waitHistogram[i] += src.waitHistogram[i];
+    dst.holdHistogram[i] += src.holdHistogram[i];
+  }
+}
+
+void merge(SiteMap &dst, const SiteMap &src) {
+  for (const auto &site : src) merge(dst[site.first], site.second);
+}
+
+#ifdef TLS_SUPPORTED
+struct ThreadStatsOwner {
+  ThreadStats *stats;
+
+  ThreadStatsOwner() : stats(new ThreadStats) {
+    State &state = getState();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.threads.push_back(stats);
+  }
+
+  ~ThreadStatsOwner() {
+    State &state = getState();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    merge(state.retired, stats->sites);
+    state.threads.erase(std::find(state.threads.begin(), state.threads.end(), stats));
+    delete stats;
+  }
+};
+
+ThreadStats &getThreadStats() {
+  thread_local ThreadStatsOwner owner;
+  return *owner.stats;
+}
+#else
+// Shared by all threads
+ThreadStats &getThreadStats() {
+  static ThreadStats *stats = []() {
+    State &state = getState();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.threads.push_back(new ThreadStats);
+    return state.threads.back();
+  }();
+
+  return *stats;
+}
+#endif
+
+} // anonymous namespace
+
+void record(const void *lock, const char *file, const int line, const bool shared, const uint64_t wait,
+            const uint64_t hold) {
+  ThreadStats &stats = getThreadStats();
+  std::lock_guard<std::mutex> guard(stats.mutex);
+  SiteStats &site = stats.sites[{lock, file, line, shared}];
+
+  ++site.acquisitions;
+  if (wait >= CONTENDED_WAIT) ++site.contended;
+  site.totalWait += wait;
+  site.maxWait = std::max(site.maxWait, wait);
+  site.totalHold += hold;
+  site.maxHold = std::max(site.maxHold, hold);
+  ++site.waitHistogram[getBucket(wait)];
+  ++site.holdHistogram[getBucket(hold)];
+}
+
+void setName(const void *lock, const char *name) {
+  State &state = getState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  state.names[lock] = name;
+}
+
+void collect(std::vector<Lock> &locks, const size_t maxHolders) {
+  SiteMap sites;
+  std::unordered_map<const void *, size_t> lockIndices;
+
+  State &state = getState();
+
+  {
+    std::lock_guard<std::mutex> guard(state.mutex);
+
+    sites = state.retired;
+
+    for (ThreadStats *stats : state.threads) {
+      std::lock_guard<std::mutex> threadGuard(stats->mutex);
+      merge(sites, stats->sites);
+    }
+
+    for (const auto &site : sites) {
+      auto inserted = lockIndices.insert({site.first.lock, locks.size()});
+      if (!inserted.second) continue;
+
+      auto name = state.names.find(site.first.lock);
+      Lock lock{};
+      lock.lock = site.first.lock;
+      if (name != state.names.end()) lock.name = name->second;
+      locks.push_back(std::move(lock));
+    }
+  }
+
+  for (const auto &site : sites) {
+    const SiteKey &key = site.first;
+    const SiteStats &stats = site.second;
+    Lock &lock = locks[lockIndices[key.lock]];
+
+    lock.acquisitions += stats.acquisitions;
+    if (key.shared) lock.sharedAcquisitions += stats.acquisitions;
+    lock.contended += stats.contended;
+    lock.totalWait += stats.totalWait;
+    lock.maxWait = std::max(lock.maxWait, stats.maxWait);
+    lock.totalHold += stats.totalHold;
+    lock.maxHold = std::max(lock.maxHold, stats.maxHold);
+
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+      lock.waitHistogram[i] += stats.waitHistogram[i];
+      lock.holdHistogram[i] += stats.holdHistogram[i];
+    }
+
+    // Shared and exclusive acquisitions of a call site are one holder
+    auto holder = std::find_if(lock.holders.begin(), lock.holders.end(), [&](const Holder &holder) {
+      return holder.file == key.file && holder.line == key.line;
+    });
+
+    if (holder == lock.holders.end()) {
+      lock.holders.push_back({key.file, key.line, stats.acquisitions, stats.totalHold, stats.maxHold});
+    } else {
+      holder->acquisitions += stats.acquisitions;
+      holder->totalHold += stats.totalHold;
+      holder->maxHold = std::max(holder->maxHold, stats.maxHold);
+    }
+  }
+
+  for (Lock &lock : locks) {
+    std::sort(lock.holders.begin(), lock.holders.end(),
+              [](const Holder &a, const Holder &b) { return a.maxHold > b.maxHold; });
+    if (lock.holders.size() > maxHolders) lock.holders.resize(maxHolders);
+  }
+
+  std::sort(locks.begin(), locks.end(), [](const Lock &a, const Lock &b) { return a.totalWait > b.totalWait; });
+}
+
+} // namespace lockstats
+#endif
+
 Version Version::parse(const char *versionStr) {
   Version version;
   version.major = atoi(versionStr);
@@ -666,11 +1236,12 @@ Version Version::parse(const char *versionStr) {
 #endif
 
 bool init() {
+  if (!asynclog::start()) return false;
   if (dirExists(TMP_DIR, nullptr) || !mkdir(TMP_DIR, 0700)) return true;
   err << "failed to create temporary directory " << "'" << TMP_DIR << "'" << err.endl();
   return false;
 }
 
-void deinit() {}
+void deinit() { asynclog::stop(); }
 
 } // namespace tools
@@ -210,6 +210,61 @@ public:
   ~SharedMutex();
 };
 
+//
+// Lock Statistics (make LOCK_STATS=1)
+//
+// LockGuard and SharedLockGuard record acquisitions, wait and hold
+// times per lock and call site. The web plugin shows them at /lockstats.
+// Without LOCK_STATS all of this compiles to nothing.
+//
+
+#ifdef LOCK_STATS
+namespace lockstats {
+
+constexpr size_t NUM_BUCKETS = 40;        // Log2 of nanoseconds, the last one is open-ended
+constexpr uint64_t CONTENDED_WAIT = 1000; // Waits from 1 us on count as contended
+
+struct Holder {
+  const char *file;
+  int line;
+  uint64_t acquisitions;
+  uint64_t totalHold; // Nanoseconds
+  uint64_t maxHold;
+};
+
+struct Lock {
+  const void *lock;
+  std::string name; // See SetLockName()
+  uint64_t acquisitions;
+  uint64_t sharedAcquisitions;
+  uint64_t contended;
+  uint64_t totalWait; // Nanoseconds
+  uint64_t maxWait;
+  uint64_t totalHold;
+  uint64_t maxHold;
+  uint64_t waitHistogram[NUM_BUCKETS];
+  uint64_t holdHistogram[NUM_BUCKETS];
+  std::vector<Holder> holders; // Longest maximum hold time first
+};
+
+void record(const void *lock, const char *file, const int line, const bool shared, const uint64_t wait,
+            const uint64_t hold);
+void setName(const void *lock, const char *name);
+
+// Longest total wait time first
+void collect(std::vector<Lock> &locks, const size_t maxHolders);
+
+} // namespace lockstats
+
+uint64_t getNanoSeconds();
+
+#define SetLockName(lock, name) lockstats::setName(lock, name)
+#define LOCK_SITE , __FILE__, __LINE__
+#else
+#define SetLockName(lock, name) do { (void)(lock); } while (0)
+#define LOCK_SITE
+#endif
+
 #ifdef SHARED_MUTEX_SUPPORTED
 template <typename T> void lockShared(T &m) { return m.lock_shared(); }
 template <typename T> void unlockShared(T &m) { return m.unlock_shared(); }
@@ -218,12 +273,78 @@ template <typename T> void lockShared(T &m) { return m.lock(); }
 template <typename T> void unlockShared(T &m) { return m.unlock(); }
 #endif
 
+#ifdef SHARED_MUTEX_SUPPORTED
+template <typename T>
+struct SharedLockGuardImpl {
+private:
+  T data;
+public:
+  void lock() {
+    if (data) data->lock_shared();
+  }
+
+  void unlock() {
+    if (data) data->unlock_shared();
+  }
+
+  T get() const { return data; }
+
+  SharedLockGuardImpl(T data) : data(data) { }
+};
+#endif
+
+#ifdef LOCK_STATS
+// Shared lock guards are recorded for the lock they wrap
+template <typename T> const void *getLockID(T data) { return data; }
+template <typename T> bool isSharedLock(T) { return false; }
+#ifdef SHARED_MUTEX_SUPPORTED
+template <typename T> const void *getLockID(SharedLockGuardImpl<T> *data) { return data->get(); }
+template <typename T> bool isSharedLock(SharedLockGuardImpl<T> *) { return true; }
+#endif
+#endif
+
 template <typename T, bool inverse = false>
 class LockGuard {
 private:
   T data;
+#ifdef LOCK_STATS
+  const char *file;
+  int line;
+  uint64_t acquired;
+  uint64_t wait;
+#endif
 
 public:
+#ifdef LOCK_STATS
+  // Unlock guards (inverse) are not recorded
+  LockGuard(T data, const char *file = nullptr, const int line = 0)
+      : data(data), file(file), line(line), acquired(0), wait(0) {
+    if (!data) return;
+
+    if (inverse) {
+      data->unlock();
+      return;
+    }
+
+    const uint64_t start = getNanoSeconds();
+    data->lock();
+    acquired = getNanoSeconds();
+    wait = acquired - start;
+  }
+
+  ~LockGuard() {
+    if (!data) return;
+
+    if (inverse) {
+      data->lock();
+      return;
+    }
+
+    const uint64_t hold = getNanoSeconds() - acquired;
+    data->unlock();
+    lockstats::record(getLockID(data), file, line, isSharedLock(data), wait, hold);
+  }
+#else
   LockGuard(T data) : data(data) {
     if (!data) return;
     if (!inverse) data->lock();
@@ -235,35 +356,21 @@ public:
     if (!inverse) data->unlock();
     else data->lock();
   }
+#endif
 };
 
 #define LockGuard(data) \
-  LockGuard<decltype(data)> CONC(__lg, __COUNTER__)(data)
+  LockGuard<decltype(data)> CONC(__lg, __COUNTER__)(data LOCK_SITE)
 
 #define UnlockGuard(data) \
   LockGuard<decltype(data), true> CONC(__ulg, __COUNTER__)(data)
 
 #ifdef SHARED_MUTEX_SUPPORTED
-template <typename T>
-struct SharedLockGuardImpl {
-private:
-  T data;
-public:
-  void lock() {
-    if (data) data->lock_shared();
-  }
-
-  void unlock() {
-    if (data) data->unlock_shared();
-  }
-
-  SharedLockGuardImpl(T data) : data(data) { }
-};
 
 #define SharedLockGuard(data)                                                                                          \
   SharedLockGuardImpl<decltype(data)> CONC(__slg_tmp, __LINE__)(data);                                                 \
   LockGuard<SharedLockGuardImpl<decltype(data)> *>                                                                     \
-      CONC(__slg, __COUNTER__)(&CONC(__slg_tmp, __LINE__))
+      CONC(__slg, __COUNTER__)(&CONC(__slg_tmp, __LINE__) LOCK_SITE)
 
 #define SharedUnlockGuard(data)                                                                                        \
   SharedLockGuardImpl<decltype(data)> CONC(__sulg_tmp, __LINE__)(data);                                                \
@@ -308,6 +415,8 @@ public:
   bool isSet() const { return valAssigned; }
   T getVal() const { return val; }
   T operator*() const { return getVal(); }
+  bool operator==(const ExtVar &in) const { return valAssigned == in.valAssigned && (!valAssigned || val == in.val); }
+  bool operator!=(const ExtVar &in) const { return !(*this == in); }
 };
 
 template<typename T>
@@ -651,6 +760,8 @@ public:
   bool match(const CString &inVal) const;
   bool isSet() const { return valAssigned; }
   size_t valLength() const { return val.length(); }
+  const CString &getVal() const { return val; }
+  StrCmpOp getOp() const { return op; }
 
   static StrCmpOp getOperator(CString2 &val, const StrCmpOp fallback = STRCMP_OP_DEFAULT_EQ);
 
@@ -719,6 +830,7 @@ template <size_t size = 0> struct ArgParser {
 
 bool readFile(const CString &file, std::string &buf);
 bool writeFile(const CString &file, const std::string &content);
+bool writeFileAtomically(const CString &file, const std::string &content);
 
 const char *convertCubeToUTF8(const CString &str, char *buf, const size_t size);
 const char *convertUTF8ToCube(const CString &str, char *buf, const size_t size);
@@ -759,6 +871,26 @@ const char *getFileExtension(const CString &fileName);
 bool fileExists(const CString &fileName, struct stat *st = nullptr);
 static const auto &dirExists = &fileExists;
 
+// Read-only view of a whole file. Uses mmap() where available
+// and falls back to reading the file into memory otherwise.
+
+class MappedFile {
+private:
+  const char *mapping;
+  size_t mappingSize;
+  std::string buf;
+
+public:
+  const char *data() const { return mapping; }
+  size_t size() const { return mappingSize; }
+
+  bool open(const CString &file);
+  void close();
+
+  MappedFile() : mapping(), mappingSize() {}
+  ~MappedFile() { close(); }
+};
+
 //
 // Terminal text colors
 //
@@ -803,10 +935,56 @@ public:
   }
 };
 
+//
+// Asynchronous log
+//
+// Log lines are copied into a lock-free ring buffer of the calling
+// thread. A background thread (started by tools::init()) collects them
+// and writes them out in batches, one write() per file descriptor.
+// Lines are dropped and counted when a ring buffer is full.
+// err, warn and warninfo flush on every line end.
+// Before the log thread is started and after it was stopped, lines
+// are written synchronously.
+//
+
+namespace asynclog {
+
+constexpr int STDERR_FD = 2;
+
+// Appends a newline; the time stamp is added by the log thread
+void writeLine(const int fd, const bool timeStamp, const char *line, const size_t length);
+
+// Waits until all lines logged so far are written
+void flush();
+
+uint64_t getNumDropped();
+
+bool start();
+void stop();
+
+} // namespace asynclog
+
 //
 // Log helper
 //
 
+// Collects what is written to an ostream in a string
+class LineBuffer : public std::streambuf {
+public:
+  std::string line;
+
+protected:
+  int_type overflow(int_type c) override {
+    if (c != traits_type::eof()) line += static_cast<char>(c);
+    return c;
+  }
+
+  std::streamsize xsputn(const char *str, std::streamsize length) override {
+    line.append(str, length);
+    return length;
+  }
+};
+
 //
 // This class locks until EOL.
 // err << "xyz"; // Will cause a deadlock
@@ -814,19 +992,22 @@ public:
 //
 
 template <bool flushOnLineEnd = false, bool noop = false> class Message {
+private:
+  LineBuffer buffer;
+
 protected:
-  std::ostream &os;
+  std::ostream os;
+  const int fd;
 
 private:
   const char *msg;
   Color color;
+  bool timeStamp;
   bool printPrefix;
 
   virtual void lock() {}
   virtual void unlock() {}
 
-  virtual void printTimeStamp() {}
-
 public:
   friend class LockGuard<Message *>;
 
@@ -834,24 +1015,21 @@ public:
   bool isEndl(char c) { return c == '\n'; }
   template <typename T> bool isEndl(T &&) { return false; }
 
-  void flush() {
-    LockGuard(this);
-    os.flush();
-  }
+  void flush() { asynclog::flush(); }
 
   template <typename T> Message &operator<<(T &&v) {
     if (noop) return *this;
     LockGuard(this);
     if (printPrefix) {
       lock();
-      printTimeStamp();
       if (msg) os << color << msg << ": " << Color(FG_DEFAULT);
       printPrefix = false;
     }
     if (isEndl(v)) {
       printPrefix = true;
-      os << std::endl;
-      if (flushOnLineEnd) os.flush();
+      asynclog::writeLine(fd, timeStamp, buffer.line.data(), buffer.line.length());
+      buffer.line.clear();
+      if (flushOnLineEnd) flush();
       unlock();
     } else {
       os << v;
@@ -859,15 +1037,16 @@ public:
     return *this;
   }
 
-  Message(std::ostream &os) : os(os), msg(), color(COLOR_NONE), printPrefix(true) {}
- 
-  Message(const char *msg, Color color = FG_RED, std::ostream &os = std::cerr)
-    : os(os), msg(msg), color(color), printPrefix(true) {}
+  Message(const int fd, const bool timeStamp = false)
+    : os(&buffer), fd(fd), msg(), color(COLOR_NONE), timeStamp(timeStamp), printPrefix(true) {}
+
+  Message(const char *msg, Color color = FG_RED, const int fd = asynclog::STDERR_FD)
+    : os(&buffer), fd(fd), msg(msg), color(color), timeStamp(false), printPrefix(true) {}
 
   virtual ~Message() {}
 };
 
-class MessageLocked : public Message<> {
+template <bool flushOnLineEnd = false> class MessageLockedImpl : public Message<flushOnLineEnd> {
 private:
   std::recursive_mutex mutex;
 
@@ -876,28 +1055,25 @@ private:
 
 public:
 #ifdef INHERITING_CONSTRUCTORS_SUPPORTED
-  using Message::Message;
+  using Message<flushOnLineEnd>::Message;
 #else
-  MessageLocked(std::ostream &os) : Message(nullptr, COLOR_NONE, os) {}
-  MessageLocked(const char *msg, Color color = FG_RED, std::ostream &os = std::cerr) : Message(msg, color, os) {}
+  MessageLockedImpl(const int fd, const bool timeStamp = false) : Message<flushOnLineEnd>(fd, timeStamp) {}
+  MessageLockedImpl(const char *msg, Color color = FG_RED, const int fd = asynclog::STDERR_FD)
+    : Message<flushOnLineEnd>(msg, color, fd) {}
 #endif
 };
 
-class LogFileStream {
-private:
-  std::ofstream log;
-  friend class LogFile;
+typedef MessageLockedImpl<> MessageLocked;
+// Written before operator<<(endl()) returns, e.g. err right before abort()
+typedef MessageLockedImpl<true> MessageLockedSync;
 
+class LogFile : public MessageLocked {
 public:
-  LogFileStream(const char *file) : log(file, std::ofstream::app) {}
-};
+  // Complete line, does not take the lock
+  void writeLine(const std::string &line) { asynclog::writeLine(fd, true, line.data(), line.length()); }
 
-class LogFile : private LogFileStream, public MessageLocked {
-private:
-  void printTimeStamp();
-
-public:
   LogFile(const char *file);
+  ~LogFile();
 };
 
 #ifdef NDEBUG
@@ -906,11 +1082,11 @@ typedef Message<false, true> MessageDebug;
 typedef MessageLocked MessageDebug;
 #endif
 
-PLUGIN_IMPORT extern MessageLocked warn;
-PLUGIN_IMPORT extern MessageLocked err;
+PLUGIN_IMPORT extern MessageLockedSync warn;
+PLUGIN_IMPORT extern MessageLockedSync err;
 PLUGIN_IMPORT extern MessageDebug dbg;
 PLUGIN_IMPORT extern MessageLocked info;
-PLUGIN_IMPORT extern MessageLocked warninfo;
+PLUGIN_IMPORT extern MessageLockedSync warninfo;
 
 //
 // Time